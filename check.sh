@@ -0,0 +1,100 @@
+#!/bin/sh
+# Golden-output regression harness, run by `make check`.
+#
+# Defragments every image in input-disk-image/ with every engine, requires the
+# output to be byte-identical to the matching image in expected-output-disk-image/,
+# and times each run in microseconds. A run of the small sample images takes
+# only 10-40 ms, so the fastest of REPEAT runs is what is compared against the
+# time recorded in check-baseline.txt: the minimum of many runs is steady where
+# any single run is not. The check fails when it is slower by more than
+# TOLERANCE percent plus SLACK_MS, a small floor for timer and scheduler jitter.
+# Inputs and outputs live in a scratch directory in memory (/dev/shm when there
+# is one), so the times are of the program and not of the disk under it.
+#
+# Environment:
+#   ENGINES          engines to run (default: every engine in engines.sh)
+#   REPEAT           runs per engine and image (default 20)
+#   TOLERANCE        allowed slowdown over the baseline, in percent (default 25)
+#   SLACK_MS         slowdown always allowed, in milliseconds (default 3)
+#   UPDATE_BASELINE  set to 1 to rewrite check-baseline.txt with the measured times
+
+. ./engines.sh
+
+BIN=./disk-defrag
+BASELINE=check-baseline.txt
+ENGINES=${ENGINES:-$ALL_ENGINES}
+REPEAT=${REPEAT:-20}
+TOLERANCE=${TOLERANCE:-25}
+SLACK_MS=${SLACK_MS:-3}
+
+# Prints the current time in microseconds.
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+if [ -d /dev/shm ] && [ -w /dev/shm ]; then
+    tmp=$(mktemp -d -p /dev/shm) || exit 2
+else
+    tmp=$(mktemp -d) || exit 2
+fi
+trap 'rm -rf "$tmp"' EXIT
+: > "$tmp/times"
+failures=0
+
+for engine in $ENGINES; do
+    args=$(engine_args "$engine") || exit 2
+    for input in input-disk-image/disk-frag-[0-9]*; do
+        case "$input" in *.txt) continue ;; esac
+        name=$(basename "$input")
+        cp "$input" "$tmp/$name" || exit 2
+        input="$tmp/$name"
+        expected=expected-output-disk-image/disk-defrag-${name##*-}
+        output="$tmp/$engine-$name"
+        baseline=$(awk -v e="$engine" -v n="$name" '$1 == e && $2 == n { print $3 }' "$BASELINE" 2>/dev/null)
+        limit=$((${baseline:-0} + ${baseline:-0} * TOLERANCE / 100 + SLACK_MS * 1000))
+        best=
+        run=0
+        # a time over the limit gets a second round of REPEAT runs before it
+        # counts, so a slow spell of the host alone doesn't fail the check
+        while [ "$run" -lt "$REPEAT" ] || { [ "$run" -lt $((REPEAT * 2)) ] && [ -n "$baseline" ] && [ "$best" -gt "$limit" ]; }; do
+            start=$(now_us)
+            # shellcheck disable=SC2086
+            if ! $BIN $args --output="$output" "$input" > "$tmp/log" 2>&1; then
+                echo "FAIL $engine $name: exited with an error"
+                cat "$tmp/log"
+                failures=$((failures + 1))
+                continue 2
+            fi
+            elapsed=$(($(now_us) - start))
+            if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+                best=$elapsed
+            fi
+            run=$((run + 1))
+        done
+        if ! cmp -s "$output" "$expected"; then
+            echo "FAIL $engine $name: output differs from $expected"
+            $BIN diff "$expected" "$output"
+            failures=$((failures + 1))
+            continue
+        fi
+        echo "$engine $name $best" >> "$tmp/times"
+        if [ -z "$baseline" ]; then
+            echo "PASS $engine $name: ${best} us (no baseline)"
+        elif [ "$best" -gt "$limit" ]; then
+            echo "FAIL $engine $name: ${best} us, baseline ${baseline} us (+${TOLERANCE}% +${SLACK_MS} ms allowed)"
+            failures=$((failures + 1))
+        else
+            echo "PASS $engine $name: ${best} us, baseline ${baseline} us"
+        fi
+    done
+done
+
+if [ "${UPDATE_BASELINE:-0}" = 1 ]; then
+    sort "$tmp/times" > "$BASELINE"
+    echo "updated $BASELINE"
+fi
+if [ "$failures" -ne 0 ]; then
+    echo "$failures check(s) failed"
+    exit 1
+fi
+echo "all checks passed"
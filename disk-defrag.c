@@ -1,707 +1,8425 @@
-//Zachary A Taylor
-
-/**
-*@file disk-defrag.c
-*@author Zachary Taylor
-*This program takes a single parameter representing a fragmented
-*disk image and returns a defragmented version of it
-*/
- 
-
-#include <stdlib.h>
-#include <stdio.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <string.h>
-
-/**The number of members that are read from/written to a file in
- * calls to fread and fwrite
- */
-#define RW_NMEMB 1
-/**The size of a superblock, as defined in the problem statement */
-#define SUPERBLOCK_SIZE 512
-/**The size of the boot block, as defined in the problem statement */
-#define BOOT_BLOCK_SIZE 512
-/**The size of an inode in bytes, as defined in the problem statement */
-#define INODE_SIZE 100
-/**Macro that indicates a given inode is unused */
-#define UNUSED_INODE_SENTINEL -1
-/**Macro used to zero out a free data block in regions beyond the initial
- *four bytes used as a pointer
- */
-#define FREE_BLOCK_ZERO 0
-/** The maximum number of direct pointers an inode can have */
-#define N_DBLOCKS 10
-/** The maximum number of single-indirect pointers an inode can have */
-#define N_IBLOCKS 4
-/** Macro used in calls to defrag to indicate that no recursion is needed */
-#define ZERO_LEVELS 0
-/** Macro used in calls to defrag to indicate that one level of recursion is needed */
-#define ONE_LEVEL 1
-/** Macro used in calls to defrag to indicate that two levels of recursion is needed */
-#define TWO_LEVELS 2
-/** Macro used in calls to defrag to indicate that three levels recursion is needed */
-#define THREE_LEVELS 3
-
-/**
- * Defines an inode in the inode region of a disk.
- * An unused inode's next_inode field will point to 
- * the next free inode, whereas an inode being used
- * will not have this value be used at all
- */
-typedef struct
-{
-    int next_inode;         /* list for free inodes */
-    int protect;            /*  protection field */
-    int nlink;              /* Number of links to this file */
-    int size;               /* Number of bytes in file */
-    int uid;                /* Owner's user ID */
-    int gid;                /* Owner's group ID */
-    int ctime;              /* Time field */
-    int mtime;              /* Time field */
-    int atime;              /* Time field */
-    int dblocks[N_DBLOCKS]; /* Pointers to data blocks */
-    int iblocks[N_IBLOCKS]; /* Pointers to indirect blocks */
-    int i2block;            /* Pointer to doubly indirect block */
-    int i3block;            /* Pointer to triply indirect block */
-} inode;
-
-/**
- * Defines a superblock that is part of disk image
- * A superblock is 512 bytes in size
- */
-typedef struct
-{
-    int blocksize;    /* size of blocks in bytes */
-    int inode_offset; /* offset of inode region in blocks */
-    int data_offset;  /* data region offset in blocks */
-    int swap_offset;  /* swap region offset in blocks */
-    int free_inode;   /* head of free inode list */
-    int free_block;   /* head of free block list */
-} superblock;
-
-//----------------------
-// Global: error_msg
-//----------------------
-
-/**
- * Function that prints an error message and exits the program
- * @param msg the message to print
- */
-void error_msg(char *msg)
-{
-    printf("%s\n", msg);
-    exit(EXIT_FAILURE);
-}
-
-//-----------------------
-// Global: getValidInodes
-//-----------------------
-
-/**
- * Function that determines which inodes are being used on disk, and which are not
- * @param inodeOffset offset into the inode region
- * @param dataOffset offset into the data region
- * @param inodeSize the size of an inode
- * @param blockSize the size of a block
- * @param buffer pointer to memory region representing the disk itself
- * @return a pointer to a block of integers in memory whose values at each index refer to 
- * inode start addresses in the buffer
- */
-int *getValidInodes(int inodeOffset, int dataOffset, int inodeSize, int blockSize, char *buffer)
-{
-    //total number of valid inodes
-    int numValidInodes = 0;
-    //the total possible number of inodes in the region
-    int totalInodes = ((dataOffset - inodeOffset) * blockSize) / inodeSize;
-    //will store the locations of valid inodes
-    int *inodeLocations = malloc(totalInodes * sizeof(int));
-    //for loop iteration variable
-    int m;
-    //get number of valid inodes
-    for (m = 0; m < totalInodes; m++)
-    {
-        //address/index into buffer
-        //get starting address of the inodeRegion
-        int inodeStart = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (inodeOffset * blockSize);
-
-        //get specific address of beginning of an inode
-        int inodeAddr = inodeStart + (m * inodeSize);
-        //cast thing at this location to an inode pointer
-        inode *i = (inode *)(&(buffer[inodeAddr]));
-        //indicates an inode that's in use
-        if (i->nlink > 0)
-        {
-            numValidInodes++;
-            inodeLocations[m] = inodeAddr;
-        }
-        else
-        {
-            inodeLocations[m] = UNUSED_INODE_SENTINEL;
-        }
-    }
-    //allocate enough space for the number of valid inodes' starting indices in the buffer (these'll be integers)
-    //also, allocate one space at the end of the malloc'd region for storing a sentinel value
-    int *validInodeLocations = (int *)malloc(sizeof(int) * (numValidInodes + 1));
-
-    //malloc fail condition
-    if (validInodeLocations == NULL)
-    {
-        error_msg("Allocating memory for inode locations failed.\n");
-    }
-
-    //iterate through inodeLocations array, taking valid entries and putting their values in validInodeLocations
-    //block of allocated memory
-
-    //iteration variable for validInodeLocations
-    int k = 0;
-    for (m = 0; m < totalInodes; m++)
-    {
-        if (inodeLocations[m] != UNUSED_INODE_SENTINEL)
-        {
-            validInodeLocations[k] = inodeLocations[m];
-            k++;
-        }
-    }
-    //fill last location of validInodeLocations with sentinel value
-    validInodeLocations[k] = UNUSED_INODE_SENTINEL;
-
-    //free unused variables
-    free(inodeLocations);
-
-    //return the pointer to the caller
-    return validInodeLocations;
-}
-
-//------------------------
-// Global: zeroFreeBlock
-//------------------------
-
-/**
- * Function that zeroes out all but the first four bytes
- * of a free data block
- * @param freeBlockAddr starting address of the free block (i.e. pointer to first 4 bytes)
- * @param blocksize the size of a block on disk
- * @param buffer the buffer to examine representing disk image
- */
-void zeroFreeBlock(int freeBlockAddr, int blocksize, char *buffer)
-{
-    //iteration variable
-    int i = 1;
-    //number of four-bytes segments to clear
-    int numSegments = blocksize / sizeof(int);
-    for (i = 1; i < numSegments; i++)
-    {
-        int *currAddr = (int *)(&buffer[freeBlockAddr + (i * sizeof(int))]);
-        *currAddr = FREE_BLOCK_ZERO;
-    }
-}
-
-//------------------------
-// Global: defrag
-//------------------------
-
-/**
- * Function that recursively defragments a given disk image by updating
- * the data blocks an inode points to.
- * @param buffer pointer to the old buffer
- * @param newBuffer pointer to the new buffer to modify
- * @param levels the number of levels of recursion to perform
- * @param blocksize the size of a data block
- * @param dataRegStartOffset the start of the data region in the original buffer (in blocks)
- * @param dataRegCurrOffset the current offset into the data region (in blocks)
- * @param inodeLocation the address in the inode region that currInode is at
- * @param nextFreeGroup integer pointer holding value of next free group of data blocks
- * @return an integer value indicating an offset (in blocks) into the data region; this offset
- * is useful for the original caller of the function, but not so for recursive calls; instead,
- * dataRegCurrOffset will be used in the recursive situation and incremented as blocks are filled in.
- * When recusion reaches its base case, the value returned then will be the one the original caller
- * of the function receives.
- */
-int defrag(char *buffer, char *newBuffer, int levels, int blocksize, int dataRegStartOffset, int dataRegCurrOffset, int inodeLocation, int *nextFreeGroup)
-{
-    //cast the thing at inodeLocation in buffer to a proper inode
-    inode currInode = *(inode *)(&buffer[inodeLocation]);
-
-    //figure out address of next group of free data blocks
-    *nextFreeGroup = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * dataRegCurrOffset);
-
-    //recusion base case
-    if (levels == 0)
-    {
-        //iteration variable
-        int i = 0;
-        for (i = 0; i < N_DBLOCKS; i++)
-        {
-            if (currInode.dblocks[i] != UNUSED_INODE_SENTINEL)
-            {
-                //get data block number in the original buffer to copy
-                int blockIdx = currInode.dblocks[i];
-                //use blockIdx to get the address of that data block in original buffer
-                int blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * blockIdx);
-                //copy the data there to the next available block in the newBuffer
-                memcpy(&newBuffer[*nextFreeGroup], &buffer[blockAddr], blocksize);
-                //change inode content in original buffer to reflect new direct data block pointer(s)
-                inode *k = (inode *)(&buffer[inodeLocation]);
-                k->dblocks[i] = dataRegCurrOffset;
-                //increment currentOffset into the data region to indicate a block was used and is no longer free
-                dataRegCurrOffset++;
-                //increment nextFreeGroup variable to give memory address of next free block in new buffer
-                *nextFreeGroup += blocksize;
-            }
-        }
-
-        //copy modified inode content to desired memory location in newBuffer's inode region
-        memcpy(&newBuffer[inodeLocation], &buffer[inodeLocation], INODE_SIZE);
-    }
-    else if (levels == 1)
-    {
-        //make recursive call beforehand to make sure DBLOCKS are placed first
-        dataRegCurrOffset = defrag(buffer, newBuffer, levels - 1, blocksize, dataRegStartOffset, dataRegCurrOffset, inodeLocation, nextFreeGroup);
-        //iteration variable
-        int i = 0;
-        for (i = 0; i < N_IBLOCKS; i++)
-        {
-            if (currInode.iblocks[i] != UNUSED_INODE_SENTINEL)
-            {
-                //copy the block representing iblock into position in front of the data blocks it points to in the new image
-                //get data block number in the original buffer to copy
-                int blockIdx = currInode.iblocks[i];
-                //use blockIdx to get the address of that indirect block in original buffer
-                int blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * blockIdx);
-                //copy this to the next free location in newBuffer's data blocks
-                memcpy(&newBuffer[*nextFreeGroup], &buffer[blockAddr], blocksize);
-                //retain address of this iblock for use later
-                int iblockAddr = *nextFreeGroup;
-                //change inode content in original buffer to reflect new indirect data block pointer(s)
-                inode *k = (inode *)(&buffer[inodeLocation]);
-                k->iblocks[i] = dataRegCurrOffset;
-
-                //increment currentOffset into the data region to indicate a block was used and is no longer free
-                dataRegCurrOffset++;
-                //update nextFreeGroup to have address of next free block
-                *nextFreeGroup += blocksize;
-
-                //iterate through this indirect block, figuring out which four byte segments have integer
-                //values corresponding to data blocks
-
-                //maximum number of direct blocks that can be pointed to by one indirect block
-                int maxNumDirectBlocks = blocksize / sizeof(int);
-                //iteration variable
-                int j = 0;
-                for (j = 0; j < maxNumDirectBlocks; j++)
-                {
-                    //dbIdx == direct block index
-                    //dereferences explained: take the address of this iblock in the original buffer,
-                    //then add some multiple of a 4-byte (i.e. integer-sized) offset to it based on the
-                    //current iteration. Then, take the four bytes at a given offset and convert it to
-                    //an integer value and examine that value
-                    int dbIdx = *(int *)(&buffer[blockAddr + (j * sizeof(int))]);
-                    //copy the data block indicated by the given offset if valid
-                    if (dbIdx != UNUSED_INODE_SENTINEL)
-                    {
-                        //address of given data block
-                        int dbAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * dbIdx);
-                        memcpy(&newBuffer[*nextFreeGroup], &buffer[dbAddr], blocksize);
-                        //update indirect block at the particular index with the value of the data block offset it has now
-                        int *newBufferIblock = (int *)(&newBuffer[iblockAddr + sizeof(int) * j]);
-                        *newBufferIblock = dataRegCurrOffset;
-                        //increment currentOffset into newBuffer data region to indicate a block was used and is no longer free
-                        dataRegCurrOffset++;
-                        //update nextFreeGroup to have address of next free block in newBuffer
-                        *nextFreeGroup += blocksize;
-                    }
-                }
-            }
-        }
-        //copy modified inode content to desired memory location in newBuffer's inode region
-        memcpy(&newBuffer[inodeLocation], &buffer[inodeLocation], INODE_SIZE);
-    }
-    else if (levels == 2)
-    {
-        //make recursive call to place DBLOCKS and IBLOCKS before doing anything else
-        dataRegCurrOffset = defrag(buffer, newBuffer, levels - 1, blocksize, dataRegStartOffset, dataRegCurrOffset, inodeLocation, nextFreeGroup);
-        //if i2block is being used
-        if (currInode.i2block != UNUSED_INODE_SENTINEL)
-        {
-            //get location of i2 block as an offset into data region of original buffer
-            int blockIdx = currInode.i2block;
-            //use blockIdx to get the address of that data block in original buffer
-            int blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * blockIdx);
-            //copy the i2block to the next free block in newBuffer
-            memcpy(&newBuffer[*nextFreeGroup], &buffer[blockAddr], blocksize);
-
-            //change inode content in original buffer to reflect new i2block pointer values
-            inode *k = (inode *)(&buffer[inodeLocation]);
-            k->i2block = dataRegCurrOffset;
-
-            //save address of start of i2block for easy updating in newBuffer loops later on
-            int i2StartAddr = *nextFreeGroup;
-
-            //increment nextFreeGroup and dataRegCurrOffset as usual
-            *nextFreeGroup += blocksize;
-            dataRegCurrOffset++;
-
-            //compute maximum possible number of references to indirect blocks in an i2block
-            int maxIblockRefs = blocksize / sizeof(int);
-            //iteration variable
-            int i = 0;
-            //go through i2 block, taking valid pointers to i blocks and then data blocks, etc.
-            for (i = 0; i < maxIblockRefs; i++)
-            {
-                //indirect block idx
-                //start of i2block address plus some 4-byte multiple offset
-                int iblockIdx = *(int *)(&buffer[blockAddr + (sizeof(int) * i)]);
-                if (iblockIdx != UNUSED_INODE_SENTINEL)
-                {
-                    //get iblock starting address in buffer based on value of iblockIdx
-                    int iblockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * iblockIdx);
-
-                    //copy iblock into newBuffer before copying its data blocks
-                    memcpy(&newBuffer[*nextFreeGroup], &buffer[iblockAddr], blocksize);
-
-                    //get start address of this particular iblock in newBuffer so you can update it later
-                    int iblockStartAddr = *nextFreeGroup;
-
-                    //update i2block pointer value in newBuffer to show new location of this iblock
-                    int *update = (int *)(&newBuffer[i2StartAddr + (sizeof(int) * i)]);
-                    *update = dataRegCurrOffset;
-
-                    //update nextFreeGroup and dataRegCurrOffset
-                    *nextFreeGroup += blocksize;
-                    dataRegCurrOffset++;
-
-                    //maximum number of data block references per indirect block
-                    int maxDbPtrs = maxIblockRefs;
-                    //iteration variable
-                    int j = 0;
-                    //go through iblock, getting valid direct block pointers
-                    for (j = 0; j < maxDbPtrs; j++)
-                    {
-                        //index into a particular location in this iblock in original buffer
-                        int dbIdx = *(int *)(&buffer[iblockAddr + sizeof(int) * j]);
-                        //copy data block at given location if it's valid
-                        if (dbIdx != UNUSED_INODE_SENTINEL)
-                        {
-                            //address of the data block that dbIdx is referring to
-                            int dbAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * dbIdx);
-
-                            //copy the data block at this address to the next free location in newBuffer
-                            memcpy(&newBuffer[*nextFreeGroup], &buffer[dbAddr], blocksize);
-
-                            //update this inode's contents in newBuffer
-                            int *update = (int *)(&newBuffer[iblockStartAddr + sizeof(int) * j]);
-                            *update = dataRegCurrOffset;
-
-                            //update nextFreeGroup and dataRegCurrOffset
-                            *nextFreeGroup += blocksize;
-                            dataRegCurrOffset++;
-                        }
-                    }
-                }
-            }
-        }
-        //copy modified inode content to desired memory location in newBuffer's inode region
-        memcpy(&newBuffer[inodeLocation], &buffer[inodeLocation], INODE_SIZE);
-    }
-    else
-    {
-        //make recursive call with levels == one less than previous value
-        dataRegCurrOffset = defrag(buffer, newBuffer, levels - 1, blocksize, dataRegStartOffset, dataRegCurrOffset, inodeLocation, nextFreeGroup);
-        //if i3block is being used
-        if (currInode.i3block != UNUSED_INODE_SENTINEL)
-        {
-            //get location of i3 block as an offset into data region of original buffer
-            int blockIdx = currInode.i3block;
-            //use blockIdx to get the address of that data block in original buffer
-            int blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * blockIdx);
-            //copy the i3block to the next free block in newBuffer
-            memcpy(&newBuffer[*nextFreeGroup], &buffer[blockAddr], blocksize);
-            //change inode content in original buffer to reflect new i3 pointer value
-            inode *k = (inode *)(&buffer[inodeLocation]);
-            k->i3block = dataRegCurrOffset;
-
-            //save address of start of i3block for easy updating in newBuffer loops later on
-            int i3blockStartAddr = *nextFreeGroup;
-
-            //increment nextFreeGroup and dataRegCurrOffset as usual
-            *nextFreeGroup += blocksize;
-            dataRegCurrOffset++;
-
-            //compute maximum possible number of references to doubly indirect blocks in an i3block
-            int maxI2blockRefs = blocksize / sizeof(int);
-            //iteration variable
-            int m = 0;
-            //go through i3 block, taking valid pointers to i2 blocks, then iblocks, then data blocks, etc.
-            for (m = 0; m < maxI2blockRefs; m++)
-            {
-                //doubly indirect block index
-                //i3block start address plus some 4-byte multiple offset
-                int i2blockIdx = *(int *)(&buffer[blockAddr + (sizeof(int) * m)]);
-                if (i2blockIdx != UNUSED_INODE_SENTINEL)
-                {
-                    //get i2block starting address in buffer based on value of i2blockIdx
-                    int i2blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * i2blockIdx);
-
-                    //copy i2block into newBuffer before copying its indirect blocks
-                    memcpy(&newBuffer[*nextFreeGroup], &buffer[i2blockAddr], blocksize);
-
-                    //get start address of this particular i2block in newBuffer so you can update it later
-                    int i2blockStartAddr = *nextFreeGroup;
-
-                    //update i3block pointer value in newBuffer to show new location of this i2block
-                    int *update = (int *)(&newBuffer[i3blockStartAddr + sizeof(int) * m]);
-                    *update = dataRegCurrOffset;
-
-                    //update nextFreeGroup and dataRegCurrOffset
-                    *nextFreeGroup += blocksize;
-                    dataRegCurrOffset++;
-
-                    //maximum number of indirect references per doubly indirect block
-                    int maxIbPtrs = maxI2blockRefs;
-                    //iteration variable
-                    int i = 0;
-                    for (i = 0; i < maxIbPtrs; i++)
-                    {
-                        //indirect block index
-                        //i2block starting address plus some 4-byte multiple offset
-                        int iblockIdx = *(int *)(&buffer[i2blockAddr + sizeof(int) * i]);
-                        if (iblockIdx != UNUSED_INODE_SENTINEL)
-                        {
-                            //get iblock starting address in buffer based on iblockIdx
-                            int iblockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * iblockIdx);
-
-                            //copy iblock into newBuffer before copying its direct blocks
-                            memcpy(&newBuffer[*nextFreeGroup], &buffer[iblockAddr], blocksize);
-
-                            //get starting address of this particular iblock in newBuffer so you can update it later
-                            int iblockStartAddr = *nextFreeGroup;
-
-                            //update i2block pointer value in newBuffer to show new location of this iblock
-                            int *i2Update = (int *)(&newBuffer[i2blockStartAddr + sizeof(int) * i]);
-                            *i2Update = dataRegCurrOffset;
-
-                            //update nextFreeGroup and dataRegCurrOffset
-                            *nextFreeGroup += blocksize;
-                            dataRegCurrOffset++;
-
-                            //maximum number of direct references per indirect block
-                            int maxDbPtrs = maxIbPtrs;
-                            //iteration variable
-                            int v = 0;
-                            for (v = 0; v < maxDbPtrs; v++)
-                            {
-                                //direct block index
-                                //indirect block starting address pluse some 4-byte multiple offset
-                                int dBlockIdx = *(int *)(&buffer[iblockAddr + sizeof(int) * v]);
-                                //if index is valid, copy the given data block
-                                if (dBlockIdx != UNUSED_INODE_SENTINEL)
-                                {
-                                    //get data block startind address in buffer based on dBlockIdx
-                                    int dblockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * dBlockIdx);
-
-                                    //copy data block into newBuffer before copying its direct block
-                                    memcpy(&newBuffer[*nextFreeGroup], &buffer[dblockAddr], blocksize);
-                                    //update iblock pointer value in newBuffer to show new location of this dblock
-                                    int *iUpdate = (int *)(&newBuffer[iblockStartAddr + sizeof(int) * v]);
-                                    *iUpdate = dataRegCurrOffset;
-
-                                    //update nextFreeGroup and dataRegCurrOffset
-                                    *nextFreeGroup += blocksize;
-                                    dataRegCurrOffset++;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        //copy modified inode content to desired memory location in newBuffer's inode region
-        memcpy(&newBuffer[inodeLocation], &buffer[inodeLocation], INODE_SIZE);
-    }
-
-    return dataRegCurrOffset;
-}
-
-//-----------------------
-// Global: main
-//-----------------------
-
-/**
- * Main entry point of the program
- * @param argc the number of arguments given
- * @param argv array of pointers to first character of 
- * each space-separated command-line argument
- * @return 0 on successful exit of the program and a different value
- * upon non-successful exit.
- */
-int main(int argc, char *argv[])
-{
-    //check that number of arguments is valid
-    if (argc != 2)
-    {
-        error_msg("Invalid number of command line arguments!");
-    }
-
-    //Steps: read in disk image, then get size of disk image using stat() system call
-
-    // stat struct that will hold information about file
-    struct stat fileInfo;
-    
-    int rc = stat(argv[1], &fileInfo);
-    //error-handling for file having invalid stat() return
-    if (rc != 0)
-    {
-        error_msg("Error determing disk image size.");
-    }
-
-    //  allocate enough space for the disk image
-    //file pointer
-    FILE *f;
-    //open file for reading
-    f = fopen(argv[1], "r");
-    //error for invalid file pointer
-    if (f == NULL)
-    {
-        error_msg("Error reading disk image file.");
-    }
-    //number of disk-sized members read from disk image
-    size_t numMembers;
-    //allocate char * buffer of size of the disk image file
-    char *buffer = malloc(fileInfo.st_size);
-    //read in the disk image file - fread returns the number of disk image-sized things it read in from the file
-    numMembers = fread(buffer, fileInfo.st_size, RW_NMEMB, f);
-    if (numMembers != 1)
-    {
-        error_msg("Error reading disk image file");
-    }
-
-    // read in the superblock and relevant data
-    superblock *sb = (superblock *)&(buffer[SUPERBLOCK_SIZE]);
-    //size of blocks on disk
-    int blocksize = sb->blocksize;
-    //offset for inode region
-    int inodeOffset = sb->inode_offset;
-    //offset for data region
-    int dataOffset = sb->data_offset;
-    //offset for swap region
-    int swapOffset = sb->swap_offset;
-    //head of free inode list
-    int inodeListHead = sb->free_inode;
-    //head of free block list
-    int blockListHead = sb->free_block;
-
-    //inode region start address
-    int inodeRegionStart = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (inodeOffset * blocksize);
-    //data region start address
-    int dataRegionStart = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (dataOffset * blocksize);
-    //swap region start address
-    int swapRegionStart = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (swapOffset * blocksize);
-
-    //allocate a new buffer representing the new disk image
-    char *newBuffer = malloc(fileInfo.st_size);
-
-    //copy entire original buffer
-    memcpy(&newBuffer[0], &buffer[0], fileInfo.st_size);
-
-    //pointer returned that indicates locations (buffer indices) of the start location of valid inodes
-    int *validInodeLocations = getValidInodes(inodeOffset, dataOffset, INODE_SIZE, blocksize, buffer);
-
-    //iteration variable
-    int i = 0;
-    //calculate number of valid inodes
-    while (validInodeLocations[i] != UNUSED_INODE_SENTINEL)
-    {
-        i++;
-    }
-
-    //number of valid inodes
-    int numInodes = i;
-
-    //pointer holding address of next free group of data blocks
-    int *nextFreeGroup = malloc(sizeof(int));
-    *nextFreeGroup = dataRegionStart;
-    //current offset into data region (in blocks) of the new buffer representing the new disk image
-    int dataRegCurrOffset = 0;
-    //for each valid inode, examine the size of files and start process of defragmenting disk
-    for (i = 0; i < numInodes; i++)
-    {
-        //validInodeLocations[i] is location (buffer index) of start of i_th valid inode
-        //cast data at memory location of buffer[inodeIdx] to an inode ptr, then dereference
-        //to get a proper inode
-        inode currInode = *(inode *)(&buffer[validInodeLocations[i]]);
-
-        //see how many levels of recursion are required in defrag call
-        if (currInode.i3block != UNUSED_INODE_SENTINEL)
-        {
-            dataRegCurrOffset = defrag(buffer, newBuffer, THREE_LEVELS, blocksize, dataOffset, dataRegCurrOffset, validInodeLocations[i], nextFreeGroup);
-        }
-        else if (currInode.i2block != UNUSED_INODE_SENTINEL)
-        {
-            dataRegCurrOffset = defrag(buffer, newBuffer, TWO_LEVELS, blocksize, dataOffset, dataRegCurrOffset, validInodeLocations[i], nextFreeGroup);
-        }
-        else if (currInode.iblocks[0] != UNUSED_INODE_SENTINEL)
-        {
-            dataRegCurrOffset = defrag(buffer, newBuffer, ONE_LEVEL, blocksize, dataOffset, dataRegCurrOffset, validInodeLocations[i], nextFreeGroup);
-        }
-        else if (currInode.dblocks[0] != UNUSED_INODE_SENTINEL)
-        {
-            dataRegCurrOffset = defrag(buffer, newBuffer, ZERO_LEVELS, blocksize, dataOffset, dataRegCurrOffset, validInodeLocations[i], nextFreeGroup);
-        }
-    }
-
-    //Create a new free block list in the now defragmented disk
-
-    //the starting place/offset (in terms of blocks) of free block list from beginning of disk
-    int freeBlockListOffset = dataRegCurrOffset + dataOffset;
-    //takes place of dataRegCurrOffset in loop to allow for easy iteration
-    int currDrgOffset = dataRegCurrOffset;
-    //make a new free list starting from freeBlockListOffset
-    //calculate number of blocks between the current block and the
-    int numberOfFreeBlocks = swapOffset - freeBlockListOffset;
-    //base address of the free block list
-    int freeBlockBaseAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * freeBlockListOffset);
-    //current address in free block list
-    int freeBlockCurrAddr = freeBlockBaseAddr;
-    //iteration variable
-    i = 0;
-    for (i = 0; i < numberOfFreeBlocks; i++)
-    {
-        //get address of current free block
-        freeBlockCurrAddr = freeBlockBaseAddr + (blocksize * i);
-        //make a pointer to first four bytes of this address
-        int *freeBlockPtr = (int *)(&newBuffer[freeBlockCurrAddr]);
-        //next offset (relative to data block) that this block will point to
-        currDrgOffset++;
-        int nextOffset = currDrgOffset;
-        *freeBlockPtr = nextOffset;
-        //zero out the free block
-        zeroFreeBlock(freeBlockCurrAddr, blocksize, newBuffer);
-    }
-    //set thing at last address to -1 to show free list is at its end
-    int *freeBlockPtr = (int *)(&newBuffer[freeBlockCurrAddr]);
-    *freeBlockPtr = UNUSED_INODE_SENTINEL;
-
-    //update newBuffer's superblock to indicate that offset of free list has changed
-    superblock *nSB = (superblock *)(&newBuffer[SUPERBLOCK_SIZE]);
-    nSB->free_block = freeBlockListOffset - dataOffset;
-
-    //write new buffer out to a file named disk_defrag_k, where k is
-    //the number of the original disk image file -- use fwrite for this
-    FILE *newFile;
-    char * diskImageFile = argv[1];
-    char * diskImageFileNumPtr = &diskImageFile[strlen(diskImageFile) - 1];
-    char filename_part[FILENAME_MAX] = "output-disk-image/disk-defrag-";
-    char * filename = strcat(filename_part, diskImageFileNumPtr);
-    newFile = fopen(filename, "w");
-    fwrite(&newBuffer[0], fileInfo.st_size, RW_NMEMB, newFile);
-
-    //free resources
-    free(validInodeLocations);
-    free(buffer);
-    free(newBuffer);
-    free(nextFreeGroup);
-
-    return 0;
+//Zachary A Taylor
+
+/**
+*@file disk-defrag.c
+*@author Zachary Taylor
+*This program takes a single parameter representing a fragmented
+*disk image and returns a defragmented version of it
+*/
+ 
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+//USDT tracepoints in the disk_defrag provider, for bpftrace and perf; they
+//compile to nothing without <sys/sdt.h>, and cost a nop each when not traced
+#ifdef HAVE_USDT
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(disk_defrag, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(disk_defrag, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(disk_defrag, name, a, b, c)
+#else
+#define TRACE_PROBE1(name, a) ((void)0)
+#define TRACE_PROBE2(name, a, b) ((void)0)
+#define TRACE_PROBE3(name, a, b, c) ((void)0)
+#endif
+
+/**The number of members that are read from/written to a file in
+ * calls to fread and fwrite
+ */
+#define RW_NMEMB 1
+/**The size of a superblock, as defined in the problem statement */
+#define SUPERBLOCK_SIZE 512
+/**The size of the boot block, as defined in the problem statement */
+#define BOOT_BLOCK_SIZE 512
+/**The size of an inode in bytes, as defined in the problem statement */
+#define INODE_SIZE 100
+/**Macro that indicates a given inode is unused */
+#define UNUSED_INODE_SENTINEL -1
+/**Macro used to zero out a free data block in regions beyond the initial
+ *four bytes used as a pointer
+ */
+#define FREE_BLOCK_ZERO 0
+/** The maximum number of direct pointers an inode can have */
+#define N_DBLOCKS 10
+/** The maximum number of single-indirect pointers an inode can have */
+#define N_IBLOCKS 4
+/** Macro used in calls to defrag to indicate that no recursion is needed */
+#define ZERO_LEVELS 0
+/** Macro used in calls to defrag to indicate that one level of recursion is needed */
+#define ONE_LEVEL 1
+/** Macro used in calls to defrag to indicate that two levels of recursion is needed */
+#define TWO_LEVELS 2
+/** Macro used in calls to defrag to indicate that three levels recursion is needed */
+#define THREE_LEVELS 3
+/** The most worker threads any subcommand will start */
+#define MAX_THREADS 64
+
+/**
+ * Defines an inode in the inode region of a disk.
+ * An unused inode's next_inode field will point to 
+ * the next free inode, whereas an inode being used
+ * will not have this value be used at all
+ */
+typedef struct
+{
+    int next_inode;         /* list for free inodes */
+    int protect;            /*  protection field */
+    int nlink;              /* Number of links to this file */
+    int size;               /* Number of bytes in file */
+    int uid;                /* Owner's user ID */
+    int gid;                /* Owner's group ID */
+    int ctime;              /* Time field */
+    int mtime;              /* Time field */
+    int atime;              /* Time field */
+    int dblocks[N_DBLOCKS]; /* Pointers to data blocks */
+    int iblocks[N_IBLOCKS]; /* Pointers to indirect blocks */
+    int i2block;            /* Pointer to doubly indirect block */
+    int i3block;            /* Pointer to triply indirect block */
+} inode;
+
+/**
+ * Defines a superblock that is part of disk image
+ * A superblock is 512 bytes in size
+ */
+typedef struct
+{
+    int blocksize;    /* size of blocks in bytes */
+    int inode_offset; /* offset of inode region in blocks */
+    int data_offset;  /* data region offset in blocks */
+    int swap_offset;  /* swap region offset in blocks */
+    int free_inode;   /* head of free inode list */
+    int free_block;   /* head of free block list */
+} superblock;
+
+//----------------------
+// Global: error_msg
+//----------------------
+
+/**
+ * Function that prints an error message and exits the program
+ * @param msg the message to print
+ */
+void error_msg(char *msg)
+{
+    printf("%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+//-----------------------
+// Global: arena
+//-----------------------
+
+/**Size of the chunks an arena carves allocations out of; larger requests get a chunk of their own */
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+/**Alignment of every arena allocation */
+#define ARENA_ALIGN 16
+
+/**
+ * A chunk of memory an arena hands out allocations from, front to back
+ */
+typedef struct arenaChunk
+{
+    struct arenaChunk *next; /* the chunk filled before this one */
+    size_t size;             /* bytes of data */
+    size_t used;             /* bytes of data handed out */
+    char *last;              /* the most recent allocation, which can grow in place */
+    _Alignas(ARENA_ALIGN) char data[]; /* the memory handed out */
+} arenaChunk;
+
+/**
+ * A bump allocator for the scratch data of one planning or analysis pass:
+ * allocating is a pointer increment, nothing is freed on its own, and
+ * everything goes at once with arenaRelease. An arena belongs to one thread;
+ * parallel workers each take a sub-arena, so they never contend, and hand its
+ * chunks to the parent when done
+ */
+typedef struct
+{
+    arenaChunk *chunks; /* the chunk being filled, then the earlier ones */
+    size_t requested;   /* bytes asked for over the arena's life */
+} arena;
+
+/**
+ * Memory held by all arenas, updated only when a chunk is taken or released
+ * so threads filling their own arenas never touch it
+ */
+typedef struct
+{
+    size_t reserved; /* bytes of chunks held now */
+    size_t peak;     /* the most bytes of chunks held at once: the high-water mark */
+    size_t chunks;   /* chunks taken so far */
+    size_t requested; /* bytes asked for by arenas released so far */
+} arenaUsage;
+
+/**Memory held by all arenas of this run */
+arenaUsage arenaTotals = {0, 0, 0, 0};
+
+/**
+ * Function that sets up an empty arena; memory is only taken on the first allocation
+ * @param a the arena
+ */
+void arenaInit(arena *a)
+{
+    a->chunks = NULL;
+    a->requested = 0;
+}
+
+/**
+ * Function that hands out memory from an arena, taking a new chunk when the current one is full
+ * @param a the arena
+ * @param size the number of bytes
+ * @return the memory, aligned to ARENA_ALIGN bytes; never NULL
+ */
+void *arenaAlloc(arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    a->requested += size;
+    arenaChunk *c = a->chunks;
+    if (c == NULL || c->size - c->used < size)
+    {
+        size_t dataSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        c = malloc(sizeof(arenaChunk) + dataSize);
+        if (c == NULL)
+        {
+            error_msg("Allocating memory for an arena failed.");
+        }
+        c->size = dataSize;
+        c->used = 0;
+        //a chunk taken for one large request goes behind the current one, which may still have room
+        if (size > ARENA_CHUNK_SIZE && a->chunks != NULL)
+        {
+            c->next = a->chunks->next;
+            a->chunks->next = c;
+        }
+        else
+        {
+            c->next = a->chunks;
+            a->chunks = c;
+        }
+        size_t reserved = __atomic_add_fetch(&arenaTotals.reserved, dataSize, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&arenaTotals.chunks, 1, __ATOMIC_RELAXED);
+        //raise the high-water mark if this is the most held so far
+        size_t peak = __atomic_load_n(&arenaTotals.peak, __ATOMIC_RELAXED);
+        while (reserved > peak && !__atomic_compare_exchange_n(&arenaTotals.peak, &peak, reserved, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+    }
+    c->last = &c->data[c->used];
+    c->used += size;
+    return c->last;
+}
+
+/**
+ * Function that hands out zeroed memory from an arena
+ * @param a the arena
+ * @param count the number of elements
+ * @param size the size of each element
+ * @return the memory; never NULL
+ */
+void *arenaCalloc(arena *a, size_t count, size_t size)
+{
+    void *p = arenaAlloc(a, count * size);
+    memset(p, 0, count * size);
+    return p;
+}
+
+/**
+ * Function that grows an allocation from an arena, in place when it was the
+ * last one made from its chunk and the chunk has room, and otherwise by moving it
+ * @param a the arena
+ * @param p the allocation, or NULL to make a new one
+ * @param oldSize its size in bytes
+ * @param newSize the size it should have
+ * @return the grown allocation
+ */
+void *arenaGrow(arena *a, void *p, size_t oldSize, size_t newSize)
+{
+    arenaChunk *c = a->chunks;
+    size_t oldAligned = (oldSize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t newAligned = (newSize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (p != NULL && c != NULL && p == c->last && c->used - oldAligned + newAligned <= c->size)
+    {
+        c->used += newAligned - oldAligned;
+        a->requested += newAligned - oldAligned;
+        return p;
+    }
+    void *q = arenaAlloc(a, newSize);
+    if (p != NULL)
+    {
+        memcpy(q, p, oldSize);
+    }
+    return q;
+}
+
+/**
+ * Function that moves every chunk of a worker's sub-arena into its parent, so
+ * the parent's release frees both; the sub-arena is left empty
+ * @param parent the arena to take the chunks
+ * @param sub the sub-arena
+ */
+void arenaAdopt(arena *parent, arena *sub)
+{
+    if (sub->chunks != NULL)
+    {
+        arenaChunk *tail = sub->chunks;
+        while (tail->next != NULL)
+        {
+            tail = tail->next;
+        }
+        //the parent keeps filling its own current chunk
+        if (parent->chunks != NULL)
+        {
+            tail->next = parent->chunks->next;
+            parent->chunks->next = sub->chunks;
+        }
+        else
+        {
+            parent->chunks = sub->chunks;
+        }
+    }
+    parent->requested += sub->requested;
+    arenaInit(sub);
+}
+
+/**
+ * Function that frees everything allocated from an arena at once
+ * @param a the arena, which is left empty and can be used again
+ */
+void arenaRelease(arena *a)
+{
+    while (a->chunks != NULL)
+    {
+        arenaChunk *next = a->chunks->next;
+        __atomic_sub_fetch(&arenaTotals.reserved, a->chunks->size, __ATOMIC_RELAXED);
+        free(a->chunks);
+        a->chunks = next;
+    }
+    __atomic_add_fetch(&arenaTotals.requested, a->requested, __ATOMIC_RELAXED);
+    a->requested = 0;
+}
+
+/**
+ * Function that prints the high-water mark of the memory held by arenas
+ * @param out the stream to print to
+ */
+void reportArenaUsage(FILE *out)
+{
+    fprintf(out, "arena: high-water mark %.1f KiB in %lu chunks taken, %.1f KiB requested\n", arenaTotals.peak / 1024.0,
+            (unsigned long)arenaTotals.chunks, arenaTotals.requested / 1024.0);
+}
+
+//-----------------------
+// Global: getValidInodes
+//-----------------------
+
+/**
+ * Function that determines which inodes are being used on disk, and which are not
+ * @param inodeOffset offset into the inode region
+ * @param dataOffset offset into the data region
+ * @param inodeSize the size of an inode
+ * @param blockSize the size of a block
+ * @param buffer pointer to memory region representing the disk itself
+ * @param a the arena the result is allocated from
+ * @return a pointer to a block of integers in memory whose values at each index refer to 
+ * inode start addresses in the buffer
+ */
+int *getValidInodes(int inodeOffset, int dataOffset, int inodeSize, int blockSize, char *buffer, arena *a)
+{
+    //total number of valid inodes
+    int numValidInodes = 0;
+    //the total possible number of inodes in the region
+    int totalInodes = ((dataOffset - inodeOffset) * blockSize) / inodeSize;
+    //get starting address of the inodeRegion
+    int inodeStart = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (inodeOffset * blockSize);
+    //for loop iteration variable
+    int m;
+    //get number of valid inodes, so their locations can be stored without a scratch copy of every slot
+    for (m = 0; m < totalInodes; m++)
+    {
+        //cast thing at this location to an inode pointer
+        inode *i = (inode *)(&(buffer[inodeStart + (m * inodeSize)]));
+        //indicates an inode that's in use
+        if (i->nlink > 0)
+        {
+            numValidInodes++;
+        }
+    }
+    //allocate enough space for the number of valid inodes' starting indices in the buffer (these'll be integers)
+    //also, allocate one space at the end of the region for storing a sentinel value
+    int *validInodeLocations = arenaAlloc(a, sizeof(int) * (numValidInodes + 1));
+
+    //iteration variable for validInodeLocations
+    int k = 0;
+    for (m = 0; m < totalInodes; m++)
+    {
+        //get specific address of beginning of an inode
+        int inodeAddr = inodeStart + (m * inodeSize);
+        if (((inode *)(&(buffer[inodeAddr])))->nlink > 0)
+        {
+            validInodeLocations[k] = inodeAddr;
+            k++;
+        }
+    }
+    //fill last location of validInodeLocations with sentinel value
+    validInodeLocations[k] = UNUSED_INODE_SENTINEL;
+
+    //return the pointer to the caller
+    return validInodeLocations;
+}
+
+//------------------------
+// Global: zeroFreeBlock
+//------------------------
+
+/**
+ * Function that zeroes out all but the first four bytes
+ * of a free data block
+ * @param freeBlockAddr starting address of the free block (i.e. pointer to first 4 bytes)
+ * @param blocksize the size of a block on disk
+ * @param buffer the buffer to examine representing disk image
+ */
+void zeroFreeBlock(int freeBlockAddr, int blocksize, char *buffer)
+{
+    //iteration variable
+    int i = 1;
+    //number of four-bytes segments to clear
+    int numSegments = blocksize / sizeof(int);
+    for (i = 1; i < numSegments; i++)
+    {
+        int *currAddr = (int *)(&buffer[freeBlockAddr + (i * sizeof(int))]);
+        *currAddr = FREE_BLOCK_ZERO;
+    }
+}
+
+//------------------------
+// Global: hasValidPointer
+//------------------------
+
+/**
+ * Function that checks whether any of an inode's block pointers of one kind are in use
+ * @param ptrs the block pointers to check
+ * @param numPtrs the number of block pointers
+ * @return 1 if any pointer is in use, 0 otherwise
+ */
+int hasValidPointer(const int *ptrs, int numPtrs)
+{
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < numPtrs; i++)
+    {
+        if (ptrs[i] != UNUSED_INODE_SENTINEL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//-----------------------
+// Global: inodeTable
+//-----------------------
+
+/**Number of columns of an inode table: nlink, size, mtime and every block pointer */
+#define INODE_TABLE_COLUMNS (3 + N_DBLOCKS + N_IBLOCKS + 2)
+/**Rows of an inode table are padded to a multiple of this, so passes over a
+ * column run in groups of a fixed size, which the compiler turns into vector code */
+#define INODE_TABLE_GROUP 16
+
+/**
+ * The inode region decoded once into columns, one array per field, so passes
+ * over every inode read only the fields they need, contiguously, and compile
+ * to vector code. Row m of every column is inode m
+ */
+typedef struct
+{
+    int count;                /* number of inodes */
+    int rows;                 /* number of rows, a multiple of INODE_TABLE_GROUP; the padding holds unused inodes */
+    const char *records;      /* the inode region decoded, where the other fields of a re-encoded inode come from */
+    int *nlink;               /* number of links to each file */
+    int *size;                /* number of bytes in each file */
+    int *mtime;               /* modification time of each file */
+    int *dblocks[N_DBLOCKS];  /* each direct pointer slot */
+    int *iblocks[N_IBLOCKS];  /* each indirect pointer slot */
+    int *i2block;             /* the doubly indirect pointers */
+    int *i3block;             /* the triply indirect pointers */
+} inodeTable;
+
+//------------------------
+// Global: defrag
+//------------------------
+
+/**Number of block pointers the tree walk looks ahead when prefetching, unless --prefetch= says otherwise */
+#define PREFETCH_DEFAULT_DISTANCE 8
+/**The furthest --prefetch= can look ahead */
+#define PREFETCH_MAX_DISTANCE 1024
+/**Bytes covered by each prefetch instruction: one cache line */
+#define PREFETCH_LINE_SIZE 64
+
+/**How many pointers of an indirect block defrag looks ahead to prefetch the blocks they point to; 0 turns it off */
+int prefetchDistance = PREFETCH_DEFAULT_DISTANCE;
+/**Number of blocks defrag has prefetched, for the metrics report */
+long prefetchedBlocks = 0;
+
+/**Nonzero while defrag times each level's loop for --metrics */
+int walkTiming = 0;
+/**Wall-clock seconds defrag spent in each level's loop, and how many times each ran, while walkTiming is set */
+double walkLevelSeconds[THREE_LEVELS + 1];
+long walkLevelSamples[THREE_LEVELS + 1];
+
+/**
+ * Function that reads the monotonic clock
+ * @return the current time in seconds
+ */
+double nowSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/**
+ * Function that starts timing one level's loop of defrag. Only the clock is
+ * read, which costs no system call, so it can run for every file
+ * @return the time the loop began, or 0 when walkTiming is not set
+ */
+static inline double beginWalkLevel(void)
+{
+    return walkTiming ? nowSeconds() : 0;
+}
+
+/**
+ * Function that adds the time since beginWalkLevel to a level's total
+ * @param level the level whose loop ended
+ * @param start what beginWalkLevel returned
+ */
+static inline void endWalkLevel(int level, double start)
+{
+    if (walkTiming)
+    {
+        walkLevelSeconds[level] += nowSeconds() - start;
+        walkLevelSamples[level]++;
+    }
+}
+
+/**
+ * Function that prefetches the blocks some entries of an indirect block point to,
+ * so that by the time the walk reaches them they are on their way into the cache.
+ * Entries past the end of the block and unused entries are skipped
+ * @param buffer pointer to the old buffer
+ * @param indirectAddr the address of the indirect block in buffer
+ * @param first the first entry whose block to prefetch
+ * @param last one past the last entry whose block to prefetch
+ * @param dataRegionAddr the address of the data region in buffer
+ * @param blocksize the size of a data block
+ * @param indirect nonzero if the entries point to indirect blocks, which are read twice and kept in cache
+ */
+static inline void prefetchEntries(const char *buffer, int indirectAddr, int first, int last, int dataRegionAddr, int blocksize, int indirect)
+{
+    //number of pointers in an indirect block
+    int numEntries = blocksize / sizeof(int);
+    last = last < numEntries ? last : numEntries;
+    //iteration variables
+    int e = 0;
+    int offset = 0;
+    for (e = first; e < last; e++)
+    {
+        int blockIdx = *(const int *)(&buffer[indirectAddr + (sizeof(int) * e)]);
+        if (blockIdx != UNUSED_INODE_SENTINEL)
+        {
+            const char *block = &buffer[dataRegionAddr + (blocksize * blockIdx)];
+            for (offset = 0; offset < blocksize; offset += PREFETCH_LINE_SIZE)
+            {
+                if (indirect)
+                {
+                    __builtin_prefetch(block + offset, 0, 3);
+                }
+                else
+                {
+                    __builtin_prefetch(block + offset, 0, 0);
+                }
+            }
+            prefetchedBlocks++;
+        }
+    }
+}
+
+/**
+ * Function that recursively defragments a given disk image by updating
+ * the data blocks an inode points to. The inode's pointers are read from and
+ * its new ones written to its row of the decoded inode table; neither image's
+ * inode record is touched, so the caller writes the row out with encodeInode
+ * once the inode has been placed.
+ * @param buffer pointer to the old buffer
+ * @param newBuffer pointer to the new buffer to modify
+ * @param levels the number of levels of recursion to perform
+ * @param blocksize the size of a data block
+ * @param dataRegStartOffset the start of the data region in the original buffer (in blocks)
+ * @param dataRegCurrOffset the current offset into the data region (in blocks)
+ * @param t the decoded inode table, whose pointer columns receive the new block numbers
+ * @param m the number of the inode, its row in t
+ * @param nextFreeGroup integer pointer holding value of next free group of data blocks
+ * @return an integer value indicating an offset (in blocks) into the data region; this offset
+ * is useful for the original caller of the function, but not so for recursive calls; instead,
+ * dataRegCurrOffset will be used in the recursive situation and incremented as blocks are filled in.
+ * When recusion reaches its base case, the value returned then will be the one the original caller
+ * of the function receives.
+ */
+int defrag(char *buffer, char *newBuffer, int levels, int blocksize, int dataRegStartOffset, int dataRegCurrOffset, inodeTable *t, int m, int *nextFreeGroup)
+{
+    //figure out address of next group of free data blocks
+    *nextFreeGroup = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * dataRegCurrOffset);
+
+    //recusion base case
+    if (levels == 0)
+    {
+        double levelStart = beginWalkLevel();
+        //iteration variable
+        int i = 0;
+        for (i = 0; i < N_DBLOCKS; i++)
+        {
+            if (t->dblocks[i][m] != UNUSED_INODE_SENTINEL)
+            {
+                //get data block number in the original buffer to copy
+                int blockIdx = t->dblocks[i][m];
+                //use blockIdx to get the address of that data block in original buffer
+                int blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * blockIdx);
+                //copy the data there to the next available block in the newBuffer
+                memcpy(&newBuffer[*nextFreeGroup], &buffer[blockAddr], blocksize);
+                //record the direct block's new place in the table
+                t->dblocks[i][m] = dataRegCurrOffset;
+                //increment currentOffset into the data region to indicate a block was used and is no longer free
+                dataRegCurrOffset++;
+                //increment nextFreeGroup variable to give memory address of next free block in new buffer
+                *nextFreeGroup += blocksize;
+            }
+        }
+
+        endWalkLevel(levels, levelStart);
+    }
+    else if (levels == 1)
+    {
+        //make recursive call beforehand to make sure DBLOCKS are placed first
+        dataRegCurrOffset = defrag(buffer, newBuffer, levels - 1, blocksize, dataRegStartOffset, dataRegCurrOffset, t, m, nextFreeGroup);
+        double levelStart = beginWalkLevel();
+        //iteration variable
+        int i = 0;
+        for (i = 0; i < N_IBLOCKS; i++)
+        {
+            if (t->iblocks[i][m] != UNUSED_INODE_SENTINEL)
+            {
+                //copy the block representing iblock into position in front of the data blocks it points to in the new image
+                //get data block number in the original buffer to copy
+                int blockIdx = t->iblocks[i][m];
+                //use blockIdx to get the address of that indirect block in original buffer
+                int blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * blockIdx);
+                //copy this to the next free location in newBuffer's data blocks
+                TRACE_PROBE2(indirect__visit, blockIdx, ONE_LEVEL);
+                memcpy(&newBuffer[*nextFreeGroup], &buffer[blockAddr], blocksize);
+                //retain address of this iblock for use later
+                int iblockAddr = *nextFreeGroup;
+                //record the indirect block's new place in the table
+                t->iblocks[i][m] = dataRegCurrOffset;
+
+                //increment currentOffset into the data region to indicate a block was used and is no longer free
+                dataRegCurrOffset++;
+                //update nextFreeGroup to have address of next free block
+                *nextFreeGroup += blocksize;
+
+                //iterate through this indirect block, figuring out which four byte segments have integer
+                //values corresponding to data blocks
+
+                //maximum number of direct blocks that can be pointed to by one indirect block
+                int maxNumDirectBlocks = blocksize / sizeof(int);
+                //iteration variable
+                int j = 0;
+                for (j = 0; j < maxNumDirectBlocks; j++)
+                {
+                    //dbIdx == direct block index
+                    //dereferences explained: take the address of this iblock in the original buffer,
+                    //then add some multiple of a 4-byte (i.e. integer-sized) offset to it based on the
+                    //current iteration. Then, take the four bytes at a given offset and convert it to
+                    //an integer value and examine that value
+                    int dbIdx = *(int *)(&buffer[blockAddr + (j * sizeof(int))]);
+                    //copy the data block indicated by the given offset if valid
+                    if (dbIdx != UNUSED_INODE_SENTINEL)
+                    {
+                        //address of given data block
+                        int dbAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * dbIdx);
+                        memcpy(&newBuffer[*nextFreeGroup], &buffer[dbAddr], blocksize);
+                        //update indirect block at the particular index with the value of the data block offset it has now
+                        int *newBufferIblock = (int *)(&newBuffer[iblockAddr + sizeof(int) * j]);
+                        *newBufferIblock = dataRegCurrOffset;
+                        //increment currentOffset into newBuffer data region to indicate a block was used and is no longer free
+                        dataRegCurrOffset++;
+                        //update nextFreeGroup to have address of next free block in newBuffer
+                        *nextFreeGroup += blocksize;
+                    }
+                }
+            }
+        }
+        endWalkLevel(levels, levelStart);
+    }
+    else if (levels == 2)
+    {
+        //make recursive call to place DBLOCKS and IBLOCKS before doing anything else
+        dataRegCurrOffset = defrag(buffer, newBuffer, levels - 1, blocksize, dataRegStartOffset, dataRegCurrOffset, t, m, nextFreeGroup);
+        double levelStart = beginWalkLevel();
+        //if i2block is being used
+        if (t->i2block[m] != UNUSED_INODE_SENTINEL)
+        {
+            //get location of i2 block as an offset into data region of original buffer
+            int blockIdx = t->i2block[m];
+            //use blockIdx to get the address of that data block in original buffer
+            int blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * blockIdx);
+            //copy the i2block to the next free block in newBuffer
+            TRACE_PROBE2(indirect__visit, blockIdx, TWO_LEVELS);
+            memcpy(&newBuffer[*nextFreeGroup], &buffer[blockAddr], blocksize);
+
+            //record the i2block's new place in the table
+            t->i2block[m] = dataRegCurrOffset;
+
+            //save address of start of i2block for easy updating in newBuffer loops later on
+            int i2StartAddr = *nextFreeGroup;
+
+            //increment nextFreeGroup and dataRegCurrOffset as usual
+            *nextFreeGroup += blocksize;
+            dataRegCurrOffset++;
+
+            //compute maximum possible number of references to indirect blocks in an i2block
+            int maxIblockRefs = blocksize / sizeof(int);
+            //address of the data region in buffer, where prefetched blocks are found
+            int dataRegionAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset);
+            //iteration variable
+            int i = 0;
+            //go through i2 block, taking valid pointers to i blocks and then data blocks, etc.
+            for (i = 0; i < maxIblockRefs; i++)
+            {
+                //indirect block idx
+                //start of i2block address plus some 4-byte multiple offset
+                int iblockIdx = *(int *)(&buffer[blockAddr + (sizeof(int) * i)]);
+                if (iblockIdx != UNUSED_INODE_SENTINEL)
+                {
+                    //get iblock starting address in buffer based on value of iblockIdx
+                    int iblockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * iblockIdx);
+
+                    //copy iblock into newBuffer before copying its data blocks
+                    TRACE_PROBE2(indirect__visit, iblockIdx, ONE_LEVEL);
+                    memcpy(&newBuffer[*nextFreeGroup], &buffer[iblockAddr], blocksize);
+
+                    //get start address of this particular iblock in newBuffer so you can update it later
+                    int iblockStartAddr = *nextFreeGroup;
+
+                    //update i2block pointer value in newBuffer to show new location of this iblock
+                    int *update = (int *)(&newBuffer[i2StartAddr + (sizeof(int) * i)]);
+                    *update = dataRegCurrOffset;
+
+                    //update nextFreeGroup and dataRegCurrOffset
+                    *nextFreeGroup += blocksize;
+                    dataRegCurrOffset++;
+
+                    //start fetching the next iblock, and the first data blocks of this one
+                    if (prefetchDistance > 0)
+                    {
+                        prefetchEntries(buffer, blockAddr, i + 1, i + 2, dataRegionAddr, blocksize, 1);
+                        prefetchEntries(buffer, iblockAddr, 0, prefetchDistance, dataRegionAddr, blocksize, 0);
+                    }
+
+                    //maximum number of data block references per indirect block
+                    int maxDbPtrs = maxIblockRefs;
+                    //iteration variable
+                    int j = 0;
+                    //go through iblock, getting valid direct block pointers
+                    for (j = 0; j < maxDbPtrs; j++)
+                    {
+                        //keep the data block prefetchDistance entries ahead on its way
+                        if (prefetchDistance > 0)
+                        {
+                            prefetchEntries(buffer, iblockAddr, j + prefetchDistance, j + prefetchDistance + 1, dataRegionAddr, blocksize, 0);
+                        }
+                        //index into a particular location in this iblock in original buffer
+                        int dbIdx = *(int *)(&buffer[iblockAddr + sizeof(int) * j]);
+                        //copy data block at given location if it's valid
+                        if (dbIdx != UNUSED_INODE_SENTINEL)
+                        {
+                            //address of the data block that dbIdx is referring to
+                            int dbAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * dbIdx);
+
+                            //copy the data block at this address to the next free location in newBuffer
+                            memcpy(&newBuffer[*nextFreeGroup], &buffer[dbAddr], blocksize);
+
+                            //update this inode's contents in newBuffer
+                            int *update = (int *)(&newBuffer[iblockStartAddr + sizeof(int) * j]);
+                            *update = dataRegCurrOffset;
+
+                            //update nextFreeGroup and dataRegCurrOffset
+                            *nextFreeGroup += blocksize;
+                            dataRegCurrOffset++;
+                        }
+                    }
+                }
+            }
+        }
+        endWalkLevel(levels, levelStart);
+    }
+    else
+    {
+        //make recursive call with levels == one less than previous value
+        dataRegCurrOffset = defrag(buffer, newBuffer, levels - 1, blocksize, dataRegStartOffset, dataRegCurrOffset, t, m, nextFreeGroup);
+        double levelStart = beginWalkLevel();
+        //if i3block is being used
+        if (t->i3block[m] != UNUSED_INODE_SENTINEL)
+        {
+            //get location of i3 block as an offset into data region of original buffer
+            int blockIdx = t->i3block[m];
+            //use blockIdx to get the address of that data block in original buffer
+            int blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * blockIdx);
+            //copy the i3block to the next free block in newBuffer
+            TRACE_PROBE2(indirect__visit, blockIdx, THREE_LEVELS);
+            memcpy(&newBuffer[*nextFreeGroup], &buffer[blockAddr], blocksize);
+            //record the i3block's new place in the table
+            t->i3block[m] = dataRegCurrOffset;
+
+            //save address of start of i3block for easy updating in newBuffer loops later on
+            int i3blockStartAddr = *nextFreeGroup;
+
+            //increment nextFreeGroup and dataRegCurrOffset as usual
+            *nextFreeGroup += blocksize;
+            dataRegCurrOffset++;
+
+            //compute maximum possible number of references to doubly indirect blocks in an i3block
+            int maxI2blockRefs = blocksize / sizeof(int);
+            //address of the data region in buffer, where prefetched blocks are found
+            int dataRegionAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset);
+            //iteration variable
+            int m = 0;
+            //go through i3 block, taking valid pointers to i2 blocks, then iblocks, then data blocks, etc.
+            for (m = 0; m < maxI2blockRefs; m++)
+            {
+                //doubly indirect block index
+                //i3block start address plus some 4-byte multiple offset
+                int i2blockIdx = *(int *)(&buffer[blockAddr + (sizeof(int) * m)]);
+                if (i2blockIdx != UNUSED_INODE_SENTINEL)
+                {
+                    //get i2block starting address in buffer based on value of i2blockIdx
+                    int i2blockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * i2blockIdx);
+
+                    //copy i2block into newBuffer before copying its indirect blocks
+                    TRACE_PROBE2(indirect__visit, i2blockIdx, TWO_LEVELS);
+                    memcpy(&newBuffer[*nextFreeGroup], &buffer[i2blockAddr], blocksize);
+
+                    //get start address of this particular i2block in newBuffer so you can update it later
+                    int i2blockStartAddr = *nextFreeGroup;
+
+                    //update i3block pointer value in newBuffer to show new location of this i2block
+                    int *update = (int *)(&newBuffer[i3blockStartAddr + sizeof(int) * m]);
+                    *update = dataRegCurrOffset;
+
+                    //update nextFreeGroup and dataRegCurrOffset
+                    *nextFreeGroup += blocksize;
+                    dataRegCurrOffset++;
+
+                    //start fetching the next i2block, and the first iblock of this one
+                    if (prefetchDistance > 0)
+                    {
+                        prefetchEntries(buffer, blockAddr, m + 1, m + 2, dataRegionAddr, blocksize, 1);
+                        prefetchEntries(buffer, i2blockAddr, 0, 1, dataRegionAddr, blocksize, 1);
+                    }
+
+                    //maximum number of indirect references per doubly indirect block
+                    int maxIbPtrs = maxI2blockRefs;
+                    //iteration variable
+                    int i = 0;
+                    for (i = 0; i < maxIbPtrs; i++)
+                    {
+                        //indirect block index
+                        //i2block starting address plus some 4-byte multiple offset
+                        int iblockIdx = *(int *)(&buffer[i2blockAddr + sizeof(int) * i]);
+                        if (iblockIdx != UNUSED_INODE_SENTINEL)
+                        {
+                            //get iblock starting address in buffer based on iblockIdx
+                            int iblockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * iblockIdx);
+
+                            //copy iblock into newBuffer before copying its direct blocks
+                            TRACE_PROBE2(indirect__visit, iblockIdx, ONE_LEVEL);
+                            memcpy(&newBuffer[*nextFreeGroup], &buffer[iblockAddr], blocksize);
+
+                            //get starting address of this particular iblock in newBuffer so you can update it later
+                            int iblockStartAddr = *nextFreeGroup;
+
+                            //update i2block pointer value in newBuffer to show new location of this iblock
+                            int *i2Update = (int *)(&newBuffer[i2blockStartAddr + sizeof(int) * i]);
+                            *i2Update = dataRegCurrOffset;
+
+                            //update nextFreeGroup and dataRegCurrOffset
+                            *nextFreeGroup += blocksize;
+                            dataRegCurrOffset++;
+
+                            //start fetching the next iblock, and the first data blocks of this one
+                            if (prefetchDistance > 0)
+                            {
+                                prefetchEntries(buffer, i2blockAddr, i + 1, i + 2, dataRegionAddr, blocksize, 1);
+                                prefetchEntries(buffer, iblockAddr, 0, prefetchDistance, dataRegionAddr, blocksize, 0);
+                            }
+
+                            //maximum number of direct references per indirect block
+                            int maxDbPtrs = maxIbPtrs;
+                            //iteration variable
+                            int v = 0;
+                            for (v = 0; v < maxDbPtrs; v++)
+                            {
+                                //keep the data block prefetchDistance entries ahead on its way
+                                if (prefetchDistance > 0)
+                                {
+                                    prefetchEntries(buffer, iblockAddr, v + prefetchDistance, v + prefetchDistance + 1, dataRegionAddr, blocksize, 0);
+                                }
+                                //direct block index
+                                //indirect block starting address pluse some 4-byte multiple offset
+                                int dBlockIdx = *(int *)(&buffer[iblockAddr + sizeof(int) * v]);
+                                //if index is valid, copy the given data block
+                                if (dBlockIdx != UNUSED_INODE_SENTINEL)
+                                {
+                                    //get data block startind address in buffer based on dBlockIdx
+                                    int dblockAddr = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (blocksize * dataRegStartOffset) + (blocksize * dBlockIdx);
+
+                                    //copy data block into newBuffer before copying its direct block
+                                    memcpy(&newBuffer[*nextFreeGroup], &buffer[dblockAddr], blocksize);
+                                    //update iblock pointer value in newBuffer to show new location of this dblock
+                                    int *iUpdate = (int *)(&newBuffer[iblockStartAddr + sizeof(int) * v]);
+                                    *iUpdate = dataRegCurrOffset;
+
+                                    //update nextFreeGroup and dataRegCurrOffset
+                                    *nextFreeGroup += blocksize;
+                                    dataRegCurrOffset++;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        endWalkLevel(levels, levelStart);
+    }
+
+    return dataRegCurrOffset;
+}
+
+//-----------------------
+// Global: writeFully
+//-----------------------
+
+/**
+ * Function that writes an entire region of memory to a file descriptor,
+ * retrying after partial writes and interrupted system calls
+ * @param fd the file descriptor to write to
+ * @param data pointer to the first byte to write
+ * @param len the number of bytes to write
+ */
+void writeFully(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        //number of bytes actually written by this call
+        ssize_t written = write(fd, data, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_msg("Error writing output file.");
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+//-----------------------
+// Global: mapDiskImage
+//-----------------------
+
+/**
+ * Function that maps a disk image file read-only into memory, so that large
+ * images can be examined without first copying them into a heap buffer
+ * @param path the path of the disk image file
+ * @param size pointer that receives the size of the disk image in bytes
+ * @return a pointer to the first byte of the mapped disk image
+ */
+char *mapDiskImage(char *path, size_t *size)
+{
+    //file descriptor for the disk image
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        error_msg("Error reading disk image file.");
+    }
+    //stat struct that will hold information about the file
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0)
+    {
+        error_msg("Error determing disk image size.");
+    }
+    //an image too small to hold a superblock can't be examined
+    if (fileInfo.st_size < BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE)
+    {
+        error_msg("Disk image is too small to contain a superblock.");
+    }
+    char *image = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED)
+    {
+        error_msg("Error mapping disk image file.");
+    }
+    //the mapping stays valid after the descriptor is closed
+    close(fd);
+    *size = fileInfo.st_size;
+    return image;
+}
+
+//-----------------------
+// Global: checkSuperblock
+//-----------------------
+
+/**
+ * Function that checks that the regions described by a superblock fit inside
+ * a disk image of the given size, so that walking the image can't run off its end
+ * @param sb the superblock to check
+ * @param imageSize the size of the disk image in bytes
+ */
+void checkSuperblock(superblock *sb, size_t imageSize)
+{
+    if (sb->blocksize <= 0 || sb->blocksize % sizeof(int) != 0)
+    {
+        error_msg("Disk image has an invalid block size.");
+    }
+    if (sb->inode_offset < 0 || sb->data_offset < sb->inode_offset || sb->swap_offset < sb->data_offset)
+    {
+        error_msg("Disk image has invalid region offsets.");
+    }
+    //address of the end of the data region, which must lie within the image
+    size_t dataRegionEnd = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + ((size_t)sb->swap_offset * sb->blocksize);
+    if (dataRegionEnd > imageSize)
+    {
+        error_msg("Disk image is smaller than its superblock describes.");
+    }
+}
+
+//-----------------------
+// Global: ioBackend
+//-----------------------
+
+/**Ways of reading and writing image files, chosen with --io= */
+#define IO_AUTO 0   /* pick the best backend available for the job */
+#define IO_BUFFER 1 /* stdio fread/fwrite of whole buffers */
+#define IO_MMAP 2   /* copy to and from a shared mapping of the file */
+#define IO_PREAD 3  /* pread/pwrite system calls */
+#define IO_DIRECT 4 /* pread/pwrite with O_DIRECT, through an aligned bounce buffer */
+#define IO_URING 5  /* io_uring, with several requests in flight */
+/**Number of backends, counting IO_AUTO */
+#define IO_NUM_BACKENDS 6
+/**The most bytes each pread, pwrite or io_uring request moves */
+#define IO_CHUNK_SIZE (1024 * 1024)
+/**Alignment O_DIRECT needs for buffers, offsets and lengths */
+#define IO_DIRECT_ALIGN 4096
+/**Number of io_uring requests kept in flight */
+#define IO_URING_DEPTH 8
+
+/**Number of linear sub-buckets per power of two in a latency histogram, which bounds its error to 1/16 */
+#define HIST_SUB_BUCKETS 16
+/**Number of buckets in a latency histogram, enough for any 64-bit nanosecond value */
+#define HIST_NUM_BUCKETS (61 * HIST_SUB_BUCKETS)
+/**Kinds of I/O operation whose latencies are recorded */
+#define LATENCY_READ 0  /* a read system call, or a whole read for the buffer and mmap backends */
+#define LATENCY_WRITE 1 /* a write system call, or a whole write for the buffer and mmap backends */
+#define LATENCY_SYNC 2  /* pushing written data to the device */
+#define LATENCY_URING 3 /* an io_uring request, from submission to completion */
+#define NUM_LATENCY_KINDS 4
+
+/**Names of the kinds of operation, as reported */
+const char *latencyKindNames[NUM_LATENCY_KINDS] = {"read", "write", "sync", "uring"};
+
+/**
+ * A log-bucketed histogram of latencies in nanoseconds, in the style of
+ * HdrHistogram: values below HIST_SUB_BUCKETS have a bucket each, and every
+ * power of two above is split into HIST_SUB_BUCKETS equal buckets. Each thread
+ * records into its own, so recording needs no locks; they are merged afterwards
+ */
+typedef struct
+{
+    uint64_t counts[HIST_NUM_BUCKETS]; /* number of values in each bucket */
+    uint64_t total;                    /* number of values recorded */
+    uint64_t max;                      /* the largest value recorded */
+} latencyHistogram;
+
+/**
+ * Latency histograms of every kind of I/O operation done through some files
+ */
+typedef struct
+{
+    latencyHistogram kinds[NUM_LATENCY_KINDS];
+} ioLatency;
+
+/**
+ * Function that reads the monotonic clock in nanoseconds
+ * @return the current time in nanoseconds
+ */
+uint64_t nowNanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * Function that finds the bucket of a latency histogram a value falls in
+ * @param value the value in nanoseconds
+ * @return the bucket's index
+ */
+int histogramBucket(uint64_t value)
+{
+    if (value < HIST_SUB_BUCKETS)
+    {
+        return value;
+    }
+    //position of the highest set bit, which is at least 4 here
+    int msb = 63 - __builtin_clzll(value);
+    return ((msb - 3) * HIST_SUB_BUCKETS) + ((value >> (msb - 4)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/**
+ * Function that finds the smallest value that falls in a bucket of a latency histogram
+ * @param bucket the bucket's index
+ * @return the value in nanoseconds
+ */
+uint64_t histogramBucketStart(int bucket)
+{
+    if (bucket < HIST_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    //position of the highest set bit of the bucket's values
+    int msb = (bucket / HIST_SUB_BUCKETS) + 3;
+    return (uint64_t)(HIST_SUB_BUCKETS + (bucket % HIST_SUB_BUCKETS)) << (msb - 4);
+}
+
+/**
+ * Function that records the time since an operation started. Does nothing when h is NULL
+ * @param h the histogram, or NULL
+ * @param start when the operation started, from nowNanos
+ */
+void recordLatency(latencyHistogram *h, uint64_t start)
+{
+    if (h == NULL)
+    {
+        return;
+    }
+    uint64_t value = nowNanos() - start;
+    h->counts[histogramBucket(value)]++;
+    h->total++;
+    h->max = value > h->max ? value : h->max;
+}
+
+/**
+ * Function that adds one set of latency histograms into another
+ * @param into the histograms to add to
+ * @param from the histograms to add
+ */
+void mergeLatency(ioLatency *into, const ioLatency *from)
+{
+    //iteration variables
+    int k = 0;
+    int b = 0;
+    for (k = 0; k < NUM_LATENCY_KINDS; k++)
+    {
+        for (b = 0; b < HIST_NUM_BUCKETS; b++)
+        {
+            into->kinds[k].counts[b] += from->kinds[k].counts[b];
+        }
+        into->kinds[k].total += from->kinds[k].total;
+        into->kinds[k].max = from->kinds[k].max > into->kinds[k].max ? from->kinds[k].max : into->kinds[k].max;
+    }
+}
+
+/**
+ * Function that finds a percentile of a latency histogram
+ * @param h the histogram
+ * @param fraction the percentile as a fraction, for example 0.99
+ * @return the largest value that can be in the percentile's bucket, but no more than the maximum
+ */
+uint64_t histogramPercentile(const latencyHistogram *h, double fraction)
+{
+    //number of values at or below the percentile
+    uint64_t rank = (uint64_t)((fraction * h->total) + 0.999999);
+    uint64_t seen = 0;
+    //iteration variable
+    int b = 0;
+    for (b = 0; b < HIST_NUM_BUCKETS; b++)
+    {
+        seen += h->counts[b];
+        if (seen >= rank && seen > 0)
+        {
+            uint64_t end = b + 1 < HIST_NUM_BUCKETS ? histogramBucketStart(b + 1) - 1 : h->max;
+            return end < h->max ? end : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Function that prints the percentiles of every kind of operation that was recorded
+ * @param l the histograms
+ * @param out the stream to print to
+ */
+void reportLatency(const ioLatency *l, FILE *out)
+{
+    fprintf(out, "%-13s %8s %10s %10s %10s %10s  (microseconds)\n", "latency", "count", "p50", "p99", "p999", "max");
+    //iteration variable
+    int k = 0;
+    for (k = 0; k < NUM_LATENCY_KINDS; k++)
+    {
+        const latencyHistogram *h = &l->kinds[k];
+        if (h->total > 0)
+        {
+            fprintf(out, "%-13s %8llu %10.1f %10.1f %10.1f %10.1f\n", latencyKindNames[k], (unsigned long long)h->total,
+                    histogramPercentile(h, 0.5) / 1e3, histogramPercentile(h, 0.99) / 1e3, histogramPercentile(h, 0.999) / 1e3, h->max / 1e3);
+        }
+    }
+}
+
+/**Names of the backends, as given to --io=, indexed by IO_ value */
+const char *ioBackendNames[IO_NUM_BACKENDS] = {"auto", "buffer", "mmap", "pread", "direct", "uring"};
+
+/**
+ * An io_uring instance, with its submission and completion rings mapped
+ */
+typedef struct
+{
+    int fd;                    /* the ring, or -1 if there is none */
+    unsigned entries;          /* number of submission queue entries */
+    unsigned *sqTail;          /* submission queue tail, advanced by us */
+    unsigned *sqMask;          /* mask that turns a tail into an index */
+    unsigned *sqArray;         /* indices of the entries to submit */
+    struct io_uring_sqe *sqes; /* the submission queue entries */
+    unsigned *cqHead;          /* completion queue head, advanced by us */
+    unsigned *cqTail;          /* completion queue tail, advanced by the kernel */
+    unsigned *cqMask;          /* mask that turns a head into an index */
+    struct io_uring_cqe *cqes; /* the completion queue entries */
+    size_t lengths[IO_URING_DEPTH];    /* size of the request using each slot */
+    uint64_t submitted[IO_URING_DEPTH]; /* when the request using each slot was queued */
+    unsigned freeSlots;        /* bitmap of slots with no request in flight */
+    void *sqRing;              /* mapping of the submission ring */
+    void *cqRing;              /* mapping of the completion ring */
+    size_t sqRingSize;         /* size of the submission ring mapping */
+    size_t cqRingSize;         /* size of the completion ring mapping */
+} ioRing;
+
+/**
+ * A file opened through one of the I/O backends
+ */
+typedef struct
+{
+    int backend;   /* the IO_ value in use */
+    int fd;        /* the file */
+    FILE *stream;  /* the file as a stdio stream, for IO_BUFFER */
+    off_t position; /* the stream's position, for IO_BUFFER */
+    char *map;     /* the file's mapping, for IO_MMAP */
+    size_t size;   /* the size of the mapping */
+    char *bounce;  /* aligned buffer of IO_CHUNK_SIZE bytes, for IO_DIRECT */
+    ioRing ring;   /* the ring, for IO_URING */
+    ioLatency *latency; /* where operation latencies are recorded, or NULL; used by one thread only */
+} ioFile;
+
+/**
+ * Function that parses the value of an --io= option
+ * @param value the backend's name
+ * @return its IO_ value
+ */
+int parseIoBackend(const char *value)
+{
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < IO_NUM_BACKENDS; i++)
+    {
+        if (strcmp(value, ioBackendNames[i]) == 0)
+        {
+            return i;
+        }
+    }
+    error_msg("Invalid value for --io: use auto, buffer, mmap, pread, direct or uring.");
+    return IO_AUTO;
+}
+
+/**
+ * Function that sets up an io_uring instance
+ * @param r the ring to set up
+ * @return 1 on success, 0 if io_uring is not available
+ */
+int ringSetup(ioRing *r)
+{
+#ifndef HAVE_IO_URING
+    r->fd = -1;
+    return 0;
+#else
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, IO_URING_DEPTH, &p);
+    if (r->fd < 0)
+    {
+        return 0;
+    }
+    r->entries = p.sq_entries;
+    r->sqRingSize = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+    r->cqRingSize = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+    r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqRing == MAP_FAILED || r->cqRing == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        close(r->fd);
+        r->fd = -1;
+        return 0;
+    }
+    r->sqTail = (unsigned *)((char *)r->sqRing + p.sq_off.tail);
+    r->sqMask = (unsigned *)((char *)r->sqRing + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)((char *)r->sqRing + p.sq_off.array);
+    r->cqHead = (unsigned *)((char *)r->cqRing + p.cq_off.head);
+    r->cqTail = (unsigned *)((char *)r->cqRing + p.cq_off.tail);
+    r->cqMask = (unsigned *)((char *)r->cqRing + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cqRing + p.cq_off.cqes);
+    return 1;
+#endif
+}
+
+/**
+ * Function that tears down an io_uring instance
+ * @param r the ring
+ */
+void ringClose(ioRing *r)
+{
+    if (r->fd < 0)
+    {
+        return;
+    }
+#ifdef HAVE_IO_URING
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+#endif
+    munmap(r->cqRing, r->cqRingSize);
+    munmap(r->sqRing, r->sqRingSize);
+    close(r->fd);
+    r->fd = -1;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Function that takes every completion waiting in a ring, freeing its slot
+ * @param r the ring
+ * @param inFlight the number of requests in flight, lowered by each completion
+ * @param h the histogram each request's latency is recorded in, or NULL
+ * @return 1 if every completion was for its request in full, 0 otherwise
+ */
+int ringReap(ioRing *r, unsigned *inFlight, latencyHistogram *h)
+{
+    int ok = 1;
+    unsigned head = *r->cqHead;
+    while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+        ok = ok && cqe->res == (int)r->lengths[cqe->user_data];
+        recordLatency(h, r->submitted[cqe->user_data]);
+        r->freeSlots |= 1U << cqe->user_data;
+        (*inFlight)--;
+        head++;
+    }
+    __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+    return ok;
+}
+#endif
+
+/**
+ * Function that reads or writes a range of a file through io_uring, split into
+ * IO_CHUNK_SIZE requests with up to a ring's worth in flight at once. When the
+ * kernel refuses requests, the ones it never took are withdrawn and the ones it
+ * took are waited for, so the caller can fall back knowing buffer is no longer in use
+ * @param r the ring
+ * @param fd the file
+ * @param buffer the memory to read into or write from
+ * @param len the number of bytes
+ * @param offset the offset in the file
+ * @param isWrite nonzero to write, zero to read
+ * @param h the histogram each request's latency is recorded in, or NULL
+ * @return 1 if every request completed in full, 0 if not but none is still in
+ * flight, and -1 if requests may still be in flight, when buffer must not be reused
+ */
+int ringTransfer(ioRing *r, int fd, char *buffer, size_t len, off_t offset, int isWrite, latencyHistogram *h)
+{
+#ifndef HAVE_IO_URING
+    return 0;
+#else
+    //bytes queued so far, requests queued but not yet handed to the kernel, and requests in flight
+    size_t queued = 0;
+    unsigned pending = 0;
+    unsigned inFlight = 0;
+    int ok = 1;
+    r->freeSlots = (1U << IO_URING_DEPTH) - 1;
+    while (queued < len || pending > 0 || inFlight > 0)
+    {
+        while (queued < len && pending + inFlight < r->entries && r->freeSlots != 0)
+        {
+            size_t n = len - queued < IO_CHUNK_SIZE ? len - queued : IO_CHUNK_SIZE;
+            unsigned tail = *r->sqTail;
+            unsigned index = tail & *r->sqMask;
+            struct io_uring_sqe *sqe = &r->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)&buffer[queued];
+            sqe->len = n;
+            sqe->off = offset + queued;
+            //each completion finds its size and submission time through its slot
+            int slot = __builtin_ctz(r->freeSlots);
+            r->freeSlots &= ~(1U << slot);
+            r->lengths[slot] = n;
+            r->submitted[slot] = nowNanos();
+            sqe->user_data = slot;
+            r->sqArray[index] = index;
+            __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+            queued += n;
+            pending++;
+        }
+        int submitted = syscall(__NR_io_uring_enter, r->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0 && errno != EINTR)
+        {
+            //the kernel never saw the queued requests, so they are taken back off the ring
+            __atomic_store_n(r->sqTail, *r->sqTail - pending, __ATOMIC_RELEASE);
+            //and every request it did take must complete before buffer is given up
+            while (inFlight > 0)
+            {
+                ringReap(r, &inFlight, h);
+                if (inFlight > 0 && syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                {
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        if (submitted > 0)
+        {
+            pending -= submitted;
+            inFlight += submitted;
+        }
+        ok = ringReap(r, &inFlight, h) && ok;
+    }
+    return ok;
+#endif
+}
+
+/**
+ * Function that picks the backend for copying whole images: io_uring when the
+ * kernel allows it, pread/pwrite otherwise
+ * @return the IO_ value
+ */
+int detectIoBackend(void)
+{
+    //the answer doesn't change, so the probe runs once
+    static int detected = IO_AUTO;
+    if (detected == IO_AUTO)
+    {
+        ioRing r;
+        detected = ringSetup(&r) ? IO_URING : IO_PREAD;
+        ringClose(&r);
+    }
+    return detected;
+}
+
+/**
+ * Function that opens a file through an I/O backend. A writable file is
+ * created or truncated, and sized up front for IO_MMAP. IO_DIRECT falls back
+ * to IO_PREAD on file systems that don't support O_DIRECT
+ * @param f the file to set up
+ * @param path the path of the file
+ * @param backend the IO_ value to use; IO_AUTO picks one
+ * @param writable nonzero to open for writing, zero for reading
+ * @param size the size the file will have, for writable files
+ * @return 1 on success, 0 on failure
+ */
+int ioOpen(ioFile *f, const char *path, int backend, int writable, size_t size)
+{
+    memset(f, 0, sizeof(*f));
+    f->backend = backend == IO_AUTO ? detectIoBackend() : backend;
+    f->ring.fd = -1;
+    //flags shared by every backend
+    int flags = writable ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY;
+    f->fd = open(path, flags | (f->backend == IO_DIRECT ? O_DIRECT : 0), 0644);
+    if (f->fd < 0 && f->backend == IO_DIRECT && errno == EINVAL)
+    {
+        f->backend = IO_PREAD;
+        f->fd = open(path, flags, 0644);
+    }
+    if (f->fd < 0)
+    {
+        return 0;
+    }
+    if (f->backend == IO_BUFFER)
+    {
+        f->stream = fdopen(f->fd, writable ? "w+" : "r");
+        return f->stream != NULL;
+    }
+    if (f->backend == IO_MMAP)
+    {
+        struct stat info;
+        if (writable ? ftruncate(f->fd, size) != 0 : fstat(f->fd, &info) != 0)
+        {
+            return 0;
+        }
+        f->size = writable ? size : (size_t)info.st_size;
+        f->map = f->size > 0 ? mmap(NULL, f->size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, f->fd, 0) : NULL;
+        return f->map != MAP_FAILED;
+    }
+    if (f->backend == IO_DIRECT)
+    {
+        return posix_memalign((void **)&f->bounce, IO_DIRECT_ALIGN, IO_CHUNK_SIZE) == 0;
+    }
+    if (f->backend == IO_URING && !ringSetup(&f->ring))
+    {
+        f->backend = IO_PREAD;
+    }
+    return 1;
+}
+
+/**
+ * Function that reads or writes a range of a file with pread or pwrite, retrying short transfers
+ * @param fd the file
+ * @param buffer the memory to read into or write from
+ * @param len the number of bytes
+ * @param offset the offset in the file
+ * @param isWrite nonzero to write, zero to read
+ * @param latency where each system call's latency is recorded, or NULL
+ * @return 1 on success, 0 on failure or end of file
+ */
+int plainTransfer(int fd, char *buffer, size_t len, off_t offset, int isWrite, ioLatency *latency)
+{
+    latencyHistogram *h = latency != NULL ? &latency->kinds[isWrite ? LATENCY_WRITE : LATENCY_READ] : NULL;
+    while (len > 0)
+    {
+        size_t n = len < IO_CHUNK_SIZE ? len : IO_CHUNK_SIZE;
+        uint64_t start = nowNanos();
+        ssize_t done = isWrite ? pwrite(fd, buffer, n, offset) : pread(fd, buffer, n, offset);
+        recordLatency(h, start);
+        if (done <= 0)
+        {
+            if (done < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        buffer += done;
+        offset += done;
+        len -= done;
+    }
+    return 1;
+}
+
+/**
+ * Function that reads or writes a range of a file opened with O_DIRECT. Reads
+ * go through the bounce buffer a whole aligned window at a time, so any range
+ * can be read; writes that are not aligned are done with O_DIRECT turned off
+ * @param f the file
+ * @param buffer the memory to read into or write from
+ * @param len the number of bytes
+ * @param offset the offset in the file
+ * @param isWrite nonzero to write, zero to read
+ * @return 1 on success, 0 on failure
+ */
+int directTransfer(ioFile *f, char *buffer, size_t len, off_t offset, int isWrite)
+{
+    while (len > 0)
+    {
+        //the aligned window around the next piece, no larger than the bounce buffer
+        off_t windowStart = offset & ~(off_t)(IO_DIRECT_ALIGN - 1);
+        size_t lead = offset - windowStart;
+        size_t n = len < IO_CHUNK_SIZE - lead ? len : IO_CHUNK_SIZE - lead;
+        size_t windowLen = (lead + n + IO_DIRECT_ALIGN - 1) & ~(size_t)(IO_DIRECT_ALIGN - 1);
+        latencyHistogram *h = f->latency != NULL ? &f->latency->kinds[isWrite ? LATENCY_WRITE : LATENCY_READ] : NULL;
+        uint64_t start = nowNanos();
+        if (!isWrite)
+        {
+            //a window running past the end of the file comes back short, which is fine
+            ssize_t got = pread(f->fd, f->bounce, windowLen, windowStart);
+            recordLatency(h, start);
+            if (got < (ssize_t)(lead + n))
+            {
+                return 0;
+            }
+            memcpy(buffer, &f->bounce[lead], n);
+        }
+        else if (lead == 0 && n % IO_DIRECT_ALIGN == 0)
+        {
+            memcpy(f->bounce, buffer, n);
+            ssize_t put = pwrite(f->fd, f->bounce, n, offset);
+            recordLatency(h, start);
+            if (put != (ssize_t)n)
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            int flags = fcntl(f->fd, F_GETFL);
+            int ok = fcntl(f->fd, F_SETFL, flags & ~O_DIRECT) == 0 && plainTransfer(f->fd, buffer, n, offset, 1, f->latency);
+            if (fcntl(f->fd, F_SETFL, flags) != 0 || !ok)
+            {
+                return 0;
+            }
+        }
+        buffer += n;
+        offset += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * Function that reads or writes a range of a file through its backend
+ * @param f the file
+ * @param buffer the memory to read into or write from
+ * @param len the number of bytes
+ * @param offset the offset in the file
+ * @param isWrite nonzero to write, zero to read
+ * @return 1 on success, 0 on failure
+ */
+int ioTransfer(ioFile *f, char *buffer, size_t len, off_t offset, int isWrite)
+{
+    //histogram of this kind of operation, if latencies are being recorded
+    latencyHistogram *h = f->latency != NULL ? &f->latency->kinds[isWrite ? LATENCY_WRITE : LATENCY_READ] : NULL;
+    uint64_t start = nowNanos();
+    if (f->backend == IO_BUFFER)
+    {
+        if (f->position != offset && fseeko(f->stream, offset, SEEK_SET) != 0)
+        {
+            return 0;
+        }
+        f->position = offset + len;
+        int ok = len == 0 || (isWrite ? fwrite(buffer, len, RW_NMEMB, f->stream) : fread(buffer, len, RW_NMEMB, f->stream)) == RW_NMEMB;
+        recordLatency(h, start);
+        return ok;
+    }
+    if (f->backend == IO_MMAP)
+    {
+        if (offset + len > f->size)
+        {
+            return 0;
+        }
+        memcpy(isWrite ? &f->map[offset] : buffer, isWrite ? buffer : &f->map[offset], len);
+        recordLatency(h, start);
+        return 1;
+    }
+    if (f->backend == IO_DIRECT)
+    {
+        return directTransfer(f, buffer, len, offset, isWrite);
+    }
+    if (f->backend == IO_URING)
+    {
+        int done = ringTransfer(&f->ring, f->fd, buffer, len, offset, isWrite, f->latency != NULL ? &f->latency->kinds[LATENCY_URING] : NULL);
+        //requests that may still land in buffer rule out retrying with it, and
+        //closing the ring makes the kernel cancel them before anything else is sent
+        if (done < 0)
+        {
+            ringClose(&f->ring);
+            f->backend = IO_PREAD;
+        }
+        if (done != 0)
+        {
+            return done > 0;
+        }
+    }
+    //pread, or a ring that refused the requests
+    return plainTransfer(f->fd, buffer, len, offset, isWrite, f->latency);
+}
+
+/**
+ * Function that pushes written data in a range of a file to the device
+ * @param f the file
+ * @param len the number of bytes
+ * @param offset the offset in the file
+ * @return 1 on success, 0 on failure
+ */
+int ioSync(ioFile *f, size_t len, off_t offset)
+{
+    uint64_t start = nowNanos();
+    int ok = 0;
+    if (f->backend == IO_BUFFER && fflush(f->stream) != 0)
+    {
+        return 0;
+    }
+    if (f->backend == IO_MMAP)
+    {
+        //msync works on whole pages
+        off_t pageStart = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        ok = msync(&f->map[pageStart], len + (offset - pageStart), MS_SYNC) == 0;
+    }
+    else
+    {
+        ok = sync_file_range(f->fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == 0;
+    }
+    recordLatency(f->latency != NULL ? &f->latency->kinds[LATENCY_SYNC] : NULL, start);
+    return ok;
+}
+
+/**
+ * Function that sets the size of a file opened for writing, so a range that
+ * was never written at its end reads back as zeroes
+ * @param f the file
+ * @param size the size the file should have
+ * @return 1 on success, 0 on failure
+ */
+int ioTruncate(ioFile *f, size_t size)
+{
+    if (f->backend == IO_BUFFER && fflush(f->stream) != 0)
+    {
+        return 0;
+    }
+    //a mapped file was sized when it was opened
+    return f->backend == IO_MMAP || ftruncate(f->fd, size) == 0;
+}
+
+/**
+ * Function that closes a file opened with ioOpen
+ * @param f the file
+ * @return 1 on success, 0 if buffered data could not be written
+ */
+int ioClose(ioFile *f)
+{
+    if (f->map != NULL && f->map != MAP_FAILED)
+    {
+        munmap(f->map, f->size);
+    }
+    ringClose(&f->ring);
+    free(f->bounce);
+    if (f->stream != NULL)
+    {
+        return fclose(f->stream) == 0;
+    }
+    return close(f->fd) == 0;
+}
+
+/**
+ * Function that loads a disk image for a command that only examines it: with
+ * IO_MMAP or IO_AUTO it is mapped like mapDiskImage does, and with any other
+ * backend it is read into a heap buffer through that backend
+ * @param path the path of the disk image file
+ * @param backend the IO_ value to use
+ * @param size receives the size of the image in bytes
+ * @return the image's contents, to be released with unloadDiskImage
+ */
+char *loadDiskImage(char *path, int backend, size_t *size)
+{
+    if (backend == IO_AUTO || backend == IO_MMAP)
+    {
+        return mapDiskImage(path, size);
+    }
+    ioFile f;
+    struct stat info;
+    if (stat(path, &info) != 0 || !ioOpen(&f, path, backend, 0, 0))
+    {
+        error_msg("Error reading disk image file.");
+    }
+    if (info.st_size < BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE)
+    {
+        error_msg("Disk image is too small to contain a superblock.");
+    }
+    char *image = malloc(info.st_size);
+    if (image == NULL || !ioTransfer(&f, image, info.st_size, 0, 0))
+    {
+        error_msg("Error reading disk image file.");
+    }
+    ioClose(&f);
+    *size = info.st_size;
+    return image;
+}
+
+/**
+ * Function that releases an image loaded with loadDiskImage
+ * @param image the image
+ * @param size the size of the image in bytes
+ * @param backend the IO_ value it was loaded with
+ */
+void unloadDiskImage(char *image, size_t size, int backend)
+{
+    if (backend == IO_AUTO || backend == IO_MMAP)
+    {
+        munmap(image, size);
+    }
+    else
+    {
+        free(image);
+    }
+}
+
+//-----------------------
+// Global: describeImage
+//-----------------------
+
+/**
+ * Describes where the regions of a disk image lie in memory
+ */
+typedef struct
+{
+    char *image;       /* first byte of the disk image */
+    size_t size;       /* size of the disk image in bytes */
+    superblock *sb;    /* the image's superblock */
+    int blocksize;     /* size of blocks in bytes */
+    char *inodeRegion; /* address of inode 0 */
+    int totalInodes;   /* number of inodes the inode region holds */
+    char *dataRegion;  /* address of data block 0 */
+    int numDataBlocks; /* number of blocks in the data region */
+} diskLayout;
+
+/**
+ * Function that checks a disk image's superblock and works out where its regions lie
+ * @param image pointer to the first byte of the disk image
+ * @param size the size of the disk image in bytes
+ * @param d the layout to fill in
+ */
+void describeImage(char *image, size_t size, diskLayout *d)
+{
+    d->image = image;
+    d->size = size;
+    d->sb = (superblock *)&image[SUPERBLOCK_SIZE];
+    checkSuperblock(d->sb, size);
+    d->blocksize = d->sb->blocksize;
+    d->inodeRegion = &image[(BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + ((size_t)d->sb->inode_offset * d->blocksize)];
+    d->totalInodes = ((size_t)(d->sb->data_offset - d->sb->inode_offset) * d->blocksize) / INODE_SIZE;
+    d->dataRegion = &image[(BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + ((size_t)d->sb->data_offset * d->blocksize)];
+    d->numDataBlocks = d->sb->swap_offset - d->sb->data_offset;
+}
+
+/**
+ * Function that finds the inode with a given number in a described disk image
+ * @param d the layout of the disk image
+ * @param inodeNum the inode's index into the inode region
+ * @return pointer to the inode
+ */
+inode *inodeAt(diskLayout *d, int inodeNum)
+{
+    return (inode *)&d->inodeRegion[(size_t)inodeNum * INODE_SIZE];
+}
+
+/**
+ * Function that counts the blocks on the free block list of a described disk image
+ * @param d the layout of the disk image
+ * @return the number of free blocks, or -1 if the list leaves the data region or loops
+ */
+int countFreeBlocks(diskLayout *d)
+{
+    //number of blocks counted so far
+    int count = 0;
+    //the block currently being looked at
+    int block = d->sb->free_block;
+    while (block != UNUSED_INODE_SENTINEL)
+    {
+        //a list longer than the data region must contain a loop
+        if (block < 0 || block >= d->numDataBlocks || count >= d->numDataBlocks)
+        {
+            return -1;
+        }
+        count++;
+        block = *(int *)&d->dataRegion[(size_t)block * d->blocksize];
+    }
+    return count;
+}
+
+//-----------------------
+// Global: decodeInodeTable
+//-----------------------
+
+/**
+ * Function that copies an inode record's columned fields into a row of an inode table
+ * @param t the table
+ * @param m the row
+ * @param in the record
+ */
+void decodeInodeRow(inodeTable *t, int m, const inode *in)
+{
+    t->nlink[m] = in->nlink;
+    t->size[m] = in->size;
+    t->mtime[m] = in->mtime;
+    //iteration variable
+    int c = 0;
+    for (c = 0; c < N_DBLOCKS; c++)
+    {
+        t->dblocks[c][m] = in->dblocks[c];
+    }
+    for (c = 0; c < N_IBLOCKS; c++)
+    {
+        t->iblocks[c][m] = in->iblocks[c];
+    }
+    t->i2block[m] = in->i2block;
+    t->i3block[m] = in->i3block;
+}
+
+/**
+ * Function that decodes the inode region of an image into a table, in one pass over the records
+ * @param d the layout of the disk image
+ * @param t the table to fill in
+ * @param a the arena the columns are allocated from; they live until it is released
+ */
+void decodeInodeTable(diskLayout *d, inodeTable *t, arena *a)
+{
+    t->count = d->totalInodes;
+    t->rows = ((t->count / INODE_TABLE_GROUP) + 1) * INODE_TABLE_GROUP;
+    t->records = d->inodeRegion;
+    //every column lives in one allocation
+    int *columns = arenaAlloc(a, sizeof(int) * INODE_TABLE_COLUMNS * (size_t)t->rows);
+    //iteration variables
+    int c = 0;
+    int m = 0;
+    int *next = columns;
+    int **all[INODE_TABLE_COLUMNS];
+    all[0] = &t->nlink;
+    all[1] = &t->size;
+    all[2] = &t->mtime;
+    for (c = 0; c < N_DBLOCKS; c++)
+    {
+        all[3 + c] = &t->dblocks[c];
+    }
+    for (c = 0; c < N_IBLOCKS; c++)
+    {
+        all[3 + N_DBLOCKS + c] = &t->iblocks[c];
+    }
+    all[3 + N_DBLOCKS + N_IBLOCKS] = &t->i2block;
+    all[4 + N_DBLOCKS + N_IBLOCKS] = &t->i3block;
+    for (c = 0; c < INODE_TABLE_COLUMNS; c++)
+    {
+        *all[c] = next;
+        next += t->rows;
+        //padding rows have no links and no blocks
+        memset(&(*all[c])[t->count], c < 3 ? 0 : 0xff, sizeof(int) * (t->rows - t->count));
+    }
+    for (m = 0; m < t->count; m++)
+    {
+        decodeInodeRow(t, m, inodeAt(d, m));
+    }
+}
+
+/**
+ * Function that encodes a row of an inode table back into an inode record,
+ * taking the fields the table has no column for from the decoded record
+ * @param t the table
+ * @param m the inode number
+ * @param out the record to fill in
+ */
+void encodeInode(const inodeTable *t, int m, inode *out)
+{
+    memcpy(out, &t->records[(size_t)m * INODE_SIZE], sizeof(inode));
+    out->nlink = t->nlink[m];
+    out->size = t->size[m];
+    out->mtime = t->mtime[m];
+    //iteration variable
+    int c = 0;
+    for (c = 0; c < N_DBLOCKS; c++)
+    {
+        out->dblocks[c] = t->dblocks[c][m];
+    }
+    for (c = 0; c < N_IBLOCKS; c++)
+    {
+        out->iblocks[c] = t->iblocks[c][m];
+    }
+    out->i2block = t->i2block[m];
+    out->i3block = t->i3block[m];
+}
+
+/**
+ * Function that sets the level of every row whose pointer in a column is in use
+ * @param levels the level of each row
+ * @param col the column
+ * @param rows the number of rows, a multiple of INODE_TABLE_GROUP
+ * @param level the level to set
+ */
+void markColumnLevel(signed char *restrict levels, const int *restrict col, int rows, signed char level)
+{
+    //iteration variables
+    int g = 0;
+    int k = 0;
+    for (g = 0; g < rows; g += INODE_TABLE_GROUP)
+    {
+        for (k = 0; k < INODE_TABLE_GROUP; k++)
+        {
+            levels[g + k] = col[g + k] != UNUSED_INODE_SENTINEL ? level : levels[g + k];
+        }
+    }
+}
+
+/**
+ * Function that works out every inode's deepest level of indirection: the
+ * level defrag must be called with, or -1 for an inode not in use or without
+ * any blocks. Each column is a separate branch-free pass; deeper levels come
+ * later and overwrite shallower ones
+ * @param t the table
+ * @param levels receives the level of each row, so it must hold t->rows entries
+ */
+void classifyInodes(const inodeTable *t, signed char *levels)
+{
+    //iteration variables
+    int c = 0;
+    int g = 0;
+    int k = 0;
+    memset(levels, -1, t->rows);
+    for (c = 0; c < N_DBLOCKS; c++)
+    {
+        markColumnLevel(levels, t->dblocks[c], t->rows, ZERO_LEVELS);
+    }
+    for (c = 0; c < N_IBLOCKS; c++)
+    {
+        markColumnLevel(levels, t->iblocks[c], t->rows, ONE_LEVEL);
+    }
+    markColumnLevel(levels, t->i2block, t->rows, TWO_LEVELS);
+    markColumnLevel(levels, t->i3block, t->rows, THREE_LEVELS);
+    for (g = 0; g < t->rows; g += INODE_TABLE_GROUP)
+    {
+        for (k = 0; k < INODE_TABLE_GROUP; k++)
+        {
+            levels[g + k] = t->nlink[g + k] > 0 ? levels[g + k] : -1;
+        }
+    }
+}
+
+/**
+ * Function that adds one to the count of every row whose pointer in a column is in use
+ * @param counts the count of each row
+ * @param col the column
+ * @param rows the number of rows, a multiple of INODE_TABLE_GROUP
+ */
+void countColumn(int *restrict counts, const int *restrict col, int rows)
+{
+    //iteration variables
+    int g = 0;
+    int k = 0;
+    for (g = 0; g < rows; g += INODE_TABLE_GROUP)
+    {
+        for (k = 0; k < INODE_TABLE_GROUP; k++)
+        {
+            counts[g + k] += col[g + k] != UNUSED_INODE_SENTINEL;
+        }
+    }
+}
+
+/**
+ * Function that counts every inode's direct blocks, which for an inode without
+ * indirect blocks is all of its blocks
+ * @param t the table
+ * @param counts receives the count of each row, so it must hold t->rows entries
+ */
+void countDirectBlocks(const inodeTable *t, int *counts)
+{
+    //iteration variable
+    int c = 0;
+    memset(counts, 0, sizeof(int) * t->rows);
+    for (c = 0; c < N_DBLOCKS; c++)
+    {
+        countColumn(counts, t->dblocks[c], t->rows);
+    }
+}
+
+//-----------------------
+// Global: walkInodeBlocks
+//-----------------------
+
+/**Value returned by walkInodeBlocks when a block pointer lies outside the data region */
+#define WALK_BAD_POINTER -1
+
+/**
+ * Function called by walkInodeBlocks for every block an inode uses
+ * @param ctx the context pointer given to walkInodeBlocks
+ * @param blockNum the block's offset into the data region (in blocks)
+ * @param level the levels of indirection below this block: ZERO_LEVELS for a
+ * data block, up to THREE_LEVELS for an i3block
+ * @param logicalBlock for data blocks, the index of the block within the file; -1 otherwise
+ * @return 0 to continue the walk, or any other value to stop it and have
+ * walkInodeBlocks return that value
+ */
+typedef int (*blockVisitor)(void *ctx, int blockNum, int level, long logicalBlock);
+
+/**
+ * Holds the state shared by every step of a walk over one inode's blocks
+ */
+typedef struct
+{
+    const char *dataRegion; /* address of data block 0 in the image */
+    int blocksize;          /* size of blocks in bytes */
+    int numDataBlocks;      /* number of blocks in the data region */
+    blockVisitor visit;     /* function called for every block */
+    void *ctx;              /* context pointer handed to visit */
+} blockWalk;
+
+/**
+ * Function that visits a block and, if it is an indirect block, recursively
+ * visits every block it points to
+ * @param w the walk being performed
+ * @param blockNum the block to visit (in blocks from the start of the data region)
+ * @param level the levels of indirection below this block
+ * @param firstLogical the index within the file of the first data block under this block
+ * @return 0 if the walk should continue, or the value that stopped it
+ */
+int walkBlockTree(blockWalk *w, int blockNum, int level, long firstLogical)
+{
+    if (blockNum < 0 || blockNum >= w->numDataBlocks)
+    {
+        return WALK_BAD_POINTER;
+    }
+    int rc = w->visit(w->ctx, blockNum, level, level == ZERO_LEVELS ? firstLogical : -1);
+    if (rc != 0 || level == ZERO_LEVELS)
+    {
+        return rc;
+    }
+    //number of pointers that fit in one indirect block
+    int ptrsPerBlock = w->blocksize / sizeof(int);
+    //number of data blocks reachable through each pointer of this block
+    long span = 1;
+    //iteration variable
+    int j = 0;
+    for (j = 1; j < level; j++)
+    {
+        span *= ptrsPerBlock;
+    }
+    const int *ptrs = (const int *)&w->dataRegion[(size_t)blockNum * w->blocksize];
+    for (j = 0; j < ptrsPerBlock; j++)
+    {
+        if (ptrs[j] != UNUSED_INODE_SENTINEL)
+        {
+            rc = walkBlockTree(w, ptrs[j], level - 1, firstLogical + (j * span));
+            if (rc != 0)
+            {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function that visits every block an inode uses in the same order defrag lays
+ * them out: the direct blocks, then each indirect block followed by the blocks
+ * it points to, then the i2block tree and finally the i3block tree
+ * @param dataRegion address of data block 0 in the image
+ * @param blocksize the size of a block
+ * @param numDataBlocks the number of blocks in the data region
+ * @param in the inode whose blocks are visited
+ * @param visit function called for every block
+ * @param ctx context pointer handed to visit
+ * @return 0 if every block was visited, WALK_BAD_POINTER if a pointer lies outside
+ * the data region, or the nonzero value a call to visit returned
+ */
+int walkInodeBlocks(const char *dataRegion, int blocksize, int numDataBlocks, const inode *in, blockVisitor visit, void *ctx)
+{
+    blockWalk w = {dataRegion, blocksize, numDataBlocks, visit, ctx};
+    //number of pointers that fit in one indirect block
+    long ptrsPerBlock = blocksize / sizeof(int);
+    //index within the file of the first data block under the current pointer
+    long logical = 0;
+    //return code of the current step
+    int rc = 0;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < N_DBLOCKS && rc == 0; i++, logical++)
+    {
+        if (in->dblocks[i] != UNUSED_INODE_SENTINEL)
+        {
+            rc = walkBlockTree(&w, in->dblocks[i], ZERO_LEVELS, logical);
+        }
+    }
+    for (i = 0; i < N_IBLOCKS && rc == 0; i++, logical += ptrsPerBlock)
+    {
+        if (in->iblocks[i] != UNUSED_INODE_SENTINEL)
+        {
+            rc = walkBlockTree(&w, in->iblocks[i], ONE_LEVEL, logical);
+        }
+    }
+    if (rc == 0 && in->i2block != UNUSED_INODE_SENTINEL)
+    {
+        rc = walkBlockTree(&w, in->i2block, TWO_LEVELS, logical);
+    }
+    logical += ptrsPerBlock * ptrsPerBlock;
+    if (rc == 0 && in->i3block != UNUSED_INODE_SENTINEL)
+    {
+        rc = walkBlockTree(&w, in->i3block, THREE_LEVELS, logical);
+    }
+    return rc;
+}
+
+//-----------------------
+// Global: formatInt
+//-----------------------
+
+/**Every two-digit decimal number, used to print integers two digits at a time */
+static const char digitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/**
+ * Function that prints the decimal representation of an integer into a buffer.
+ * This does the same job as sprintf("%d"), but without parsing a format string
+ * and producing two digits per division, which matters when dumping every
+ * integer in a multi-gigabyte image
+ * @param out the position in the buffer to print to
+ * @param value the integer to print
+ * @return the position in the buffer just past the last character printed
+ */
+char *formatInt(char *out, int value)
+{
+    //magnitude of the value, negated in unsigned arithmetic so that INT_MIN is safe
+    unsigned int magnitude = (unsigned int)value;
+    if (value < 0)
+    {
+        *out++ = '-';
+        magnitude = 0u - magnitude;
+    }
+    //digits are produced from least significant to most significant, so build them backwards
+    char digits[10];
+    char *first = &digits[sizeof(digits)];
+    while (magnitude >= 100)
+    {
+        unsigned int pair = magnitude % 100;
+        magnitude /= 100;
+        first -= 2;
+        memcpy(first, &digitPairs[pair * 2], 2);
+    }
+    if (magnitude >= 10)
+    {
+        first -= 2;
+        memcpy(first, &digitPairs[magnitude * 2], 2);
+    }
+    else
+    {
+        *--first = '0' + magnitude;
+    }
+    //number of digits that were produced
+    size_t numDigits = &digits[sizeof(digits)] - first;
+    memcpy(out, first, numDigits);
+    return out + numDigits;
+}
+
+//-----------------------
+// Global: dump
+//-----------------------
+
+/**The number of integers printed on each line of a data block in a text dump */
+#define DUMP_INTS_PER_LINE 16
+/**The most characters an integer and the ", " that follows it can take up in a text dump */
+#define DUMP_MAX_INT_CHARS 13
+/**The most characters the "Data Block N - \n[" header and "]\n\n" trailer of a block can take up */
+#define DUMP_MAX_BLOCK_FRAME_CHARS 40
+/**The approximate number of bytes of text each dump worker formats before the text is written out */
+#define DUMP_CHUNK_BYTES (4 * 1024 * 1024)
+
+/**
+ * Appends a string literal to a dump buffer, evaluating to the position just past it
+ */
+#define DUMP_APPEND(out, literal) (memcpy((out), (literal), sizeof(literal) - 1), (out) + sizeof(literal) - 1)
+
+/**
+ * Holds the range of data blocks one dump worker formats, and the text it produced
+ */
+typedef struct
+{
+    const char *dataRegion; /* address of data block 0 in the image */
+    int blocksize;          /* size of blocks in bytes */
+    int firstBlock;         /* first data block this worker formats */
+    int numBlocks;          /* number of data blocks this worker formats */
+    char *text;             /* buffer the text is formatted into */
+    size_t textLen;         /* number of bytes of text produced */
+} dumpWorker;
+
+/**
+ * Function that prints a bracketed, comma-separated list of integers as used
+ * for the block pointers of an inode in a text dump
+ * @param out the position in the buffer to print to
+ * @param values the integers to print
+ * @param numValues the number of integers to print
+ * @return the position in the buffer just past the last character printed
+ */
+char *formatIntList(char *out, const int *values, int numValues)
+{
+    *out++ = '[';
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < numValues; i++)
+    {
+        if (i > 0)
+        {
+            out = DUMP_APPEND(out, ", ");
+        }
+        out = formatInt(out, values[i]);
+    }
+    *out++ = ']';
+    return out;
+}
+
+/**
+ * Function that prints the superblock and every inode in the inode region
+ * of a disk image in the text dump format
+ * @param out the buffer to print to, which must be large enough for the whole inode region
+ * @param image pointer to the first byte of the disk image
+ * @return the position in the buffer just past the last character printed
+ */
+char *formatDumpHeader(char *out, const char *image)
+{
+    superblock *sb = (superblock *)&image[SUPERBLOCK_SIZE];
+    out = DUMP_APPEND(out, "Superblock-\nBlocksize: ");
+    out = formatInt(out, sb->blocksize);
+    out = DUMP_APPEND(out, "\nData offset: ");
+    out = formatInt(out, sb->data_offset);
+    out = DUMP_APPEND(out, "\nFree block: ");
+    out = formatInt(out, sb->free_block);
+    out = DUMP_APPEND(out, "\nFree inode: ");
+    out = formatInt(out, sb->free_inode);
+    out = DUMP_APPEND(out, "\nInode offset: ");
+    out = formatInt(out, sb->inode_offset);
+    out = DUMP_APPEND(out, "\nSwap offset: ");
+    out = formatInt(out, sb->swap_offset);
+    out = DUMP_APPEND(out, "\n");
+
+    //the total possible number of inodes in the region
+    int totalInodes = ((sb->data_offset - sb->inode_offset) * sb->blocksize) / INODE_SIZE;
+    //start of the inode region
+    size_t inodeStart = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + ((size_t)sb->inode_offset * sb->blocksize);
+    //iteration variable
+    int m = 0;
+    for (m = 0; m < totalInodes; m++)
+    {
+        inode *i = (inode *)&image[inodeStart + ((size_t)m * INODE_SIZE)];
+        out = DUMP_APPEND(out, "\nInode ");
+        out = formatInt(out, m);
+        out = DUMP_APPEND(out, " -\nNext inode: ");
+        out = formatInt(out, i->next_inode);
+        out = DUMP_APPEND(out, "\nProtect: ");
+        out = formatInt(out, i->protect);
+        out = DUMP_APPEND(out, "\nNlink: ");
+        out = formatInt(out, i->nlink);
+        out = DUMP_APPEND(out, "\nSize: ");
+        out = formatInt(out, i->size);
+        out = DUMP_APPEND(out, "\nUid: ");
+        out = formatInt(out, i->uid);
+        out = DUMP_APPEND(out, "\nGid: ");
+        out = formatInt(out, i->gid);
+        out = DUMP_APPEND(out, "\nCtime: ");
+        out = formatInt(out, i->ctime);
+        out = DUMP_APPEND(out, "\nMtime: ");
+        out = formatInt(out, i->mtime);
+        out = DUMP_APPEND(out, "\nAtime: ");
+        out = formatInt(out, i->atime);
+        out = DUMP_APPEND(out, "\nDblocks: ");
+        out = formatIntList(out, i->dblocks, N_DBLOCKS);
+        out = DUMP_APPEND(out, "\nIblocks: ");
+        out = formatIntList(out, i->iblocks, N_IBLOCKS);
+        out = DUMP_APPEND(out, "\nI2block: ");
+        out = formatInt(out, i->i2block);
+        out = DUMP_APPEND(out, "\nI3block: ");
+        out = formatInt(out, i->i3block);
+        out = DUMP_APPEND(out, "\n");
+    }
+    return out;
+}
+
+/**
+ * Thread entry point that prints a dump worker's range of data blocks into its text buffer
+ * @param arg pointer to the dumpWorker describing the range
+ * @return always NULL
+ */
+void *formatDumpBlocks(void *arg)
+{
+    dumpWorker *w = (dumpWorker *)arg;
+    //number of integers in one data block
+    int intsPerBlock = w->blocksize / sizeof(int);
+    //current position in the text buffer
+    char *out = w->text;
+    //iteration variables
+    int b = 0;
+    int j = 0;
+    for (b = 0; b < w->numBlocks; b++)
+    {
+        int blockNum = w->firstBlock + b;
+        const int *words = (const int *)&w->dataRegion[(size_t)blockNum * w->blocksize];
+        out = DUMP_APPEND(out, "Data Block ");
+        out = formatInt(out, blockNum);
+        out = DUMP_APPEND(out, " - \n[");
+        for (j = 0; j < intsPerBlock; j++)
+        {
+            if (j > 0 && j % DUMP_INTS_PER_LINE == 0)
+            {
+                *out++ = '\n';
+            }
+            //zero is by far the most common value, so skip the general formatter for it
+            if (words[j] == 0)
+            {
+                out = DUMP_APPEND(out, "0, ");
+            }
+            else
+            {
+                out = formatInt(out, words[j]);
+                out = DUMP_APPEND(out, ", ");
+            }
+        }
+        out = DUMP_APPEND(out, "]\n\n");
+    }
+    w->textLen = out - w->text;
+    return NULL;
+}
+
+/**
+ * Function that writes a text dump of a disk image: the superblock, every inode
+ * and every data block. Data blocks are formatted in parallel, each worker
+ * formatting a contiguous range into its own buffer, and the buffers are written
+ * out in block order so the text is identical to a sequential dump
+ * @param image pointer to the first byte of the disk image
+ * @param imageSize the size of the disk image in bytes
+ * @param fd the file descriptor to write the dump to
+ * @param numThreads the number of worker threads to format data blocks with
+ */
+void dump(const char *image, size_t imageSize, int fd, int numThreads)
+{
+    superblock *sb = (superblock *)&image[SUPERBLOCK_SIZE];
+    checkSuperblock(sb, imageSize);
+    int blocksize = sb->blocksize;
+
+    //the superblock and inode region are small, so format them in one go
+    size_t inodeRegionSize = (size_t)(sb->data_offset - sb->inode_offset) * blocksize;
+    char *header = malloc(SUPERBLOCK_SIZE + ((inodeRegionSize / INODE_SIZE) + 1) * INODE_SIZE * DUMP_MAX_INT_CHARS);
+    if (header == NULL)
+    {
+        error_msg("Allocating memory for the dump failed.");
+    }
+    writeFully(fd, header, formatDumpHeader(header, image) - header);
+    free(header);
+
+    //most text one data block can produce
+    size_t maxBlockText = DUMP_MAX_BLOCK_FRAME_CHARS + (size_t)(blocksize / sizeof(int)) * (DUMP_MAX_INT_CHARS + 1);
+    //number of blocks each worker formats per round
+    int blocksPerWorker = DUMP_CHUNK_BYTES / maxBlockText;
+    if (blocksPerWorker < 1)
+    {
+        blocksPerWorker = 1;
+    }
+    dumpWorker workers[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    //iteration variable
+    int t = 0;
+    for (t = 0; t < numThreads; t++)
+    {
+        workers[t].dataRegion = &image[(BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + ((size_t)sb->data_offset * blocksize)];
+        workers[t].blocksize = blocksize;
+        workers[t].text = malloc(maxBlockText * blocksPerWorker);
+        if (workers[t].text == NULL)
+        {
+            error_msg("Allocating memory for the dump failed.");
+        }
+    }
+
+    //total number of data blocks in the data region
+    int numDataBlocks = sb->swap_offset - sb->data_offset;
+    //first data block not yet formatted
+    int nextBlock = 0;
+    while (nextBlock < numDataBlocks)
+    {
+        //number of workers that have a range this round
+        int numActive = 0;
+        for (t = 0; t < numThreads && nextBlock < numDataBlocks; t++)
+        {
+            workers[t].firstBlock = nextBlock;
+            workers[t].numBlocks = numDataBlocks - nextBlock < blocksPerWorker ? numDataBlocks - nextBlock : blocksPerWorker;
+            nextBlock += workers[t].numBlocks;
+            numActive++;
+        }
+        //worker 0 runs on this thread, so a single-threaded dump starts no threads at all
+        for (t = 1; t < numActive; t++)
+        {
+            if (pthread_create(&threads[t], NULL, formatDumpBlocks, &workers[t]) != 0)
+            {
+                error_msg("Error starting dump worker thread.");
+            }
+        }
+        formatDumpBlocks(&workers[0]);
+        //join and write in block order so the output is deterministic
+        writeFully(fd, workers[0].text, workers[0].textLen);
+        for (t = 1; t < numActive; t++)
+        {
+            pthread_join(threads[t], NULL);
+            writeFully(fd, workers[t].text, workers[t].textLen);
+        }
+    }
+
+    for (t = 0; t < numThreads; t++)
+    {
+        free(workers[t].text);
+    }
+}
+
+//-----------------------
+// Global: parseThreads
+//-----------------------
+
+/**
+ * Function that parses the value of a --threads= option, where 0 or an omitted
+ * option means one thread per online processor
+ * @param value the text after the '=' sign, or NULL if the option was not given
+ * @param max the most threads the caller supports
+ * @return the number of threads to use, between 1 and max
+ */
+int parseThreads(const char *value, int max)
+{
+    //number of threads requested
+    long threads = 0;
+    if (value != NULL)
+    {
+        char *end;
+        threads = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || threads < 0)
+        {
+            error_msg("Invalid value for --threads.");
+        }
+    }
+    if (threads == 0)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    return threads > max ? max : threads;
+}
+
+//-----------------------
+// Global: dumpCommand
+//-----------------------
+
+/**
+ * Entry point of the dump subcommand, which writes a text dump of a disk image
+ * in the same format as the *-output.txt files kept next to the sample images.
+ * Usage: dump [--threads=N] <image> [<output>]; the dump goes to standard output
+ * when no output file is given
+ * @param argc the number of arguments after the subcommand name
+ * @param argv the arguments after the subcommand name
+ * @return 0 on success
+ */
+int dumpCommand(int argc, char *argv[])
+{
+    //value of the --threads= option, if given
+    const char *threadsValue = NULL;
+    //how the image is read
+    int ioBackend = IO_AUTO;
+    //positional arguments: the image and the optional output file
+    char *positional[2] = {NULL, NULL};
+    int numPositional = 0;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--threads=", strlen("--threads=")) == 0)
+        {
+            threadsValue = argv[i] + strlen("--threads=");
+        }
+        else if (strncmp(argv[i], "--io=", strlen("--io=")) == 0)
+        {
+            ioBackend = parseIoBackend(argv[i] + strlen("--io="));
+        }
+        else if (numPositional < 2 && argv[i][0] != '-')
+        {
+            positional[numPositional++] = argv[i];
+        }
+        else
+        {
+            error_msg("Usage: disk-defrag dump [--threads=N] [--io=BACKEND] <image> [<output>]");
+        }
+    }
+    if (numPositional < 1)
+    {
+        error_msg("Usage: disk-defrag dump [--threads=N] [--io=BACKEND] <image> [<output>]");
+    }
+
+    size_t imageSize;
+    char *image = loadDiskImage(positional[0], ioBackend, &imageSize);
+    if (ioBackend == IO_AUTO || ioBackend == IO_MMAP)
+    {
+        //the dump is read front to back, so let the kernel read ahead aggressively
+        madvise(image, imageSize, MADV_SEQUENTIAL);
+    }
+
+    //file descriptor the dump is written to
+    int fd = STDOUT_FILENO;
+    if (positional[1] != NULL)
+    {
+        fd = open(positional[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            error_msg("Error opening dump output file.");
+        }
+    }
+    dump(image, imageSize, fd, parseThreads(threadsValue, MAX_THREADS));
+    if (fd != STDOUT_FILENO && close(fd) != 0)
+    {
+        error_msg("Error writing output file.");
+    }
+    unloadDiskImage(image, imageSize, ioBackend);
+    return 0;
+}
+
+//-----------------------
+// Global: hashBytes
+//-----------------------
+
+/**Multipliers used by hashBytes to mix bits */
+#define HASH_PRIME_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME_3 0x165667B19E3779F9ULL
+
+/**
+ * Function that rotates a 64-bit integer left
+ * @param x the integer to rotate
+ * @param r the number of bits to rotate by, between 1 and 63
+ * @return the rotated integer
+ */
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * Function that computes a fast, non-cryptographic 64-bit hash of a region of
+ * memory. Four independent lanes consume 32 bytes per step, so the hash runs at
+ * close to memory bandwidth. Passing the previous result as the seed chains
+ * hashes of several regions together
+ * @param data pointer to the first byte to hash
+ * @param len the number of bytes to hash
+ * @param seed the starting value of the hash
+ * @return the hash of the region
+ */
+uint64_t hashBytes(const char *data, size_t len, uint64_t seed)
+{
+    uint64_t lanes[4] = {seed + HASH_PRIME_1 + HASH_PRIME_2, seed + HASH_PRIME_2, seed, seed - HASH_PRIME_1};
+    //the 64-bit word currently being mixed in
+    uint64_t word;
+    //iteration variable
+    int k = 0;
+    //the length is mixed in so that regions that differ only in trailing zeros differ
+    uint64_t h = len * HASH_PRIME_3;
+    while (len >= 4 * sizeof(uint64_t))
+    {
+        for (k = 0; k < 4; k++)
+        {
+            memcpy(&word, &data[k * sizeof(uint64_t)], sizeof(uint64_t));
+            lanes[k] = rotl64(lanes[k] + (word * HASH_PRIME_2), 31) * HASH_PRIME_1;
+        }
+        data += 4 * sizeof(uint64_t);
+        len -= 4 * sizeof(uint64_t);
+    }
+    h += rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+    while (len >= sizeof(uint64_t))
+    {
+        memcpy(&word, data, sizeof(uint64_t));
+        h ^= rotl64(word * HASH_PRIME_2, 31) * HASH_PRIME_1;
+        h = (rotl64(h, 27) * HASH_PRIME_1) + HASH_PRIME_3;
+        data += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+    while (len > 0)
+    {
+        h ^= (unsigned char)*data * HASH_PRIME_3;
+        h = rotl64(h, 11) * HASH_PRIME_1;
+        data++;
+        len--;
+    }
+    //final avalanche so every input bit affects every output bit
+    h ^= h >> 33;
+    h *= HASH_PRIME_2;
+    h ^= h >> 29;
+    h *= HASH_PRIME_3;
+    h ^= h >> 32;
+    return h;
+}
+
+//-----------------------
+// Global: diff
+//-----------------------
+
+/**Exit status of the diff subcommand when the two images hold different content */
+#define DIFF_EXIT_CORRUPT 2
+/**The number of inodes a diff worker claims at a time */
+#define DIFF_INODES_PER_CLAIM 64
+
+/**Possible outcomes of comparing one inode across two images */
+#define INODE_IDENTICAL 0 /* records and contents are the same */
+#define INODE_RELOCATED 1 /* only the block pointers differ; contents are the same */
+#define INODE_METADATA 2  /* a field other than the block pointers differs */
+#define INODE_CONTENT 3   /* the file contents differ */
+#define INODE_BAD_PTR 4   /* a block pointer lies outside the data region */
+
+/**
+ * Holds the running hash of one file's contents while its blocks are walked
+ */
+typedef struct
+{
+    const char *dataRegion; /* address of data block 0 in the image */
+    int blocksize;          /* size of blocks in bytes */
+    long fileSize;          /* number of bytes in the file */
+    uint64_t hash;          /* hash of the contents seen so far */
+    long numBlocks;         /* number of blocks (data and indirect) the file uses */
+} fileHash;
+
+/**
+ * Holds what a diff found out about one inode
+ */
+typedef struct
+{
+    int outcome;        /* one of the INODE_ outcomes */
+    long blocksA;       /* blocks the inode uses in the first image */
+    long blocksB;       /* blocks the inode uses in the second image */
+} inodeDiff;
+
+/**
+ * Holds the images being compared and the work shared between diff workers
+ */
+typedef struct
+{
+    diskLayout *a;        /* the first image */
+    diskLayout *b;        /* the second image */
+    int numInodes;        /* number of inodes to compare */
+    int nextInode;        /* next inode not yet claimed by a worker */
+    inodeDiff *results;   /* per-inode results, indexed by inode number */
+} diffJob;
+
+/**
+ * Visitor that mixes a data block into the hash of a file's contents. Only the
+ * bytes before the end of the file count, and each block is tagged with its
+ * index in the file, so the hash depends on the logical contents and not on
+ * where the blocks happen to be placed
+ * @param ctx pointer to the fileHash being computed
+ * @param blockNum the block being visited
+ * @param level the levels of indirection below the block
+ * @param logicalBlock the index of a data block within the file
+ * @return always 0
+ */
+int hashFileBlock(void *ctx, int blockNum, int level, long logicalBlock)
+{
+    fileHash *fh = (fileHash *)ctx;
+    fh->numBlocks++;
+    if (level != ZERO_LEVELS)
+    {
+        return 0;
+    }
+    //byte offset of this block within the file
+    long fileOffset = logicalBlock * fh->blocksize;
+    //number of bytes of this block that are part of the file
+    long len = fh->fileSize - fileOffset;
+    if (len > fh->blocksize)
+    {
+        len = fh->blocksize;
+    }
+    if (len < 0)
+    {
+        len = 0;
+    }
+    fh->hash = hashBytes(&fh->dataRegion[(size_t)blockNum * fh->blocksize], len, fh->hash ^ (logicalBlock * HASH_PRIME_1));
+    return 0;
+}
+
+/**
+ * Function that hashes the logical contents of the file an inode describes
+ * @param d the layout of the image holding the inode
+ * @param in the inode
+ * @param fh the hash to fill in
+ * @return 0, or WALK_BAD_POINTER if one of the inode's block pointers is invalid
+ */
+int hashFile(diskLayout *d, inode *in, fileHash *fh)
+{
+    fh->dataRegion = d->dataRegion;
+    fh->blocksize = d->blocksize;
+    fh->fileSize = in->size;
+    fh->hash = in->size;
+    fh->numBlocks = 0;
+    return walkInodeBlocks(d->dataRegion, d->blocksize, d->numDataBlocks, in, hashFileBlock, fh);
+}
+
+/**
+ * Function that compares one inode across the two images of a diff
+ * @param job the diff being performed
+ * @param m the inode number
+ */
+void diffInode(diffJob *job, int m)
+{
+    inode *ia = inodeAt(job->a, m);
+    inode *ib = inodeAt(job->b, m);
+    inodeDiff *r = &job->results[m];
+    r->blocksA = 0;
+    r->blocksB = 0;
+    //everything before the block pointers is file metadata
+    if (memcmp(ia, ib, offsetof(inode, dblocks)) != 0)
+    {
+        r->outcome = INODE_METADATA;
+        return;
+    }
+    //an unused inode has no blocks to compare
+    if (ia->nlink <= 0)
+    {
+        r->outcome = INODE_IDENTICAL;
+        return;
+    }
+    fileHash ha;
+    fileHash hb;
+    if (hashFile(job->a, ia, &ha) != 0 || hashFile(job->b, ib, &hb) != 0)
+    {
+        r->outcome = INODE_BAD_PTR;
+        return;
+    }
+    r->blocksA = ha.numBlocks;
+    r->blocksB = hb.numBlocks;
+    if (ha.hash != hb.hash)
+    {
+        r->outcome = INODE_CONTENT;
+    }
+    else if (memcmp(ia, ib, INODE_SIZE) != 0)
+    {
+        r->outcome = INODE_RELOCATED;
+    }
+    else
+    {
+        r->outcome = INODE_IDENTICAL;
+    }
+}
+
+/**
+ * Thread entry point that claims groups of inodes and compares them until none are left
+ * @param arg pointer to the diffJob being performed
+ * @return always NULL
+ */
+void *diffWorker(void *arg)
+{
+    diffJob *job = (diffJob *)arg;
+    while (1)
+    {
+        //first inode of the group this worker claimed
+        int first = __atomic_fetch_add(&job->nextInode, DIFF_INODES_PER_CLAIM, __ATOMIC_RELAXED);
+        if (first >= job->numInodes)
+        {
+            return NULL;
+        }
+        //iteration variable
+        int m = first;
+        for (m = first; m < first + DIFF_INODES_PER_CLAIM && m < job->numInodes; m++)
+        {
+            diffInode(job, m);
+        }
+    }
+}
+
+/**
+ * Function that structurally compares two disk images and prints what differs.
+ * Differences that only move blocks around (block pointers and the free list)
+ * are reported as layout differences; differences in superblock geometry,
+ * inode metadata or file contents are reported as corruption
+ * @param a the layout of the first image
+ * @param b the layout of the second image
+ * @param numThreads the number of threads to hash files with
+ * @return 0 if both images hold the same files, DIFF_EXIT_CORRUPT otherwise
+ */
+int diff(diskLayout *a, diskLayout *b, int numThreads)
+{
+    //number of differences that change what the images hold
+    long corrupt = 0;
+    superblock *sa = a->sb;
+    superblock *sbB = b->sb;
+    if (sa->blocksize != sbB->blocksize || sa->inode_offset != sbB->inode_offset || sa->data_offset != sbB->data_offset || sa->swap_offset != sbB->swap_offset)
+    {
+        printf("superblock: geometry differs (blocksize %d/%d, inode offset %d/%d, data offset %d/%d, swap offset %d/%d)\n",
+               sa->blocksize, sbB->blocksize, sa->inode_offset, sbB->inode_offset, sa->data_offset, sbB->data_offset, sa->swap_offset, sbB->swap_offset);
+        corrupt++;
+    }
+    if (sa->free_inode != sbB->free_inode)
+    {
+        printf("superblock: free inode list head differs (%d/%d)\n", sa->free_inode, sbB->free_inode);
+        corrupt++;
+    }
+
+    diffJob job;
+    job.a = a;
+    job.b = b;
+    job.numInodes = a->totalInodes < b->totalInodes ? a->totalInodes : b->totalInodes;
+    job.nextInode = 0;
+    job.results = malloc(sizeof(inodeDiff) * (job.numInodes + 1));
+    if (job.results == NULL)
+    {
+        error_msg("Allocating memory for the diff failed.");
+    }
+    pthread_t threads[MAX_THREADS];
+    //iteration variable
+    int t = 0;
+    for (t = 1; t < numThreads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, diffWorker, &job) != 0)
+        {
+            error_msg("Error starting diff worker thread.");
+        }
+    }
+    diffWorker(&job);
+    for (t = 1; t < numThreads; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    //tallies of each outcome, and of the blocks files use in each image
+    long outcomes[INODE_BAD_PTR + 1] = {0};
+    long usedA = 0;
+    long usedB = 0;
+    //iteration variable
+    int m = 0;
+    for (m = 0; m < job.numInodes; m++)
+    {
+        inodeDiff *r = &job.results[m];
+        outcomes[r->outcome]++;
+        usedA += r->blocksA;
+        usedB += r->blocksB;
+        if (r->outcome == INODE_METADATA)
+        {
+            printf("inode %d: metadata differs\n", m);
+        }
+        else if (r->outcome == INODE_CONTENT)
+        {
+            printf("inode %d: contents differ\n", m);
+        }
+        else if (r->outcome == INODE_BAD_PTR)
+        {
+            printf("inode %d: block pointer outside the data region\n", m);
+        }
+    }
+    corrupt += outcomes[INODE_METADATA] + outcomes[INODE_CONTENT] + outcomes[INODE_BAD_PTR];
+    //inodes only one of the images has room for must be unused
+    diskLayout *larger = a->totalInodes > b->totalInodes ? a : b;
+    for (m = job.numInodes; m < larger->totalInodes; m++)
+    {
+        if (inodeAt(larger, m)->nlink > 0)
+        {
+            printf("inode %d: only present in %s image\n", m, larger == a ? "first" : "second");
+            corrupt++;
+        }
+    }
+
+    //every data block should be either used by a file or on the free list
+    int freeA = countFreeBlocks(a);
+    int freeB = countFreeBlocks(b);
+    if (freeA < 0 || freeB < 0)
+    {
+        printf("free list: malformed in %s image\n", freeA < 0 ? "first" : "second");
+        corrupt++;
+    }
+    else if (usedA + freeA > a->numDataBlocks || usedB + freeB > b->numDataBlocks)
+    {
+        printf("free list: blocks claimed by both a file and the free list in %s image\n", usedA + freeA > a->numDataBlocks ? "first" : "second");
+        corrupt++;
+    }
+    else if (sa->free_block != sbB->free_block || freeA != freeB)
+    {
+        //blocks neither used nor free were leaked by whatever last wrote the image
+        printf("free list: layout differs (head %d/%d, %d/%d blocks free, %ld/%ld blocks unaccounted for)\n",
+               sa->free_block, sbB->free_block, freeA, freeB, a->numDataBlocks - usedA - freeA, b->numDataBlocks - usedB - freeB);
+    }
+
+    printf("%d inodes compared: %ld identical, %ld relocated with identical contents, %ld differ\n",
+           job.numInodes, outcomes[INODE_IDENTICAL], outcomes[INODE_RELOCATED],
+           outcomes[INODE_METADATA] + outcomes[INODE_CONTENT] + outcomes[INODE_BAD_PTR]);
+    printf("%s\n", corrupt == 0 ? "images hold the same files" : "images hold different files");
+
+    free(job.results);
+    return corrupt == 0 ? 0 : DIFF_EXIT_CORRUPT;
+}
+
+//-----------------------
+// Global: diffCommand
+//-----------------------
+
+/**
+ * Entry point of the diff subcommand, which structurally compares two disk images.
+ * Usage: diff [--threads=N] <image> <image>
+ * @param argc the number of arguments after the subcommand name
+ * @param argv the arguments after the subcommand name
+ * @return 0 if both images hold the same files, DIFF_EXIT_CORRUPT otherwise
+ */
+int diffCommand(int argc, char *argv[])
+{
+    //value of the --threads= option, if given
+    const char *threadsValue = NULL;
+    //how the images are read
+    int ioBackend = IO_AUTO;
+    //the two images to compare
+    char *positional[2] = {NULL, NULL};
+    int numPositional = 0;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--threads=", strlen("--threads=")) == 0)
+        {
+            threadsValue = argv[i] + strlen("--threads=");
+        }
+        else if (strncmp(argv[i], "--io=", strlen("--io=")) == 0)
+        {
+            ioBackend = parseIoBackend(argv[i] + strlen("--io="));
+        }
+        else if (numPositional < 2 && argv[i][0] != '-')
+        {
+            positional[numPositional++] = argv[i];
+        }
+        else
+        {
+            error_msg("Usage: disk-defrag diff [--threads=N] [--io=BACKEND] <image> <image>");
+        }
+    }
+    if (numPositional != 2)
+    {
+        error_msg("Usage: disk-defrag diff [--threads=N] [--io=BACKEND] <image> <image>");
+    }
+
+    diskLayout a;
+    diskLayout b;
+    size_t size;
+    char *image = loadDiskImage(positional[0], ioBackend, &size);
+    describeImage(image, size, &a);
+    image = loadDiskImage(positional[1], ioBackend, &size);
+    describeImage(image, size, &b);
+    int rc = diff(&a, &b, parseThreads(threadsValue, MAX_THREADS));
+    unloadDiskImage(a.image, a.size, ioBackend);
+    unloadDiskImage(b.image, b.size, ioBackend);
+    return rc;
+}
+
+//-----------------------
+// Global: blockIndex
+//-----------------------
+
+/**Magic bytes at the start of a block index file */
+#define BLOCK_INDEX_MAGIC "DDBLKIDX"
+/**Version of the block index file format; bumped whenever the layout changes */
+#define BLOCK_INDEX_VERSION 4
+/**Suffix added to an image's path to name its sidecar block index */
+#define BLOCK_INDEX_SUFFIX ".idx"
+/**Flag set on an indexed inode that has a block pointer outside the data region */
+#define INDEXED_BAD_POINTER 1
+/**Flag set on an indexed inode that is in use, i.e. has links */
+#define INDEXED_IN_USE 2
+
+/**Sections of a block index with a checksum of their own, as bits */
+#define INDEX_SECTION_INODES 1
+#define INDEX_SECTION_EXTENTS 2
+#define INDEX_SECTION_BITMAP 4
+#define INDEX_SECTIONS_ALL (INDEX_SECTION_INODES | INDEX_SECTION_EXTENTS | INDEX_SECTION_BITMAP)
+
+/**
+ * Header at the start of a block index file. The index is keyed by the size and
+ * mtime of the image and a hash of its superblock, and is only trusted while all
+ * three still match the image. Every section is 8-byte aligned so a mapped index
+ * can be used in place, except the extents, which a file stores delta and varint
+ * coded (see encodeExtents). Loading checks only the header's own checksum; each
+ * section's checksum is checked, and the extents decoded, when something first uses it
+ */
+typedef struct
+{
+    char magic[8];           /* BLOCK_INDEX_MAGIC */
+    uint32_t version;        /* BLOCK_INDEX_VERSION */
+    uint32_t blocksize;      /* size of blocks in the image */
+    uint64_t imageSize;      /* size of the image in bytes */
+    int64_t imageMtimeSec;   /* mtime of the image, seconds */
+    int64_t imageMtimeNsec;  /* mtime of the image, nanoseconds */
+    uint64_t superblockHash; /* hashBytes of the image's superblock */
+    uint64_t headerChecksum; /* hashBytes of this header with headerChecksum zero */
+    uint64_t inodesChecksum; /* hashBytes of the indexedInode table */
+    uint64_t extentsChecksum; /* hashBytes of the coded extents, up to the bitmap */
+    uint64_t bitmapChecksum; /* hashBytes of the used-block bitmap */
+    uint32_t numInodes;      /* number of inodes in the inode region */
+    uint32_t numDataBlocks;  /* number of blocks in the data region */
+    uint64_t numExtents;     /* number of extents over all inodes */
+    uint64_t inodesOffset;   /* offset of the indexedInode table */
+    uint64_t extentsOffset;  /* offset of the blockExtent array, or in a file of the coded extents */
+    uint64_t bitmapOffset;   /* offset of the used-block bitmap */
+    uint64_t totalSize;      /* size of the whole index in bytes */
+} blockIndexHeader;
+
+/**
+ * Entry of the block index for one inode
+ */
+typedef struct
+{
+    uint64_t firstExtent; /* index of the inode's first extent */
+    uint32_t numExtents;  /* number of extents the inode's blocks form */
+    uint32_t numBlocks;   /* number of blocks (data and indirect) the inode uses */
+    uint32_t flags;       /* INDEXED_ flags */
+    uint32_t reserved;    /* keeps entries 8-byte aligned */
+    uint64_t recordHash;  /* hashBytes of the inode's record, to spot inodes changed since indexing */
+} indexedInode;
+
+/**
+ * A run of consecutive data blocks, in the order defrag would lay them out
+ */
+typedef struct
+{
+    int32_t start;  /* first block of the run (in blocks from the start of the data region) */
+    int32_t length; /* number of blocks in the run */
+} blockExtent;
+
+/**
+ * An index of every inode's extents and of which data blocks are in use, either
+ * built in memory or mapped from a sidecar file
+ */
+typedef struct
+{
+    blockIndexHeader *header; /* start of the index */
+    indexedInode *inodes;     /* one entry per inode */
+    blockExtent *extents;     /* every inode's extents, one inode after another */
+    uint64_t *usedBitmap;     /* bit n set when data block n is used by some file */
+    int mapped;               /* nonzero when the index is mapped from a file */
+    blockExtent *decoded;     /* the extents of a mapped index, decoded from the file, or NULL */
+    int checked;              /* INDEX_SECTION_ bits of the sections known to be intact */
+} blockIndex;
+
+/**
+ * Holds the extents of the inode being indexed while its blocks are walked
+ */
+typedef struct
+{
+    blockExtent *extents; /* extents of every inode indexed so far */
+    uint64_t numExtents;  /* number of extents in use */
+    uint64_t capacity;    /* number of extents allocated */
+    uint64_t *usedBitmap; /* bitmap of used data blocks */
+    uint32_t numBlocks;   /* blocks the current inode uses */
+    arena *scratch;       /* where extents and usedBitmap are allocated */
+} extentBuilder;
+
+/**
+ * Function that tests whether a block is marked in a block bitmap
+ * @param bitmap the bitmap
+ * @param blockNum the block to test
+ * @return nonzero if the block is marked
+ */
+static inline int testBlockBit(const uint64_t *bitmap, int blockNum)
+{
+    return (bitmap[blockNum / 64] >> (blockNum % 64)) & 1;
+}
+
+/**
+ * Function that marks a block in a block bitmap
+ * @param bitmap the bitmap
+ * @param blockNum the block to mark
+ */
+static inline void setBlockBit(uint64_t *bitmap, int blockNum)
+{
+    bitmap[blockNum / 64] |= 1ULL << (blockNum % 64);
+}
+
+/**
+ * Visitor that appends a block to the extents of the inode being indexed,
+ * extending the last extent when the block directly follows it
+ * @param ctx pointer to the extentBuilder
+ * @param blockNum the block being visited
+ * @param level the levels of indirection below the block
+ * @param logicalBlock the index of a data block within the file
+ * @return always 0
+ */
+int addBlockToExtents(void *ctx, int blockNum, int level, long logicalBlock)
+{
+    extentBuilder *b = (extentBuilder *)ctx;
+    setBlockBit(b->usedBitmap, blockNum);
+    //the first block of an inode always starts a new extent
+    if (b->numBlocks > 0)
+    {
+        blockExtent *last = &b->extents[b->numExtents - 1];
+        if (last->start + last->length == blockNum)
+        {
+            last->length++;
+            b->numBlocks++;
+            return 0;
+        }
+    }
+    if (b->numExtents == b->capacity)
+    {
+        uint64_t capacity = b->capacity * 2 + 1024;
+        b->extents = arenaGrow(b->scratch, b->extents, sizeof(blockExtent) * b->capacity, sizeof(blockExtent) * capacity);
+        b->capacity = capacity;
+    }
+    b->extents[b->numExtents].start = blockNum;
+    b->extents[b->numExtents].length = 1;
+    b->numExtents++;
+    b->numBlocks++;
+    return 0;
+}
+
+/**
+ * Function that marks a run of blocks in a block bitmap
+ * @param bitmap the bitmap
+ * @param start the first block to mark
+ * @param n the number of blocks to mark
+ */
+void setBlockRange(uint64_t *bitmap, int start, int n)
+{
+    //iteration variable
+    int b = 0;
+    for (b = start; b < start + n; b++)
+    {
+        setBlockBit(bitmap, b);
+    }
+}
+
+/**
+ * Function that unmarks a run of blocks in a block bitmap
+ * @param bitmap the bitmap
+ * @param start the first block to unmark
+ * @param n the number of blocks to unmark
+ */
+void clearBlockRange(uint64_t *bitmap, int start, int n)
+{
+    //iteration variable
+    int b = 0;
+    for (b = start; b < start + n; b++)
+    {
+        bitmap[b / 64] &= ~(1ULL << (b % 64));
+    }
+}
+
+/**
+ * Function that finds the first run of unmarked blocks long enough to hold a file,
+ * starting the search at a given block
+ * @param bitmap the bitmap of used blocks
+ * @param numBlocks the number of blocks the bitmap covers
+ * @param from the block to start searching at
+ * @param n the number of blocks needed
+ * @return the first block of the run, or -1 if there is no such run at or after from
+ */
+int findFreeRun(const uint64_t *bitmap, int numBlocks, int from, int n)
+{
+    //first block of the free run being measured, and its length so far
+    int runStart = from;
+    int runLen = 0;
+    //iteration variable
+    int b = from;
+    while (b < numBlocks && runLen < n)
+    {
+        //skip whole words of used blocks at once
+        if (b % 64 == 0 && bitmap[b / 64] == ~0ULL)
+        {
+            b += 64;
+            runLen = 0;
+            continue;
+        }
+        if (testBlockBit(bitmap, b))
+        {
+            runLen = 0;
+        }
+        else
+        {
+            if (runLen == 0)
+            {
+                runStart = b;
+            }
+            runLen++;
+        }
+        b++;
+    }
+    return runLen >= n && runStart + n <= numBlocks ? runStart : -1;
+}
+
+/**
+ * Function that rounds a size up to a multiple of 8 bytes
+ * @param n the size
+ * @return the rounded size
+ */
+static inline uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~(uint64_t)7;
+}
+
+/**
+ * Function that appends a value to a buffer as a varint: seven bits per byte,
+ * least significant first, with the top bit set on every byte but the last
+ * @param out where to write, or NULL to only count the bytes
+ * @param value the value
+ * @return the number of bytes the varint takes
+ */
+static inline int putVarint(uint8_t *out, uint64_t value)
+{
+    //number of bytes written
+    int n = 0;
+    while (value >= 0x80)
+    {
+        if (out != NULL)
+        {
+            out[n] = (uint8_t)value | 0x80;
+        }
+        n++;
+        value >>= 7;
+    }
+    if (out != NULL)
+    {
+        out[n] = (uint8_t)value;
+    }
+    return n + 1;
+}
+
+/**
+ * Function that reads a varint written by putVarint
+ * @param p the position to read from, advanced past the varint
+ * @param end the end of the buffer
+ * @param value receives the value
+ * @return 1 on success, 0 if the varint runs past end or is too long
+ */
+static inline int getVarint(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+    *value = 0;
+    //iteration variable
+    int shift = 0;
+    for (shift = 0; shift < 64 && *p < end; shift += 7)
+    {
+        uint8_t byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function that codes extents compactly for storage: each extent is the
+ * distance from the end of the previous one to its start, zigzag coded so
+ * backward jumps stay small, then its length, both as varints. The extents of
+ * a contiguous file, or of files laid out one after another, take two or three
+ * bytes each instead of eight
+ * @param extents the extents
+ * @param numExtents the number of extents
+ * @param out where to write, or NULL to only count the bytes
+ * @return the number of bytes the coded extents take
+ */
+uint64_t encodeExtents(const blockExtent *extents, uint64_t numExtents, uint8_t *out)
+{
+    uint64_t size = 0;
+    //end of the previous extent, which the next one's start is coded against
+    int64_t prevEnd = 0;
+    //iteration variable
+    uint64_t i = 0;
+    for (i = 0; i < numExtents; i++)
+    {
+        int64_t delta = extents[i].start - prevEnd;
+        size += putVarint(out != NULL ? &out[size] : NULL, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        size += putVarint(out != NULL ? &out[size] : NULL, (uint32_t)extents[i].length);
+        prevEnd = (int64_t)extents[i].start + extents[i].length;
+    }
+    return size;
+}
+
+/**
+ * Function that decodes extents coded by encodeExtents, checking each lies in the data region
+ * @param p the coded extents
+ * @param end the end of the coded extents
+ * @param extents receives the extents
+ * @param numExtents the number of extents to decode
+ * @param numDataBlocks the number of blocks in the data region
+ * @return 1 on success, 0 if the coding is damaged
+ */
+int decodeExtents(const uint8_t *p, const uint8_t *end, blockExtent *extents, uint64_t numExtents, int numDataBlocks)
+{
+    int64_t prevEnd = 0;
+    //iteration variable
+    uint64_t i = 0;
+    for (i = 0; i < numExtents; i++)
+    {
+        uint64_t zigzag;
+        uint64_t length;
+        if (!getVarint(&p, end, &zigzag) || !getVarint(&p, end, &length))
+        {
+            return 0;
+        }
+        int64_t start = prevEnd + (int64_t)((zigzag >> 1) ^ -(zigzag & 1));
+        if (start < 0 || length < 1 || start + (int64_t)length > numDataBlocks)
+        {
+            return 0;
+        }
+        extents[i].start = start;
+        extents[i].length = length;
+        prevEnd = start + length;
+    }
+    return 1;
+}
+
+/**
+ * Function that points a blockIndex's section pointers into its memory
+ * @param idx the index, whose header pointer is already set
+ */
+void locateIndexSections(blockIndex *idx)
+{
+    char *base = (char *)idx->header;
+    idx->inodes = (indexedInode *)&base[idx->header->inodesOffset];
+    idx->extents = (blockExtent *)&base[idx->header->extentsOffset];
+    idx->usedBitmap = (uint64_t *)&base[idx->header->bitmapOffset];
+}
+
+/**
+ * Function that computes the checksum of an index file's header
+ * @param header the start of the index file
+ * @return the checksum
+ */
+uint64_t checksumIndexHeader(const blockIndexHeader *header)
+{
+    blockIndexHeader h = *header;
+    h.headerChecksum = 0;
+    return hashBytes((char *)&h, sizeof(h), BLOCK_INDEX_VERSION);
+}
+
+/**
+ * Function that computes the checksum of one section of an index file
+ * @param header the start of the index file
+ * @param section the INDEX_SECTION_ value
+ * @return the checksum
+ */
+uint64_t checksumIndexSection(const blockIndexHeader *header, int section)
+{
+    const char *base = (const char *)header;
+    if (section == INDEX_SECTION_INODES)
+    {
+        return hashBytes(&base[header->inodesOffset], sizeof(indexedInode) * (uint64_t)header->numInodes, BLOCK_INDEX_VERSION);
+    }
+    if (section == INDEX_SECTION_EXTENTS)
+    {
+        return hashBytes(&base[header->extentsOffset], header->bitmapOffset - header->extentsOffset, BLOCK_INDEX_VERSION);
+    }
+    return hashBytes(&base[header->bitmapOffset], header->totalSize - header->bitmapOffset, BLOCK_INDEX_VERSION);
+}
+
+/**
+ * Function that lays an index out in a single allocation from its parts. Each
+ * entry's record hash is taken from the inode region of the image; the index is
+ * not keyed to an image file until keyBlockIndex is called
+ * @param d the layout of the disk image the index describes
+ * @param entries one entry per inode; firstExtent, numExtents, numBlocks and flags must be set
+ * @param extents every inode's extents
+ * @param numExtents the number of extents
+ * @param usedBitmap bitmap of the used data blocks
+ * @param idx the index to fill in
+ */
+void assembleBlockIndex(diskLayout *d, indexedInode *entries, blockExtent *extents, uint64_t numExtents, uint64_t *usedBitmap, blockIndex *idx)
+{
+    //number of 64-bit words in the used-block bitmap
+    uint64_t bitmapWords = ((uint64_t)d->numDataBlocks + 63) / 64;
+    blockIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BLOCK_INDEX_MAGIC, sizeof(h.magic));
+    h.version = BLOCK_INDEX_VERSION;
+    h.blocksize = d->blocksize;
+    h.numInodes = d->totalInodes;
+    h.numDataBlocks = d->numDataBlocks;
+    h.numExtents = numExtents;
+    h.inodesOffset = align8(sizeof(blockIndexHeader));
+    h.extentsOffset = align8(h.inodesOffset + sizeof(indexedInode) * (uint64_t)d->totalInodes);
+    h.bitmapOffset = align8(h.extentsOffset + sizeof(blockExtent) * numExtents);
+    h.totalSize = h.bitmapOffset + sizeof(uint64_t) * bitmapWords;
+    char *base = calloc(1, h.totalSize);
+    if (base == NULL)
+    {
+        error_msg("Allocating memory for the block index failed.");
+    }
+    memcpy(base, &h, sizeof(h));
+    idx->header = (blockIndexHeader *)base;
+    idx->mapped = 0;
+    idx->decoded = NULL;
+    idx->checked = INDEX_SECTIONS_ALL;
+    locateIndexSections(idx);
+    memcpy(idx->inodes, entries, sizeof(indexedInode) * (uint64_t)d->totalInodes);
+    memcpy(idx->extents, extents, sizeof(blockExtent) * numExtents);
+    memcpy(idx->usedBitmap, usedBitmap, sizeof(uint64_t) * bitmapWords);
+    //iteration variable
+    int m = 0;
+    for (m = 0; m < d->totalInodes; m++)
+    {
+        idx->inodes[m].recordHash = hashBytes((char *)inodeAt(d, m), INODE_SIZE, 0);
+    }
+}
+
+/**
+ * Function that keys an index to the image file it describes
+ * @param idx the index, which must be in memory
+ * @param d the layout of the disk image
+ * @param fileInfo the stat information of the image file
+ */
+void keyBlockIndex(blockIndex *idx, diskLayout *d, struct stat *fileInfo)
+{
+    idx->header->imageSize = fileInfo->st_size;
+    idx->header->imageMtimeSec = fileInfo->st_mtim.tv_sec;
+    idx->header->imageMtimeNsec = fileInfo->st_mtim.tv_nsec;
+    idx->header->superblockHash = hashBytes((char *)d->sb, SUPERBLOCK_SIZE, 0);
+}
+
+/**
+ * Function that builds a block index by walking every inode of a disk image
+ * @param d the layout of the disk image
+ * @param fileInfo the image's stat information, which keys the index
+ * @param idx the index to fill in; it is allocated in memory
+ */
+void buildBlockIndex(diskLayout *d, struct stat *fileInfo, blockIndex *idx)
+{
+    //the entries, extents and bitmap are only needed until the index is assembled
+    arena scratch;
+    arenaInit(&scratch);
+    extentBuilder b = {NULL, 0, 0, NULL, 0, &scratch};
+    //number of 64-bit words in the used-block bitmap
+    uint64_t bitmapWords = ((uint64_t)d->numDataBlocks + 63) / 64;
+    b.usedBitmap = arenaCalloc(&scratch, bitmapWords + 1, sizeof(uint64_t));
+    indexedInode *entries = arenaCalloc(&scratch, d->totalInodes + 1, sizeof(indexedInode));
+    //iteration variable
+    int m = 0;
+    for (m = 0; m < d->totalInodes; m++)
+    {
+        inode *in = inodeAt(d, m);
+        entries[m].firstExtent = b.numExtents;
+        if (in->nlink <= 0)
+        {
+            continue;
+        }
+        entries[m].flags |= INDEXED_IN_USE;
+        b.numBlocks = 0;
+        if (walkInodeBlocks(d->dataRegion, d->blocksize, d->numDataBlocks, in, addBlockToExtents, &b) != 0)
+        {
+            entries[m].flags |= INDEXED_BAD_POINTER;
+        }
+        entries[m].numExtents = b.numExtents - entries[m].firstExtent;
+        entries[m].numBlocks = b.numBlocks;
+    }
+    assembleBlockIndex(d, entries, b.extents, b.numExtents, b.usedBitmap, idx);
+    keyBlockIndex(idx, d, fileInfo);
+    arenaRelease(&scratch);
+}
+
+/**
+ * Function that writes a block index to a sidecar file, with its extents coded
+ * and sealed with a checksum. The index is written to a temporary file that is
+ * renamed over the sidecar, so readers never see half an index
+ * @param idx the index to save, which must be in memory
+ * @param path the path of the sidecar file
+ */
+void saveBlockIndex(blockIndex *idx, const char *path)
+{
+    //the file holds the same sections, with the coded extents in place of the array
+    blockIndexHeader h = *idx->header;
+    uint64_t codedSize = encodeExtents(idx->extents, h.numExtents, NULL);
+    uint64_t bitmapSize = h.totalSize - h.bitmapOffset;
+    h.bitmapOffset = align8(h.extentsOffset + codedSize);
+    h.totalSize = h.bitmapOffset + bitmapSize;
+    char *file = calloc(1, h.totalSize);
+    if (file == NULL)
+    {
+        error_msg("Allocating memory for the block index failed.");
+    }
+    memcpy(file, &h, sizeof(h));
+    memcpy(&file[h.inodesOffset], idx->inodes, sizeof(indexedInode) * (uint64_t)h.numInodes);
+    encodeExtents(idx->extents, h.numExtents, (uint8_t *)&file[h.extentsOffset]);
+    memcpy(&file[h.bitmapOffset], idx->usedBitmap, bitmapSize);
+    blockIndexHeader *fh = (blockIndexHeader *)file;
+    fh->inodesChecksum = checksumIndexSection(fh, INDEX_SECTION_INODES);
+    fh->extentsChecksum = checksumIndexSection(fh, INDEX_SECTION_EXTENTS);
+    fh->bitmapChecksum = checksumIndexSection(fh, INDEX_SECTION_BITMAP);
+    fh->headerChecksum = checksumIndexHeader(fh);
+
+    char tmpPath[FILENAME_MAX];
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path) >= (int)sizeof(tmpPath))
+    {
+        error_msg("Block index path is too long.");
+    }
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        error_msg("Error opening block index file.");
+    }
+    writeFully(fd, file, h.totalSize);
+    if (close(fd) != 0 || rename(tmpPath, path) != 0)
+    {
+        error_msg("Error writing block index file.");
+    }
+    free(file);
+}
+
+/**
+ * Function that maps a sidecar block index, if it exists and still describes the
+ * image. Only the header is read, so loading costs the same for any size of index;
+ * the sections are checked by checkBlockIndex before they are used
+ * @param path the path of the sidecar file
+ * @param d the layout of the disk image
+ * @param fileInfo the image's current stat information
+ * @param changedSince nonzero to accept an index built before the image last
+ * changed: the image must still be the same size and its mtime must not be older
+ * than the one the index was keyed to, but its contents may differ
+ * @param idx the index to fill in
+ * @return 1 if the index was loaded, 0 if it is missing, damaged or stale
+ */
+int loadBlockIndex(const char *path, diskLayout *d, struct stat *fileInfo, int changedSince, blockIndex *idx)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct stat indexInfo;
+    if (fstat(fd, &indexInfo) != 0 || indexInfo.st_size < (off_t)sizeof(blockIndexHeader))
+    {
+        close(fd);
+        return 0;
+    }
+    blockIndexHeader *h = mmap(NULL, indexInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+    {
+        return 0;
+    }
+    int valid = memcmp(h->magic, BLOCK_INDEX_MAGIC, sizeof(h->magic)) == 0 &&
+                h->version == BLOCK_INDEX_VERSION &&
+                h->totalSize == (uint64_t)indexInfo.st_size &&
+                h->imageSize == (uint64_t)fileInfo->st_size &&
+                (changedSince ? (h->imageMtimeSec < fileInfo->st_mtim.tv_sec ||
+                                 (h->imageMtimeSec == fileInfo->st_mtim.tv_sec && h->imageMtimeNsec <= fileInfo->st_mtim.tv_nsec))
+                              : (h->imageMtimeSec == fileInfo->st_mtim.tv_sec &&
+                                 h->imageMtimeNsec == fileInfo->st_mtim.tv_nsec &&
+                                 h->superblockHash == hashBytes((char *)d->sb, SUPERBLOCK_SIZE, 0))) &&
+                h->blocksize == (uint32_t)d->blocksize &&
+                h->numInodes == (uint32_t)d->totalInodes &&
+                h->numDataBlocks == (uint32_t)d->numDataBlocks &&
+                h->inodesOffset + sizeof(indexedInode) * (uint64_t)h->numInodes <= h->extentsOffset &&
+                h->extentsOffset <= h->bitmapOffset &&
+                h->bitmapOffset + sizeof(uint64_t) * (((uint64_t)h->numDataBlocks + 63) / 64) <= h->totalSize &&
+                h->headerChecksum == checksumIndexHeader(h);
+    if (!valid)
+    {
+        munmap(h, indexInfo.st_size);
+        return 0;
+    }
+    //everything but the extents is used in place; those are decoded once they are checked
+    idx->header = h;
+    idx->mapped = 1;
+    idx->decoded = NULL;
+    idx->checked = 0;
+    locateIndexSections(idx);
+    idx->extents = NULL;
+    return 1;
+}
+
+/**
+ * Function that checks the sections of a block index that are about to be used,
+ * each only the first time, and decodes the extents of a mapped index when they
+ * are asked for
+ * @param idx the index
+ * @param sections the INDEX_SECTION_ bits of the sections to check
+ * @return 1 if the sections are intact, 0 if any is damaged
+ */
+int checkBlockIndex(blockIndex *idx, int sections)
+{
+    blockIndexHeader *h = idx->header;
+    if ((sections & INDEX_SECTION_INODES) && !(idx->checked & INDEX_SECTION_INODES))
+    {
+        if (h->inodesChecksum != checksumIndexSection(h, INDEX_SECTION_INODES))
+        {
+            return 0;
+        }
+        idx->checked |= INDEX_SECTION_INODES;
+    }
+    if ((sections & INDEX_SECTION_BITMAP) && !(idx->checked & INDEX_SECTION_BITMAP))
+    {
+        if (h->bitmapChecksum != checksumIndexSection(h, INDEX_SECTION_BITMAP))
+        {
+            return 0;
+        }
+        idx->checked |= INDEX_SECTION_BITMAP;
+    }
+    if ((sections & INDEX_SECTION_EXTENTS) && !(idx->checked & INDEX_SECTION_EXTENTS))
+    {
+        if (h->extentsChecksum != checksumIndexSection(h, INDEX_SECTION_EXTENTS))
+        {
+            return 0;
+        }
+        idx->decoded = malloc(sizeof(blockExtent) * (h->numExtents + 1));
+        if (idx->decoded == NULL)
+        {
+            error_msg("Allocating memory for the block index failed.");
+        }
+        if (!decodeExtents((uint8_t *)h + h->extentsOffset, (uint8_t *)h + h->bitmapOffset, idx->decoded, h->numExtents, h->numDataBlocks))
+        {
+            free(idx->decoded);
+            idx->decoded = NULL;
+            return 0;
+        }
+        idx->extents = idx->decoded;
+        idx->checked |= INDEX_SECTION_EXTENTS;
+    }
+    return 1;
+}
+
+/**
+ * Function that releases a block index
+ * @param idx the index
+ */
+void freeBlockIndex(blockIndex *idx)
+{
+    if (idx->mapped)
+    {
+        free(idx->decoded);
+        munmap(idx->header, idx->header->totalSize);
+    }
+    else
+    {
+        free(idx->header);
+    }
+}
+
+/**
+ * Function that loads a disk image's sidecar block index, rebuilding and saving
+ * it first if it is missing, damaged, or the image has changed since it was built
+ * @param path the path of the sidecar file
+ * @param d the layout of the disk image
+ * @param fileInfo the image's current stat information
+ * @param sections the INDEX_SECTION_ bits of the sections that will be used
+ * @param idx the index to fill in
+ * @return 1 if an up-to-date index was loaded, 0 if it had to be rebuilt
+ */
+int openBlockIndex(const char *path, diskLayout *d, struct stat *fileInfo, int sections, blockIndex *idx)
+{
+    if (loadBlockIndex(path, d, fileInfo, 0, idx))
+    {
+        if (checkBlockIndex(idx, sections))
+        {
+            return 1;
+        }
+        freeBlockIndex(idx);
+    }
+    buildBlockIndex(d, fileInfo, idx);
+    saveBlockIndex(idx, path);
+    return 0;
+}
+
+//-----------------------
+// Global: analyze
+//-----------------------
+
+/**
+ * Function that prints a fragmentation report for a disk image from its block
+ * index, without reading the inode region. The free blocks are counted from the
+ * index's bitmap, or by following the image's free list when the image is being
+ * walked anyway, which also finds blocks that are neither used nor on the list
+ * @param d the layout of the disk image
+ * @param idx the image's block index, with every section checked
+ * @param walkFreeList nonzero to follow the free list, zero to use the bitmap only
+ */
+void analyze(diskLayout *d, blockIndex *idx, int walkFreeList)
+{
+    //number of files, of files split over more than one extent, and of files with bad pointers
+    int numFiles = 0;
+    int fragmentedFiles = 0;
+    int badFiles = 0;
+    //totals over all files
+    uint64_t usedBlocks = 0;
+    uint64_t numExtents = 0;
+    //the file split into the most extents
+    int worstInode = -1;
+    uint32_t worstExtents = 0;
+    //iteration variable
+    int m = 0;
+    for (m = 0; m < (int)idx->header->numInodes; m++)
+    {
+        indexedInode *e = &idx->inodes[m];
+        if (!(e->flags & INDEXED_IN_USE))
+        {
+            continue;
+        }
+        numFiles++;
+        usedBlocks += e->numBlocks;
+        numExtents += e->numExtents;
+        if (e->numExtents > 1)
+        {
+            fragmentedFiles++;
+        }
+        if (e->flags & INDEXED_BAD_POINTER)
+        {
+            badFiles++;
+        }
+        if (e->numExtents > worstExtents)
+        {
+            worstExtents = e->numExtents;
+            worstInode = m;
+        }
+    }
+
+    //free blocks and the runs they form, found from the used-block bitmap
+    int bitmapFree = 0;
+    uint64_t freeRuns = 0;
+    //whether the previous block was free
+    int prevFree = 0;
+    int b = 0;
+    for (b = 0; b < d->numDataBlocks; b++)
+    {
+        int isFree = !testBlockBit(idx->usedBitmap, b);
+        if (isFree && !prevFree)
+        {
+            freeRuns++;
+        }
+        bitmapFree += isFree;
+        prevFree = isFree;
+    }
+
+    if (walkFreeList)
+    {
+        int freeBlocks = countFreeBlocks(d);
+        printf("blocksize %d, %d data blocks: %lu used, %d on the free list", d->blocksize, d->numDataBlocks, (unsigned long)usedBlocks, freeBlocks);
+        if (freeBlocks >= 0 && usedBlocks + freeBlocks < (uint64_t)d->numDataBlocks)
+        {
+            printf(", %lu unaccounted for", (unsigned long)(d->numDataBlocks - usedBlocks - freeBlocks));
+        }
+        printf("\n");
+    }
+    else
+    {
+        printf("blocksize %d, %d data blocks: %lu used, %d free\n", d->blocksize, d->numDataBlocks, (unsigned long)usedBlocks, bitmapFree);
+    }
+    printf("%d files in %lu extents, %d fragmented (%.1f%%), %.2f extents per file\n", numFiles, (unsigned long)numExtents,
+           fragmentedFiles, numFiles > 0 ? (100.0 * fragmentedFiles) / numFiles : 0.0, numFiles > 0 ? (double)numExtents / numFiles : 0.0);
+    if (worstInode >= 0)
+    {
+        printf("most fragmented: inode %d, %u blocks in %u extents\n", worstInode, idx->inodes[worstInode].numBlocks, worstExtents);
+    }
+    printf("free space in %lu runs\n", (unsigned long)freeRuns);
+    if (badFiles > 0)
+    {
+        printf("%d files have block pointers outside the data region\n", badFiles);
+    }
+}
+
+//-----------------------
+// Global: analyzeCommand
+//-----------------------
+
+/**
+ * Function that works out the path of an image's sidecar block index
+ * @param option the value of an --index= option, or NULL to use the default path
+ * @param imagePath the path of the disk image
+ * @param path buffer of FILENAME_MAX bytes that receives the path
+ */
+void blockIndexPath(const char *option, const char *imagePath, char *path)
+{
+    if (option != NULL && *option != '\0')
+    {
+        snprintf(path, FILENAME_MAX, "%s", option);
+    }
+    else if (snprintf(path, FILENAME_MAX, "%s%s", imagePath, BLOCK_INDEX_SUFFIX) >= FILENAME_MAX)
+    {
+        error_msg("Block index path is too long.");
+    }
+}
+
+/**
+ * Entry point of the analyze and index subcommands. analyze prints a
+ * fragmentation report; with --index it takes the block map from the image's
+ * sidecar index, rebuilding the index only if the image changed. index just
+ * brings the sidecar index up to date.
+ * Usage: analyze [--index[=PATH]] <image>, index [--index=PATH] <image>
+ * @param argc the number of arguments after the subcommand name
+ * @param argv the arguments after the subcommand name
+ * @param report nonzero for analyze, zero for index
+ * @return 0 on success
+ */
+int analyzeCommand(int argc, char *argv[], int report)
+{
+    //whether to use a sidecar index, and its path if given
+    int useIndex = !report;
+    const char *indexOption = NULL;
+    char *imagePath = NULL;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--index") == 0)
+        {
+            useIndex = 1;
+        }
+        else if (strncmp(argv[i], "--index=", strlen("--index=")) == 0)
+        {
+            useIndex = 1;
+            indexOption = argv[i] + strlen("--index=");
+        }
+        else if (imagePath == NULL && argv[i][0] != '-')
+        {
+            imagePath = argv[i];
+        }
+        else
+        {
+            imagePath = NULL;
+            break;
+        }
+    }
+    if (imagePath == NULL)
+    {
+        error_msg(report ? "Usage: disk-defrag analyze [--index[=PATH]] <image>" : "Usage: disk-defrag index [--index=PATH] <image>");
+    }
+
+    size_t size;
+    char *image = mapDiskImage(imagePath, &size);
+    diskLayout d;
+    describeImage(image, size, &d);
+    struct stat fileInfo;
+    if (stat(imagePath, &fileInfo) != 0)
+    {
+        error_msg("Error determing disk image size.");
+    }
+    blockIndex idx;
+    if (useIndex)
+    {
+        char path[FILENAME_MAX];
+        blockIndexPath(indexOption, imagePath, path);
+        //the report needs only the inode entries and the bitmap, so the extents are neither checked nor decoded
+        int loaded = openBlockIndex(path, &d, &fileInfo, report ? INDEX_SECTION_INODES | INDEX_SECTION_BITMAP : INDEX_SECTIONS_ALL, &idx);
+        //a mapped index's header gives the size of the coded extents; a rebuilt one is still laid out in memory
+        uint64_t storedBytes = idx.mapped ? idx.header->bitmapOffset - idx.header->extentsOffset : align8(encodeExtents(idx.extents, idx.header->numExtents, NULL));
+        printf("index %s: %s, %lu extents stored in %lu bytes\n", path, loaded ? "up to date" : "rebuilt",
+               (unsigned long)idx.header->numExtents, (unsigned long)storedBytes);
+    }
+    else
+    {
+        buildBlockIndex(&d, &fileInfo, &idx);
+    }
+    if (report)
+    {
+        analyze(&d, &idx, !useIndex);
+    }
+    freeBlockIndex(&idx);
+    munmap(image, size);
+    return 0;
+}
+
+//-----------------------
+// Global: rebuildFreeList
+//-----------------------
+
+/**
+ * Function that threads every data block not marked in a bitmap onto a new free
+ * list in ascending order, zeroing each one the same way defrag does
+ * @param d the layout of the disk image to rebuild the free list of
+ * @param usedBitmap bitmap of the data blocks in use
+ * @return the number of free blocks
+ */
+int rebuildFreeList(diskLayout *d, const uint64_t *usedBitmap)
+{
+    TRACE_PROBE1(freelist__start, d->numDataBlocks);
+    //head of the list built so far; built back to front so it comes out sorted
+    int head = UNUSED_INODE_SENTINEL;
+    //number of blocks on the list
+    int numFree = 0;
+    //iteration variable
+    int b = 0;
+    for (b = d->numDataBlocks - 1; b >= 0; b--)
+    {
+        if (!testBlockBit(usedBitmap, b))
+        {
+            char *block = &d->dataRegion[(size_t)b * d->blocksize];
+            *(int *)block = head;
+            memset(block + sizeof(int), FREE_BLOCK_ZERO, d->blocksize - sizeof(int));
+            head = b;
+            numFree++;
+        }
+    }
+    d->sb->free_block = head;
+    TRACE_PROBE1(freelist__end, numFree);
+    return numFree;
+}
+
+//-----------------------
+// Global: incrementalDefrag
+//-----------------------
+
+/**
+ * Visitor that counts the blocks an inode uses
+ * @param ctx pointer to the int count
+ * @param blockNum the block being visited
+ * @param level the levels of indirection below the block
+ * @param logicalBlock the index of a data block within the file
+ * @return always 0
+ */
+int countBlock(void *ctx, int blockNum, int level, long logicalBlock)
+{
+    (*(int *)ctx)++;
+    return 0;
+}
+
+/**
+ * Function that defragments an image that was defragmented before, using the
+ * block index written by that run. Inodes whose records (pointers, size, mtime
+ * and the rest) still hash the same as in the index keep their blocks; only
+ * changed inodes are walked and moved, each into the next free run that fits
+ * it. Copy work is therefore proportional to the files that changed. Files
+ * whose indirect blocks were rewritten without touching the inode record are
+ * not detected, matching how a file system updates mtime and size on write.
+ * @param buffer the original image, which is only read
+ * @param newBuffer the output image, which starts out as a copy of buffer
+ * @param size the size of the image in bytes
+ * @param fileInfo the stat information of the image file, which must be the one the
+ * index was written for: the same size, and modified no earlier than the index says
+ * @param indexPath the path of the previous run's block index
+ * @param outIndex receives the block index of the output image
+ * @return 1 if the image was defragmented, 0 if a full defrag is needed instead
+ */
+int incrementalDefrag(char *buffer, char *newBuffer, size_t size, struct stat *fileInfo, const char *indexPath, blockIndex *outIndex)
+{
+    diskLayout d;
+    diskLayout nd;
+    describeImage(buffer, size, &d);
+    describeImage(newBuffer, size, &nd);
+    blockIndex prev;
+    if (!loadBlockIndex(indexPath, &d, fileInfo, 1, &prev))
+    {
+        printf("incremental: no block index for this image at %s, doing a full defrag\n", indexPath);
+        return 0;
+    }
+    //the plan starts from every section of the index, so all of them must be intact
+    if (!checkBlockIndex(&prev, INDEX_SECTIONS_ALL))
+    {
+        printf("incremental: block index at %s is damaged, doing a full defrag\n", indexPath);
+        freeBlockIndex(&prev);
+        return 0;
+    }
+
+    //blocks used by inodes that did not change start out as the only used blocks
+    uint64_t bitmapWords = ((uint64_t)d.numDataBlocks + 63) / 64;
+    //the plan lives until the output's index is assembled
+    arena plan;
+    arenaInit(&plan);
+    uint64_t *used = arenaAlloc(&plan, sizeof(uint64_t) * (bitmapWords + 1));
+    //where each changed inode's blocks go: -1 for unchanged inodes, -2 for changed inodes with no blocks
+    int *newStart = arenaAlloc(&plan, sizeof(int) * (d.totalInodes + 1));
+    int *newCount = arenaCalloc(&plan, d.totalInodes + 1, sizeof(int));
+    memcpy(used, prev.usedBitmap, sizeof(uint64_t) * bitmapWords);
+    //number of inodes whose records changed
+    int numChanged = 0;
+    //iteration variables
+    int m = 0;
+    uint32_t e = 0;
+    for (m = 0; m < d.totalInodes; m++)
+    {
+        newStart[m] = -1;
+        indexedInode *entry = &prev.inodes[m];
+        if (hashBytes((char *)inodeAt(&d, m), INODE_SIZE, 0) == entry->recordHash)
+        {
+            continue;
+        }
+        numChanged++;
+        newStart[m] = -2;
+        for (e = 0; e < entry->numExtents; e++)
+        {
+            clearBlockRange(used, prev.extents[entry->firstExtent + e].start, prev.extents[entry->firstExtent + e].length);
+        }
+    }
+
+    //plan every move before copying anything, so falling back leaves buffer untouched
+    //number of blocks moved
+    long blocksMoved = 0;
+    //the search for a free run carries on from where the last one was placed, going back
+    //to the start only when nothing past it fits, so each search doesn't rescan the used blocks
+    int searchFrom = 0;
+    for (m = 0; m < d.totalInodes; m++)
+    {
+        inode *in = inodeAt(&d, m);
+        if (newStart[m] != -2 || in->nlink <= 0)
+        {
+            continue;
+        }
+        if (walkInodeBlocks(d.dataRegion, d.blocksize, d.numDataBlocks, in, countBlock, &newCount[m]) != 0)
+        {
+            printf("incremental: inode %d has a block pointer outside the data region, doing a full defrag\n", m);
+            break;
+        }
+        if (newCount[m] == 0)
+        {
+            continue;
+        }
+        int start = findFreeRun(used, d.numDataBlocks, searchFrom, newCount[m]);
+        if (start < 0 && searchFrom > 0)
+        {
+            start = findFreeRun(used, d.numDataBlocks, 0, newCount[m]);
+        }
+        if (start < 0)
+        {
+            printf("incremental: no free run of %d blocks for inode %d, doing a full defrag\n", newCount[m], m);
+            break;
+        }
+        setBlockRange(used, start, newCount[m]);
+        newStart[m] = start;
+        searchFrom = start + newCount[m];
+        blocksMoved += newCount[m];
+    }
+    if (m < d.totalInodes)
+    {
+        arenaRelease(&plan);
+        freeBlockIndex(&prev);
+        return 0;
+    }
+
+    //address of the next block to copy into; defrag keeps it up to date
+    int nextFreeGroup = 0;
+    //moved inodes are placed in the table's columns and encoded into the output from there
+    inodeTable table;
+    decodeInodeTable(&d, &table, &plan);
+    for (m = 0; m < d.totalInodes; m++)
+    {
+        if (newStart[m] >= 0)
+        {
+            defrag(buffer, newBuffer, THREE_LEVELS, d.blocksize, d.sb->data_offset, newStart[m], &table, m, &nextFreeGroup);
+            encodeInode(&table, m, inodeAt(&nd, m));
+        }
+    }
+    int numFree = rebuildFreeList(&nd, used);
+
+    //the output's index reuses the extents of unchanged inodes; moved inodes have one extent
+    indexedInode *entries = arenaCalloc(&plan, d.totalInodes + 1, sizeof(indexedInode));
+    blockExtent *extents = arenaAlloc(&plan, sizeof(blockExtent) * (prev.header->numExtents + d.totalInodes + 1));
+    uint64_t numExtents = 0;
+    for (m = 0; m < d.totalInodes; m++)
+    {
+        entries[m].firstExtent = numExtents;
+        if (newStart[m] == -1)
+        {
+            indexedInode *entry = &prev.inodes[m];
+            memcpy(&extents[numExtents], &prev.extents[entry->firstExtent], sizeof(blockExtent) * entry->numExtents);
+            numExtents += entry->numExtents;
+            entries[m].numExtents = entry->numExtents;
+            entries[m].numBlocks = entry->numBlocks;
+            entries[m].flags = entry->flags;
+        }
+        else
+        {
+            entries[m].flags = inodeAt(&d, m)->nlink > 0 ? INDEXED_IN_USE : 0;
+        }
+        if (newStart[m] >= 0)
+        {
+            extents[numExtents].start = newStart[m];
+            extents[numExtents].length = newCount[m];
+            numExtents++;
+            entries[m].numExtents = 1;
+            entries[m].numBlocks = newCount[m];
+        }
+    }
+    assembleBlockIndex(&nd, entries, extents, numExtents, used, outIndex);
+    printf("incremental: %d of %d inodes changed, %ld blocks moved, %d blocks free\n", numChanged, d.totalInodes, blocksMoved, numFree);
+
+    arenaRelease(&plan);
+    freeBlockIndex(&prev);
+    return 1;
+}
+
+//-----------------------
+// Global: perfMetrics
+//-----------------------
+
+/**Hardware counters sampled per phase, in the order they are reported */
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_LLC_MISSES 2
+#define PERF_DTLB_MISSES 3
+#define PERF_BRANCH_MISSES 4
+#define PERF_NUM_COUNTERS 5
+
+/**Phases of a defrag run that are timed and counted */
+#define PHASE_READ 0        /* reading the input image */
+#define PHASE_BUFFER_COPY 1 /* duplicating the whole input into the output buffer */
+#define PHASE_INODE_SCAN 2  /* finding the inodes in use */
+#define PHASE_WALK 3        /* walking every file and copying its blocks into place */
+#define PHASE_WALK_LEVEL 4  /* PHASE_WALK_LEVEL + level: defrag's loop over one level of the trees, timed only */
+#define PHASE_FREE_LIST 8   /* building the free list */
+#define PHASE_WRITE 9       /* writing the output image */
+#define NUM_PHASES 10
+
+/**Names of the counters and phases, as reported */
+const char *perfCounterNames[PERF_NUM_COUNTERS] = {"cycles", "instructions", "llc-misses", "dtlb-misses", "branch-misses"};
+const char *phaseNames[NUM_PHASES] = {"read", "buffer-copy", "inode-scan", "walk", "walk-direct", "walk-iblock", "walk-i2block", "walk-i3block", "free-list", "write"};
+
+/**
+ * Time and hardware counter totals of one phase
+ */
+typedef struct
+{
+    long samples;                       /* number of times the phase ran */
+    double seconds;                     /* total wall-clock time */
+    uint64_t counts[PERF_NUM_COUNTERS]; /* total of each counter */
+} phaseMetrics;
+
+/**
+ * Per-phase metrics of a run, with the counters they are sampled from
+ */
+typedef struct
+{
+    int fds[PERF_NUM_COUNTERS];         /* each counter, or -1 if it could not be opened */
+    int numCounters;                    /* number of counters that could be opened */
+    int openError;                      /* errno of the first counter that could not be opened */
+    double start;                       /* time the current phase began */
+    uint64_t startCounts[PERF_NUM_COUNTERS]; /* counter values when the current phase began */
+    phaseMetrics phases[NUM_PHASES];    /* totals of each phase */
+    int timedOnly[NUM_PHASES];          /* nonzero for phases that have a time but no counts */
+} perfMetrics;
+
+/**
+ * Function that opens the hardware counters for this thread. Counters count
+ * user space only, which is all an unprivileged process may count; any that
+ * can't be opened (no PMU, perf_event_paranoid, seccomp) are left out and the
+ * phases are still timed
+ * @param m the metrics to set up
+ */
+void initMetrics(perfMetrics *m)
+{
+    memset(m, 0, sizeof(*m));
+    //type and config of each counter
+    uint32_t types[PERF_NUM_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    uint64_t configs[PERF_NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_BRANCH_MISSES};
+    //iteration variable
+    int c = 0;
+    for (c = 0; c < PERF_NUM_COUNTERS; c++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[c];
+        attr.config = configs[c];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m->fds[c] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (m->fds[c] < 0)
+        {
+            m->openError = m->openError != 0 ? m->openError : errno;
+            continue;
+        }
+        m->numCounters++;
+    }
+}
+
+/**
+ * Function that reads the current value of every open counter
+ * @param m the metrics
+ * @param counts receives the values; counters that aren't open read as 0
+ */
+void readCounters(perfMetrics *m, uint64_t *counts)
+{
+    //iteration variable
+    int c = 0;
+    for (c = 0; c < PERF_NUM_COUNTERS; c++)
+    {
+        counts[c] = 0;
+        if (m->fds[c] >= 0 && read(m->fds[c], &counts[c], sizeof(uint64_t)) != sizeof(uint64_t))
+        {
+            counts[c] = 0;
+        }
+    }
+}
+
+/**
+ * Function that marks the start of a phase. Does nothing when m is NULL
+ * @param m the metrics, or NULL
+ */
+void beginPhase(perfMetrics *m)
+{
+    if (m == NULL)
+    {
+        return;
+    }
+    readCounters(m, m->startCounts);
+    m->start = nowSeconds();
+}
+
+/**
+ * Function that adds the time and counts since beginPhase to a phase's totals. Does nothing when m is NULL
+ * @param m the metrics, or NULL
+ * @param phase the PHASE_ value that ended
+ */
+void endPhase(perfMetrics *m, int phase)
+{
+    if (m == NULL)
+    {
+        return;
+    }
+    double end = nowSeconds();
+    uint64_t counts[PERF_NUM_COUNTERS];
+    readCounters(m, counts);
+    phaseMetrics *p = &m->phases[phase];
+    p->samples++;
+    p->seconds += end - m->start;
+    //iteration variable
+    int c = 0;
+    for (c = 0; c < PERF_NUM_COUNTERS; c++)
+    {
+        p->counts[c] += counts[c] - m->startCounts[c];
+    }
+}
+
+/**
+ * Function that prints the metrics of every phase that ran, and closes the counters
+ * @param m the metrics
+ * @param out the stream to print to
+ */
+void reportMetrics(perfMetrics *m, FILE *out)
+{
+    if (m->numCounters == 0)
+    {
+        fprintf(out, "metrics: hardware counters unavailable (%s), reporting times only\n", strerror(m->openError));
+    }
+    fprintf(out, "%-13s %8s %10s", "phase", "samples", "seconds");
+    //iteration variables
+    int c = 0;
+    int p = 0;
+    for (c = 0; c < PERF_NUM_COUNTERS; c++)
+    {
+        if (m->fds[c] >= 0)
+        {
+            fprintf(out, " %14s", perfCounterNames[c]);
+        }
+    }
+    fprintf(out, m->fds[PERF_CYCLES] >= 0 && m->fds[PERF_INSTRUCTIONS] >= 0 ? " %6s\n" : "\n", "ipc");
+    for (p = 0; p < NUM_PHASES; p++)
+    {
+        phaseMetrics *ph = &m->phases[p];
+        if (ph->samples == 0)
+        {
+            continue;
+        }
+        fprintf(out, "%-13s %8ld %10.6f", phaseNames[p], ph->samples, ph->seconds);
+        for (c = 0; c < PERF_NUM_COUNTERS; c++)
+        {
+            if (m->fds[c] >= 0 && m->timedOnly[p])
+            {
+                fprintf(out, " %14s", "-");
+            }
+            else if (m->fds[c] >= 0)
+            {
+                fprintf(out, " %14llu", (unsigned long long)ph->counts[c]);
+            }
+        }
+        if (m->fds[PERF_CYCLES] >= 0 && m->fds[PERF_INSTRUCTIONS] >= 0 && m->timedOnly[p])
+        {
+            fprintf(out, " %6s", "-");
+        }
+        else if (m->fds[PERF_CYCLES] >= 0 && m->fds[PERF_INSTRUCTIONS] >= 0)
+        {
+            fprintf(out, " %6.2f", ph->counts[PERF_CYCLES] > 0 ? (double)ph->counts[PERF_INSTRUCTIONS] / ph->counts[PERF_CYCLES] : 0.0);
+        }
+        fprintf(out, "\n");
+    }
+    for (c = 0; c < PERF_NUM_COUNTERS; c++)
+    {
+        if (m->fds[c] >= 0)
+        {
+            close(m->fds[c]);
+            m->fds[c] = -1;
+        }
+    }
+}
+
+//-----------------------
+// Global: placementPolicy
+//-----------------------
+
+/**
+ * Constraints on where defragImage places each file. A zeroed policy packs
+ * every file directly after the previous one
+ */
+typedef struct
+{
+    long alignBytes;    /* byte boundary each file's first block starts on, or 0 for none */
+    long alignMinBytes; /* files smaller than this are packed without alignment */
+    long slackBlocks;   /* free blocks left after each recently modified file */
+    double slackPercent; /* or, when slackBlocks is 0, this percentage of the file's blocks */
+    long slackWindow;   /* files modified less than this many seconds before now get slack */
+    long now;           /* the time mtimes are compared against */
+    int *order;         /* inodes to lay out first, in this order, or NULL for inode order */
+    int orderLength;    /* the number of inodes in order */
+} placementPolicy;
+
+/**Default window within which a file counts as recently modified, in seconds */
+#define SLACK_DEFAULT_WINDOW (7 * 24 * 60 * 60)
+
+/**
+ * Function that finds how many free blocks to leave after a file so it can grow in place
+ * @param policy the placement constraints
+ * @param mtime the file's modification time
+ * @param numBlocks the number of blocks the file uses
+ * @return the number of blocks to leave free, 0 for files not modified recently
+ */
+long growthSlack(placementPolicy *policy, int mtime, int numBlocks)
+{
+    if (numBlocks <= 0 || mtime < policy->now - policy->slackWindow)
+    {
+        return 0;
+    }
+    if (policy->slackBlocks > 0)
+    {
+        return policy->slackBlocks;
+    }
+    //round up, so every recent file gets at least one block when a percentage is set
+    return (long)(((numBlocks * policy->slackPercent) / 100) + 0.999999);
+}
+
+/**
+ * Function that finds the greatest common divisor of two numbers
+ * @param a the first number
+ * @param b the second number
+ * @return the greatest common divisor of a and b
+ */
+long greatestCommonDivisor(long a, long b)
+{
+    while (b != 0)
+    {
+        long r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+/**
+ * Function that finds how many blocks to skip so a data block starts on a byte
+ * boundary of the image
+ * @param d the layout of the image
+ * @param block the first block that could be used
+ * @param alignBytes the boundary
+ * @return the number of blocks to skip, or -1 if no block of this geometry ever starts on the boundary
+ */
+long alignmentPadding(diskLayout *d, long block, long alignBytes)
+{
+    //block starts repeat their remainders modulo alignBytes after this many blocks
+    long period = alignBytes / greatestCommonDivisor(d->blocksize, alignBytes);
+    //byte offset of the data region from the start of the image
+    long dataStart = d->dataRegion - d->image;
+    //iteration variable
+    long pad = 0;
+    for (pad = 0; pad < period; pad++)
+    {
+        if ((dataStart + ((block + pad) * d->blocksize)) % alignBytes == 0)
+        {
+            return pad;
+        }
+    }
+    return -1;
+}
+
+//-----------------------
+// Global: accessTrace
+//-----------------------
+
+/**
+ * One edge of the co-access graph: inode b was read right after inode a, weight times
+ */
+typedef struct
+{
+    int a;
+    int b;
+    int weight;
+} coAccessEdge;
+
+/**
+ * Function that reads an access trace: inode numbers in the order they were
+ * read, separated by whitespace. A # starts a comment that runs to the end of
+ * its line. Anything else, or a number that is not an inode of the image, is an error
+ * @param path the path of the trace file
+ * @param totalInodes the number of inodes in the image
+ * @param length receives the number of accesses
+ * @return a newly allocated array of inode numbers
+ */
+int *loadAccessTrace(const char *path, int totalInodes, int *length)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        error_msg("Error opening access trace file.");
+    }
+    //capacity of the array, which doubles as it fills
+    int capacity = 1024;
+    int *trace = malloc(sizeof(int) * capacity);
+    if (trace == NULL)
+    {
+        error_msg("Allocating memory for the access trace failed.");
+    }
+    *length = 0;
+    //each line is read whole, however long it is
+    char *line = NULL;
+    size_t lineSize = 0;
+    int lineNum = 0;
+    while (getline(&line, &lineSize, f) != -1)
+    {
+        lineNum++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+        char *p = line;
+        while (1)
+        {
+            while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == '\v' || *p == '\f')
+            {
+                p++;
+            }
+            if (*p == '\0')
+            {
+                break;
+            }
+            char *end;
+            long m = strtol(p, &end, 10);
+            if (end == p || (*end != '\0' && *end != ' ' && *end != '\t' && *end != '\n' && *end != '\r' && *end != '\v' && *end != '\f') ||
+                m < 0 || m >= totalInodes)
+            {
+                printf("Invalid inode number on line %d of the access trace.\n", lineNum);
+                exit(EXIT_FAILURE);
+            }
+            if (*length == capacity)
+            {
+                capacity *= 2;
+                trace = realloc(trace, sizeof(int) * capacity);
+                if (trace == NULL)
+                {
+                    error_msg("Allocating memory for the access trace failed.");
+                }
+            }
+            trace[(*length)++] = m;
+            p = end;
+        }
+    }
+    free(line);
+    fclose(f);
+    return trace;
+}
+
+/**
+ * Function that orders co-access edges by source, then destination, for qsort
+ * @param x the first edge
+ * @param y the second edge
+ * @return negative, zero or positive as x sorts before, with or after y
+ */
+int compareEdges(const void *x, const void *y)
+{
+    const coAccessEdge *e = x;
+    const coAccessEdge *f = y;
+    if (e->a != f->a)
+    {
+        return e->a < f->a ? -1 : 1;
+    }
+    return e->b < f->b ? -1 : e->b > f->b;
+}
+
+/**
+ * Function that orders 64-bit keys ascending, for qsort
+ * @param x the first key
+ * @param y the second key
+ * @return negative, zero or positive as x sorts before, with or after y
+ */
+int compareKeys(const void *x, const void *y)
+{
+    uint64_t a = *(const uint64_t *)x;
+    uint64_t b = *(const uint64_t *)y;
+    return a < b ? -1 : a > b;
+}
+
+/**
+ * Function that plans the order files are laid out in from an access trace.
+ * Each pair of consecutive accesses to different inodes adds weight to an
+ * undirected edge between them. A chain is then grown greedily: it starts at
+ * the most-read inode and repeatedly appends the unplaced neighbour of its
+ * last inode with the heaviest edge, starting over from the most-read unplaced
+ * inode when the last one has none. Files read together end up next to each other
+ * @param trace the inode numbers, in the order they were read
+ * @param length the number of accesses
+ * @param totalInodes the number of inodes in the image; other numbers are ignored
+ * @param orderLength receives the number of inodes in the order
+ * @return a newly allocated array of every inode in the trace, in layout order
+ */
+int *coAccessOrder(const int *trace, int length, int totalInodes, int *orderLength)
+{
+    //the graph is only needed until the order is built
+    arena graph;
+    arenaInit(&graph);
+    //two directed edges per consecutive pair, so neighbours can be found from either end
+    coAccessEdge *edges = arenaAlloc(&graph, sizeof(coAccessEdge) * (2 * (size_t)length + 1));
+    int *reads = arenaCalloc(&graph, totalInodes + 1, sizeof(int));
+    int *firstEdge = arenaCalloc(&graph, totalInodes + 2, sizeof(int));
+    char *placed = arenaCalloc(&graph, totalInodes + 1, 1);
+    int *order = malloc(sizeof(int) * (length + 1));
+    if (order == NULL)
+    {
+        error_msg("Allocating memory for the co-access graph failed.");
+    }
+    //number of edges, before and after merging duplicates
+    int numEdges = 0;
+    //the previous valid access
+    int prev = -1;
+    //iteration variables
+    int i = 0;
+    int j = 0;
+    for (i = 0; i < length; i++)
+    {
+        int m = trace[i];
+        if (m < 0 || m >= totalInodes)
+        {
+            continue;
+        }
+        reads[m]++;
+        if (prev >= 0 && prev != m)
+        {
+            edges[numEdges++] = (coAccessEdge){prev, m, 1};
+            edges[numEdges++] = (coAccessEdge){m, prev, 1};
+        }
+        prev = m;
+    }
+    qsort(edges, numEdges, sizeof(coAccessEdge), compareEdges);
+    //merge repeated pairs into one weighted edge
+    int merged = 0;
+    for (i = 0; i < numEdges; i++)
+    {
+        if (merged > 0 && edges[merged - 1].a == edges[i].a && edges[merged - 1].b == edges[i].b)
+        {
+            edges[merged - 1].weight++;
+        }
+        else
+        {
+            edges[merged++] = edges[i];
+        }
+    }
+    //index of each inode's first edge; its edges run up to the next inode's first edge
+    for (i = 0; i < merged; i++)
+    {
+        firstEdge[edges[i].a + 1]++;
+    }
+    for (i = 0; i < totalInodes; i++)
+    {
+        firstEdge[i + 1] += firstEdge[i];
+    }
+    //every inode read, keyed most-read first and then by inode number in the low half:
+    //chains start from here, so a cursor replaces a scan of every inode
+    uint64_t *byReads = arenaAlloc(&graph, sizeof(uint64_t) * (totalInodes + 1));
+    int numRead = 0;
+    for (i = 0; i < totalInodes; i++)
+    {
+        if (reads[i] > 0)
+        {
+            byReads[numRead++] = ((uint64_t)(UINT32_MAX - (uint32_t)reads[i]) << 32) | (uint32_t)i;
+        }
+    }
+    qsort(byReads, numRead, sizeof(uint64_t), compareKeys);
+    //the first entry of byReads that may still be unplaced
+    int cursor = 0;
+
+    *orderLength = 0;
+    //the last inode in the chain, or -1 to start a new chain
+    int tail = -1;
+    while (1)
+    {
+        int next = -1;
+        if (tail >= 0)
+        {
+            //heaviest edge to an unplaced neighbour, lowest inode number on ties
+            int best = 0;
+            for (j = firstEdge[tail]; j < firstEdge[tail + 1]; j++)
+            {
+                if (!placed[edges[j].b] && edges[j].weight > best)
+                {
+                    best = edges[j].weight;
+                    next = edges[j].b;
+                }
+            }
+        }
+        if (next < 0)
+        {
+            //most-read unplaced inode starts the next chain
+            while (cursor < numRead && placed[(uint32_t)byReads[cursor]])
+            {
+                cursor++;
+            }
+            next = cursor < numRead ? (int)(uint32_t)byReads[cursor] : -1;
+        }
+        if (next < 0)
+        {
+            break;
+        }
+        placed[next] = 1;
+        order[(*orderLength)++] = next;
+        tail = next;
+    }
+
+    arenaRelease(&graph);
+    return order;
+}
+
+/**
+ * The state of a simulated read through an access trace
+ */
+typedef struct
+{
+    long prevBlock; /* the block read last, or -1 before the first read */
+    long distance;  /* total blocks the head moved between reads that were not contiguous */
+    long seeks;     /* number of reads that were not contiguous */
+    long extents;   /* number of contiguous runs read, counting the first */
+    long blocks;    /* number of blocks read */
+} readSimulation;
+
+/**
+ * Visitor that simulates reading one block after the previous one
+ * @param ctx pointer to the readSimulation
+ * @param blockNum the block being read
+ * @param level the levels of indirection below the block
+ * @param logicalBlock the index of a data block within the file
+ * @return always 0
+ */
+int simulateRead(void *ctx, int blockNum, int level, long logicalBlock)
+{
+    readSimulation *sim = ctx;
+    if (sim->prevBlock >= 0 && blockNum != sim->prevBlock + 1)
+    {
+        sim->distance += labs(blockNum - (sim->prevBlock + 1));
+        sim->seeks++;
+    }
+    sim->extents += sim->prevBlock < 0 || blockNum != sim->prevBlock + 1;
+    sim->blocks++;
+    sim->prevBlock = blockNum;
+    return 0;
+}
+
+/**
+ * Function that simulates reading every file of an access trace in order,
+ * block by block as defrag lays them out, and measures how far a disk head
+ * would travel between blocks that are not next to each other
+ * @param d the layout of the image
+ * @param trace the inode numbers, in the order they were read, or NULL to read every file in inode order
+ * @param length the number of accesses
+ * @param sim receives the totals
+ */
+void simulateTrace(diskLayout *d, const int *trace, int length, readSimulation *sim)
+{
+    memset(sim, 0, sizeof(*sim));
+    sim->prevBlock = -1;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < (trace != NULL ? length : d->totalInodes); i++)
+    {
+        int m = trace != NULL ? trace[i] : i;
+        if (m >= 0 && m < d->totalInodes && inodeAt(d, m)->nlink > 0)
+        {
+            walkInodeBlocks(d->dataRegion, d->blocksize, d->numDataBlocks, inodeAt(d, m), simulateRead, sim);
+        }
+    }
+}
+
+//-----------------------
+// Global: inodeCost
+//-----------------------
+
+/**The most inodes --top= can ask for */
+#define MAX_TOP_INODES 1000000
+/**Names of the levels of indirection an inode's deepest block pointer can have, indexed by level */
+const char *levelNames[THREE_LEVELS + 1] = {"direct", "iblocks", "i2block", "i3block"};
+
+/**
+ * What defragmenting one inode cost
+ */
+typedef struct
+{
+    int inodeNum;      /* the inode */
+    int level;         /* its deepest level of indirection */
+    long blocks;       /* blocks moved, data and indirect */
+    long indirect;     /* indirect blocks visited */
+    long seekDistance; /* blocks skipped between its blocks in the source image */
+    long seeks;        /* jumps between its blocks in the source image */
+    double seconds;    /* time spent walking and copying its blocks */
+} inodeCost;
+
+/**
+ * A bounded min-heap of the most expensive inodes seen so far, by time; the
+ * cheapest of them is at the root, so a costlier inode replaces it in O(log N)
+ */
+typedef struct
+{
+    inodeCost *entries; /* the heap */
+    int count;          /* number of entries in use */
+    int capacity;       /* the most inodes kept */
+} costHeap;
+
+/**
+ * The state of a walk measuring one inode's source layout
+ */
+typedef struct
+{
+    readSimulation sim; /* seeks and distance between its blocks */
+    long indirect;      /* indirect blocks seen */
+} costWalk;
+
+/**
+ * Visitor that measures a block of an inode in the source image
+ * @param ctx pointer to the costWalk
+ * @param blockNum the block
+ * @param level the levels of indirection below the block
+ * @param logicalBlock the index of a data block within the file
+ * @return always 0
+ */
+int measureCostBlock(void *ctx, int blockNum, int level, long logicalBlock)
+{
+    costWalk *w = ctx;
+    w->indirect += level > ZERO_LEVELS;
+    return simulateRead(&w->sim, blockNum, level, logicalBlock);
+}
+
+/**
+ * Function that offers an inode's cost to a bounded heap, which keeps it if it
+ * is among the most expensive seen so far
+ * @param h the heap
+ * @param cost the inode's cost
+ */
+void offerInodeCost(costHeap *h, const inodeCost *cost)
+{
+    //position the new entry is sifted from
+    int pos = 0;
+    if (h->count < h->capacity)
+    {
+        //sift up from the end
+        pos = h->count++;
+        while (pos > 0 && h->entries[(pos - 1) / 2].seconds > cost->seconds)
+        {
+            h->entries[pos] = h->entries[(pos - 1) / 2];
+            pos = (pos - 1) / 2;
+        }
+        h->entries[pos] = *cost;
+        return;
+    }
+    if (h->capacity == 0 || cost->seconds <= h->entries[0].seconds)
+    {
+        return;
+    }
+    //replace the root and sift down
+    while (1)
+    {
+        int child = (2 * pos) + 1;
+        if (child >= h->count)
+        {
+            break;
+        }
+        if (child + 1 < h->count && h->entries[child + 1].seconds < h->entries[child].seconds)
+        {
+            child++;
+        }
+        if (h->entries[child].seconds >= cost->seconds)
+        {
+            break;
+        }
+        h->entries[pos] = h->entries[child];
+        pos = child;
+    }
+    h->entries[pos] = *cost;
+}
+
+/**
+ * Function that compares two inode costs, the most expensive first, for qsort
+ * @param a pointer to the first inodeCost
+ * @param b pointer to the second inodeCost
+ * @return a negative, zero or positive value as a costs more, the same or less than b
+ */
+int compareCosts(const void *a, const void *b)
+{
+    const inodeCost *x = a;
+    const inodeCost *y = b;
+    if (x->seconds != y->seconds)
+    {
+        return x->seconds < y->seconds ? 1 : -1;
+    }
+    return x->inodeNum - y->inodeNum;
+}
+
+/**
+ * Function that prints the inodes a heap kept, the most expensive first. The heap is left sorted
+ * @param h the heap
+ * @param out the stream to print to
+ */
+void reportInodeCosts(costHeap *h, FILE *out)
+{
+    qsort(h->entries, h->count, sizeof(inodeCost), compareCosts);
+    fprintf(out, "top %d inodes by copy time:\n", h->count);
+    fprintf(out, "%8s %-8s %10s %10s %10s %8s %10s\n", "inode", "level", "ms", "blocks", "indirect", "seeks", "seek-span");
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < h->count; i++)
+    {
+        const inodeCost *c = &h->entries[i];
+        fprintf(out, "%8d %-8s %10.3f %10ld %10ld %8ld %10ld\n", c->inodeNum, levelNames[c->level], c->seconds * 1e3, c->blocks, c->indirect, c->seeks, c->seekDistance);
+    }
+}
+
+//-----------------------
+// Global: defragImage
+//-----------------------
+
+/**
+ * Function that defragments a whole disk image: every file is laid out
+ * contiguously from the start of the data region in inode order, or in the
+ * policy's order when it has one, and the
+ * remaining blocks become a sorted free list. A placement policy can leave
+ * free blocks before a file so it starts on an aligned boundary, and after a
+ * recently modified file so it can grow without fragmenting; those blocks are
+ * threaded into the free list with the rest, and only taken while the
+ * remaining files still fit
+ * @param buffer the original image, which is only read
+ * @param newBuffer the output image, which starts out as a copy of buffer
+ * @param size the size of the image in bytes
+ * @param policy the placement constraints, or NULL to pack files tightly
+ * @param metrics the per-phase metrics to add to, or NULL
+ * @param topInodes keeps the most expensive inodes to defragment, or NULL
+ * @param outIndex receives the block index of the output image, or NULL if none is needed
+ */
+void defragImage(char *buffer, char *newBuffer, size_t size, placementPolicy *policy, perfMetrics *metrics, costHeap *topInodes, blockIndex *outIndex)
+{
+    diskLayout d;
+    describeImage(buffer, size, &d);
+    //size of blocks on disk
+    int blocksize = d.blocksize;
+    //offset for data region
+    int dataOffset = d.sb->data_offset;
+    //offset of the inode region from the start of the image
+    int inodeRegionStart = d.inodeRegion - d.image;
+
+    //every array the plan needs is allocated from here and released together at the end
+    arena plan;
+    arenaInit(&plan);
+    //the inode region decoded into columns in its only pass, and each inode's deepest level of indirection
+    beginPhase(metrics);
+    inodeTable table;
+    decodeInodeTable(&d, &table, &plan);
+    signed char *inodeLevels = arenaAlloc(&plan, table.rows);
+    classifyInodes(&table, inodeLevels);
+    //locations (buffer indices) of the start of each valid inode, taken from the nlink column
+    int *validInodeLocations = arenaAlloc(&plan, sizeof(int) * (table.count + 1));
+    //number of valid inodes
+    int numInodes = 0;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < table.count; i++)
+    {
+        validInodeLocations[numInodes] = inodeRegionStart + (i * INODE_SIZE);
+        numInodes += table.nlink[i] > 0;
+    }
+    validInodeLocations[numInodes] = UNUSED_INODE_SENTINEL;
+    endPhase(metrics, PHASE_INODE_SCAN);
+
+    //lay out the inodes the policy orders first, then the rest in inode order
+    if (policy != NULL && policy->order != NULL)
+    {
+        int *ordered = arenaAlloc(&plan, sizeof(int) * (numInodes + 1));
+        //0 for invalid inodes, 1 for valid ones, 2 once placed in ordered
+        char *state = arenaCalloc(&plan, d.totalInodes + 1, 1);
+        for (i = 0; i < numInodes; i++)
+        {
+            state[(validInodeLocations[i] - inodeRegionStart) / INODE_SIZE] = 1;
+        }
+        //number of inodes placed in ordered
+        int k = 0;
+        for (i = 0; i < policy->orderLength; i++)
+        {
+            int m = policy->order[i];
+            if (m >= 0 && m < d.totalInodes && state[m] == 1)
+            {
+                state[m] = 2;
+                ordered[k++] = inodeRegionStart + (m * INODE_SIZE);
+            }
+        }
+        for (i = 0; i < numInodes; i++)
+        {
+            if (state[(validInodeLocations[i] - inodeRegionStart) / INODE_SIZE] == 1)
+            {
+                ordered[k++] = validInodeLocations[i];
+            }
+        }
+        ordered[k] = UNUSED_INODE_SENTINEL;
+        validInodeLocations = ordered;
+    }
+
+    //data blocks each file uses, and the number still to be placed after it, when a policy needs them
+    int *fileBlocks = NULL;
+    long blocksRemaining = 0;
+    //blocks left free by the policy, and the files aligned or left unaligned for lack of room
+    long paddingBlocks = 0;
+    int numAligned = 0;
+    int numUnaligned = 0;
+    //blocks reserved for growth, and the recent files that got some or went without for lack of room
+    long slackTotal = 0;
+    int numSlack = 0;
+    int numNoSlack = 0;
+    if (policy != NULL && (policy->alignBytes > 0 || policy->slackBlocks > 0 || policy->slackPercent > 0))
+    {
+        fileBlocks = arenaCalloc(&plan, numInodes + 1, sizeof(int));
+        int *directBlocks = arenaAlloc(&plan, sizeof(int) * table.rows);
+        //only files with indirect blocks need their trees walked to be counted
+        countDirectBlocks(&table, directBlocks);
+        for (i = 0; i < numInodes; i++)
+        {
+            int m = (validInodeLocations[i] - inodeRegionStart) / INODE_SIZE;
+            if (inodeLevels[m] > ZERO_LEVELS)
+            {
+                walkInodeBlocks(d.dataRegion, blocksize, d.numDataBlocks, (inode *)&buffer[validInodeLocations[i]], countBlock, &fileBlocks[i]);
+            }
+            else
+            {
+                fileBlocks[i] = directBlocks[m];
+            }
+            blocksRemaining += fileBlocks[i];
+        }
+    }
+
+    //the output index's entries and extents, if one is being built
+    indexedInode *entries = NULL;
+    blockExtent *extents = NULL;
+    uint64_t numExtents = 0;
+    if (outIndex != NULL)
+    {
+        entries = arenaCalloc(&plan, d.totalInodes + 1, sizeof(indexedInode));
+        extents = arenaAlloc(&plan, sizeof(blockExtent) * (numInodes + 1));
+    }
+
+    //blocks the output's files use
+    uint64_t *used = arenaCalloc(&plan, (d.numDataBlocks + 63) / 64 + 1, sizeof(uint64_t));
+    diskLayout nd;
+    describeImage(newBuffer, size, &nd);
+
+    //address of next free group of data blocks
+    int nextFreeGroup = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + (dataOffset * blocksize);
+    //current offset into data region (in blocks) of the new buffer representing the new disk image
+    int dataRegCurrOffset = 0;
+    //the counters are read once around the whole walk; defrag only reads the clock per level's loop
+    beginPhase(metrics);
+    if (metrics != NULL)
+    {
+        walkTiming = 1;
+        memset(walkLevelSeconds, 0, sizeof(walkLevelSeconds));
+        memset(walkLevelSamples, 0, sizeof(walkLevelSamples));
+    }
+    //for each valid inode, examine the size of files and start process of defragmenting disk
+    for (i = 0; i < numInodes; i++)
+    {
+        //validInodeLocations[i] is location (buffer index) of start of i_th valid inode
+        int inodeNum = (validInodeLocations[i] - inodeRegionStart) / INODE_SIZE;
+        if (fileBlocks != NULL)
+        {
+            blocksRemaining -= fileBlocks[i];
+            if (policy->alignBytes > 0 && fileBlocks[i] > 0 && (long)fileBlocks[i] * blocksize >= policy->alignMinBytes)
+            {
+                long pad = alignmentPadding(&d, dataRegCurrOffset, policy->alignBytes);
+                //padding is only taken while every remaining file still fits after it
+                if (pad < 0 || dataRegCurrOffset + pad + fileBlocks[i] + blocksRemaining > d.numDataBlocks)
+                {
+                    numUnaligned++;
+                }
+                else
+                {
+                    dataRegCurrOffset += pad;
+                    paddingBlocks += pad;
+                    numAligned++;
+                }
+            }
+        }
+        //first block of the new data region this inode's blocks go to
+        int fileStart = dataRegCurrOffset;
+
+        //how many levels of recursion are required in defrag call
+        int levels = inodeLevels[inodeNum];
+        if (levels >= 0)
+        {
+            TRACE_PROBE2(inode__start, inodeNum, levels);
+            //the source layout is measured before defrag rewrites the pointers in the inode's row
+            costWalk walk;
+            if (topInodes != NULL)
+            {
+                inode source;
+                encodeInode(&table, inodeNum, &source);
+                memset(&walk, 0, sizeof(walk));
+                walk.sim.prevBlock = -1;
+                walkInodeBlocks(d.dataRegion, blocksize, d.numDataBlocks, &source, measureCostBlock, &walk);
+            }
+            double start = topInodes != NULL ? nowSeconds() : 0;
+            dataRegCurrOffset = defrag(buffer, newBuffer, levels, blocksize, dataOffset, dataRegCurrOffset, &table, inodeNum, &nextFreeGroup);
+            TRACE_PROBE3(inode__end, inodeNum, levels, dataRegCurrOffset - fileStart);
+            if (topInodes != NULL)
+            {
+                inodeCost cost = {inodeNum, levels, dataRegCurrOffset - fileStart, walk.indirect, walk.sim.distance, walk.sim.seeks, nowSeconds() - start};
+                offerInodeCost(topInodes, &cost);
+            }
+        }
+        setBlockRange(used, fileStart, dataRegCurrOffset - fileStart);
+        if (outIndex != NULL)
+        {
+            entries[inodeNum].flags = INDEXED_IN_USE;
+        }
+        //every file ends up as a single extent
+        if (outIndex != NULL && dataRegCurrOffset > fileStart)
+        {
+            entries[inodeNum].firstExtent = numExtents;
+            entries[inodeNum].numExtents = 1;
+            entries[inodeNum].numBlocks = dataRegCurrOffset - fileStart;
+            extents[numExtents].start = fileStart;
+            extents[numExtents].length = dataRegCurrOffset - fileStart;
+            numExtents++;
+        }
+        if (fileBlocks != NULL)
+        {
+            long slack = growthSlack(policy, table.mtime[inodeNum], fileBlocks[i]);
+            //slack is only left while every remaining file still fits after it
+            if (slack > 0 && dataRegCurrOffset + slack + blocksRemaining > d.numDataBlocks)
+            {
+                numNoSlack++;
+            }
+            else if (slack > 0)
+            {
+                dataRegCurrOffset += slack;
+                slackTotal += slack;
+                numSlack++;
+            }
+        }
+    }
+
+    //the output's inode region: each placed inode's row, encoded once with its new pointers
+    for (i = 0; i < numInodes; i++)
+    {
+        int inodeNum = (validInodeLocations[i] - inodeRegionStart) / INODE_SIZE;
+        encodeInode(&table, inodeNum, inodeAt(&nd, inodeNum));
+    }
+    endPhase(metrics, PHASE_WALK);
+    if (metrics != NULL)
+    {
+        walkTiming = 0;
+        //iteration variable
+        int level = 0;
+        for (level = ZERO_LEVELS; level <= THREE_LEVELS; level++)
+        {
+            metrics->timedOnly[PHASE_WALK_LEVEL + level] = 1;
+            metrics->phases[PHASE_WALK_LEVEL + level].seconds += walkLevelSeconds[level];
+            metrics->phases[PHASE_WALK_LEVEL + level].samples += walkLevelSamples[level];
+        }
+    }
+
+    //every block not used by a file goes on the sorted free list, including any padding
+    beginPhase(metrics);
+    rebuildFreeList(&nd, used);
+    endPhase(metrics, PHASE_FREE_LIST);
+    if (fileBlocks != NULL && (policy->slackBlocks > 0 || policy->slackPercent > 0))
+    {
+        printf("slack: %d recently modified files got %ld blocks to grow into, %d got none for lack of room\n", numSlack, slackTotal, numNoSlack);
+    }
+    if (fileBlocks != NULL && policy->alignBytes > 0)
+    {
+        printf("align: %d files aligned to %ld bytes, %d left unaligned, %ld padding blocks (%ld bytes, %.2f%% of the data region)\n",
+               numAligned, policy->alignBytes, numUnaligned, paddingBlocks, paddingBlocks * blocksize, d.numDataBlocks > 0 ? (100.0 * paddingBlocks) / d.numDataBlocks : 0.0);
+    }
+
+    if (outIndex != NULL)
+    {
+        assembleBlockIndex(&nd, entries, extents, numExtents, used, outIndex);
+    }
+
+    //free resources
+    arenaRelease(&plan);
+}
+
+//-----------------------
+// Global: ioThrottle
+//-----------------------
+
+/**The size of each read or write a throttled copy issues, in bytes */
+#define THROTTLE_CHUNK_SIZE (1024 * 1024)
+/**How often a throttle checks its control file for changes, in seconds */
+#define THROTTLE_POLL_INTERVAL 0.25
+/**The most a token bucket can save up, in seconds' worth of its rate */
+#define THROTTLE_BURST_SECONDS 0.5
+/**Weight of the newest sample in the moving average of I/O latency */
+#define THROTTLE_LATENCY_WEIGHT 0.2
+/**Factor the adaptive mode cuts the rate by when latency is above target */
+#define THROTTLE_BACKOFF 0.7
+/**Factor the adaptive mode raises the rate by when latency is well below target */
+#define THROTTLE_RECOVER 1.05
+/**The smallest share of the configured rate the adaptive mode backs off to */
+#define THROTTLE_MIN_SCALE 0.05
+
+/**
+ * A token bucket: tokens accumulate at a fixed rate up to a burst limit and are
+ * spent by I/O, which waits whenever there aren't enough
+ */
+typedef struct
+{
+    double rate;   /* tokens added per second; 0 means unlimited */
+    double tokens; /* tokens available now */
+} tokenBucket;
+
+/**
+ * Limits the read and write bandwidth and the operation rate of a copy. The
+ * limits can be changed while a copy runs, by editing the control file (which is
+ * polled, and also re-read on SIGHUP), and the adaptive mode scales them down
+ * while the observed completion latency is above a target
+ */
+typedef struct
+{
+    int enabled;              /* nonzero once any limit has been set */
+    tokenBucket readBytes;    /* read bandwidth, bytes per second */
+    tokenBucket writeBytes;   /* write bandwidth, bytes per second */
+    tokenBucket ops;          /* reads and writes per second */
+    double lastRefill;        /* time the buckets were last refilled */
+    double scale;             /* share of the configured rates in force, set by the adaptive mode */
+    double latencyTarget;     /* adaptive mode's latency target in seconds; 0 turns it off */
+    double latencyAverage;    /* moving average of completion latency in seconds */
+    const char *controlFile;  /* file holding settings to apply at runtime, or NULL */
+    struct timespec controlMtime; /* mtime of the control file when last read */
+    double lastPoll;          /* time the control file was last checked */
+    double waited;            /* total time spent waiting for tokens */
+} ioThrottle;
+
+/**Set by the SIGHUP handler to make throttles re-read their control file */
+static volatile sig_atomic_t throttleReloadRequested = 0;
+
+/**
+ * Signal handler that asks throttles to re-read their control file
+ * @param sig the signal number
+ */
+void requestThrottleReload(int sig)
+{
+    throttleReloadRequested = 1;
+}
+
+/**
+ * Function that parses a size such as 512, 64K, 100M or 2G
+ * @param value the text to parse
+ * @param result receives the size in bytes
+ * @return 1 if the text is a valid size, 0 otherwise
+ */
+int parseSize(const char *value, double *result)
+{
+    char *end;
+    double n = strtod(value, &end);
+    if (end == value || n < 0)
+    {
+        return 0;
+    }
+    if (*end == 'K' || *end == 'k')
+    {
+        n *= 1024;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        n *= 1024 * 1024;
+        end++;
+    }
+    else if (*end == 'G' || *end == 'g')
+    {
+        n *= 1024.0 * 1024 * 1024;
+        end++;
+    }
+    *result = n;
+    return *end == '\0';
+}
+
+/**
+ * Function that parses a duration: a number of seconds, optionally followed by
+ * s, m, h or d for seconds, minutes, hours or days
+ * @param value the text to parse
+ * @param result receives the duration in seconds
+ * @return 1 if the value was valid, 0 otherwise
+ */
+int parseDuration(const char *value, double *result)
+{
+    char *end;
+    double n = strtod(value, &end);
+    if (end == value || n < 0)
+    {
+        return 0;
+    }
+    if (*end == 'm')
+    {
+        n *= 60;
+        end++;
+    }
+    else if (*end == 'h')
+    {
+        n *= 60 * 60;
+        end++;
+    }
+    else if (*end == 'd')
+    {
+        n *= 24 * 60 * 60;
+        end++;
+    }
+    else if (*end == 's')
+    {
+        end++;
+    }
+    *result = n;
+    return *end == '\0';
+}
+
+/**
+ * Function that applies one throttle setting, written as it would be on the
+ * command line without the leading dashes: read-bw=SIZE, write-bw=SIZE, iops=N
+ * or adaptive-latency=MS. A value of 0 removes the limit
+ * @param t the throttle
+ * @param setting the setting to apply
+ * @return 1 if the setting was recognised and valid, 0 otherwise
+ */
+int applyThrottleSetting(ioThrottle *t, const char *setting)
+{
+    //the value after the '=' sign
+    const char *value = strchr(setting, '=');
+    double n;
+    if (value == NULL || !parseSize(value + 1, &n))
+    {
+        return 0;
+    }
+    //length of the setting's name
+    size_t nameLen = value - setting;
+    if (nameLen == strlen("read-bw") && strncmp(setting, "read-bw", nameLen) == 0)
+    {
+        t->readBytes.rate = n;
+    }
+    else if (nameLen == strlen("write-bw") && strncmp(setting, "write-bw", nameLen) == 0)
+    {
+        t->writeBytes.rate = n;
+    }
+    else if (nameLen == strlen("iops") && strncmp(setting, "iops", nameLen) == 0)
+    {
+        t->ops.rate = n;
+    }
+    else if (nameLen == strlen("adaptive-latency") && strncmp(setting, "adaptive-latency", nameLen) == 0)
+    {
+        t->latencyTarget = n / 1000;
+    }
+    else
+    {
+        return 0;
+    }
+    t->enabled = t->readBytes.rate > 0 || t->writeBytes.rate > 0 || t->ops.rate > 0 || t->controlFile != NULL;
+    return 1;
+}
+
+/**
+ * Function that re-reads a throttle's control file if it changed or a reload
+ * was requested. Each line holds one setting; blank lines and lines starting
+ * with '#' are ignored, as are settings that don't parse
+ * @param t the throttle
+ */
+void reloadThrottleControl(ioThrottle *t)
+{
+    struct stat controlInfo;
+    if (t->controlFile == NULL || stat(t->controlFile, &controlInfo) != 0)
+    {
+        return;
+    }
+    if (!throttleReloadRequested && controlInfo.st_mtim.tv_sec == t->controlMtime.tv_sec && controlInfo.st_mtim.tv_nsec == t->controlMtime.tv_nsec)
+    {
+        return;
+    }
+    throttleReloadRequested = 0;
+    t->controlMtime = controlInfo.st_mtim;
+    FILE *f = fopen(t->controlFile, "r");
+    if (f == NULL)
+    {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#' && !applyThrottleSetting(t, line))
+        {
+            fprintf(stderr, "throttle: ignoring bad setting \"%s\" in %s\n", line, t->controlFile);
+        }
+    }
+    fclose(f);
+}
+
+/**
+ * Function that sets up a throttle with no limits
+ * @param t the throttle
+ */
+void initThrottle(ioThrottle *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->scale = 1;
+}
+
+/**
+ * Function that starts a throttle: reads its control file and installs the
+ * SIGHUP handler that re-reads it
+ * @param t the throttle
+ */
+void startThrottle(ioThrottle *t)
+{
+    if (!t->enabled)
+    {
+        return;
+    }
+    if (t->controlFile != NULL)
+    {
+        signal(SIGHUP, requestThrottleReload);
+        throttleReloadRequested = 1;
+        reloadThrottleControl(t);
+    }
+    t->lastRefill = nowSeconds();
+    t->lastPoll = t->lastRefill;
+}
+
+/**
+ * Function that adds the tokens a bucket earned over some time, up to its burst limit
+ * @param b the bucket
+ * @param rate the rate in force
+ * @param elapsed the time since the last refill, in seconds
+ * @param minBurst the fewest tokens the bucket may hold, so that one operation always fits
+ */
+void refillBucket(tokenBucket *b, double rate, double elapsed, double minBurst)
+{
+    double burst = rate * THROTTLE_BURST_SECONDS;
+    b->tokens += rate * elapsed;
+    if (b->tokens > (burst > minBurst ? burst : minBurst))
+    {
+        b->tokens = burst > minBurst ? burst : minBurst;
+    }
+}
+
+/**
+ * Function that waits until a throttle allows one read or write of a given size
+ * and then spends the tokens for it
+ * @param t the throttle
+ * @param isWrite nonzero for a write, zero for a read
+ * @param bytes the size of the operation
+ */
+void throttleAcquire(ioThrottle *t, int isWrite, size_t bytes)
+{
+    if (!t->enabled)
+    {
+        return;
+    }
+    tokenBucket *bw = isWrite ? &t->writeBytes : &t->readBytes;
+    while (1)
+    {
+        double now = nowSeconds();
+        if (t->controlFile != NULL && (throttleReloadRequested || now - t->lastPoll >= THROTTLE_POLL_INTERVAL))
+        {
+            t->lastPoll = now;
+            reloadThrottleControl(t);
+        }
+        double elapsed = now - t->lastRefill;
+        t->lastRefill = now;
+        refillBucket(&t->readBytes, t->readBytes.rate * t->scale, elapsed, bytes);
+        refillBucket(&t->writeBytes, t->writeBytes.rate * t->scale, elapsed, bytes);
+        refillBucket(&t->ops, t->ops.rate * t->scale, elapsed, 1);
+        //time until both buckets this operation draws on hold enough tokens
+        double wait = 0;
+        if (bw->rate > 0 && bw->tokens < bytes)
+        {
+            wait = (bytes - bw->tokens) / (bw->rate * t->scale);
+        }
+        if (t->ops.rate > 0 && t->ops.tokens < 1)
+        {
+            double opsWait = (1 - t->ops.tokens) / (t->ops.rate * t->scale);
+            wait = opsWait > wait ? opsWait : wait;
+        }
+        if (wait <= 0)
+        {
+            break;
+        }
+        //wake up at least every poll interval so control file changes take effect
+        wait = wait < THROTTLE_POLL_INTERVAL ? wait : THROTTLE_POLL_INTERVAL;
+        struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&ts, NULL);
+        t->waited += wait;
+    }
+    if (bw->rate > 0)
+    {
+        bw->tokens -= bytes;
+    }
+    if (t->ops.rate > 0)
+    {
+        t->ops.tokens -= 1;
+    }
+}
+
+/**
+ * Function that tells a throttle how long an operation took to complete. In
+ * adaptive mode, the share of the configured rates in force is cut whenever the
+ * moving average latency is above target and slowly raised again while it is
+ * well below target
+ * @param t the throttle
+ * @param latency the operation's completion latency in seconds
+ */
+void throttleComplete(ioThrottle *t, double latency)
+{
+    if (!t->enabled || t->latencyTarget <= 0)
+    {
+        return;
+    }
+    t->latencyAverage = t->latencyAverage == 0 ? latency : (THROTTLE_LATENCY_WEIGHT * latency) + ((1 - THROTTLE_LATENCY_WEIGHT) * t->latencyAverage);
+    if (t->latencyAverage > t->latencyTarget)
+    {
+        t->scale *= THROTTLE_BACKOFF;
+        t->scale = t->scale < THROTTLE_MIN_SCALE ? THROTTLE_MIN_SCALE : t->scale;
+    }
+    else if (t->latencyAverage < t->latencyTarget / 2)
+    {
+        t->scale *= THROTTLE_RECOVER;
+        t->scale = t->scale > 1 ? 1 : t->scale;
+    }
+}
+
+/**
+ * Function that reads part of a file into the same offset of a buffer, one
+ * throttled chunk at a time when a throttle is in force and in a single
+ * transfer otherwise
+ * @param f the file to read
+ * @param buffer the buffer, which mirrors the file
+ * @param offset the offset to read from
+ * @param len the number of bytes to read
+ * @param t the throttle
+ * @return 1 if every byte was read, 0 otherwise
+ */
+int readThrottled(ioFile *f, char *buffer, size_t offset, size_t len, ioThrottle *t)
+{
+    //size of each read
+    size_t chunk = t->enabled ? THROTTLE_CHUNK_SIZE : len;
+    size_t end = offset + len;
+    while (offset < end)
+    {
+        size_t n = end - offset < chunk ? end - offset : chunk;
+        throttleAcquire(t, 0, n);
+        double start = nowSeconds();
+        TRACE_PROBE3(copy__submit, 0, offset, n);
+        if (!ioTransfer(f, &buffer[offset], n, offset, 0))
+        {
+            return 0;
+        }
+        TRACE_PROBE3(copy__complete, 0, offset, n);
+        throttleComplete(t, nowSeconds() - start);
+        offset += n;
+    }
+    return 1;
+}
+
+/**
+ * Function that writes a range of a buffer to the same range of a file, one
+ * throttled chunk at a time when a throttle is in force and in a single transfer
+ * otherwise. Throttled chunks are pushed to the device before the next one is
+ * issued, so the limits apply to the device rather than to the page cache and
+ * latency reflects the device
+ * @param f the file to write
+ * @param buffer the buffer to write
+ * @param offset the offset of the range in the buffer and the file
+ * @param size the number of bytes to write
+ * @param t the throttle
+ * @return 1 if every byte was written, 0 otherwise
+ */
+int writeThrottled(ioFile *f, char *buffer, size_t offset, size_t size, ioThrottle *t)
+{
+    //size of each write
+    size_t chunk = t->enabled ? THROTTLE_CHUNK_SIZE : size;
+    //bytes written so far
+    size_t done = offset;
+    size = offset + size;
+    while (done < size)
+    {
+        size_t len = size - done < chunk ? size - done : chunk;
+        throttleAcquire(t, 1, len);
+        double start = nowSeconds();
+        TRACE_PROBE3(copy__submit, 1, done, len);
+        if (!ioTransfer(f, &buffer[done], len, done, 1) || (t->enabled && !ioSync(f, len, done)))
+        {
+            return 0;
+        }
+        TRACE_PROBE3(copy__complete, 1, done, len);
+        throttleComplete(t, nowSeconds() - start);
+        done += len;
+    }
+    return 1;
+}
+
+/**A 16-byte vector, the width of SSE2 and NEON registers; isZeroBlock ORs four of them together per step */
+typedef uint64_t zeroVector __attribute__((vector_size(16)));
+
+/**
+ * Function that tests whether a block holds nothing but zero bytes, a cache
+ * line at a time, stopping at the first line that has a set bit
+ * @param block the block, which need not be aligned
+ * @param blocksize the size of a block, a multiple of 4
+ * @return nonzero if every byte of the block is zero
+ */
+static inline int isZeroBlock(const char *block, int blocksize)
+{
+    //iteration variable
+    int i = 0;
+    for (i = 0; i + (int)(4 * sizeof(zeroVector)) <= blocksize; i += 4 * sizeof(zeroVector))
+    {
+        zeroVector v[4];
+        //memcpy makes unaligned vector loads
+        memcpy(v, &block[i], sizeof(v));
+        zeroVector any = (v[0] | v[1]) | (v[2] | v[3]);
+        if ((any[0] | any[1]) != 0)
+        {
+            return 0;
+        }
+    }
+    //the tail shorter than a line, a word at a time
+    uint32_t rest = 0;
+    for (; i < blocksize; i += sizeof(uint32_t))
+    {
+        uint32_t word;
+        memcpy(&word, &block[i], sizeof(word));
+        rest |= word;
+    }
+    return rest == 0;
+}
+
+/**
+ * Function that writes a disk image to a newly created regular file, leaving
+ * out the all-zero parts of its data region: the file is sized to the whole
+ * image at the end, so they become holes that read back as zeroes without using
+ * disk space. A hole is only left where the zeroes cover whole, aligned units
+ * of the file system's allocation size, since a smaller one frees nothing and
+ * just splits the writes; zero blocks that fall short of a unit are written
+ * along with their neighbours
+ * @param f the file to write, empty until now
+ * @param buffer the image
+ * @param size the size of the image in bytes
+ * @param unit the file's allocation unit in bytes (st_blksize), a multiple of 4
+ * @param t the throttle
+ * @param holeBytes receives the number of bytes left as holes
+ * @return 1 if every other byte was written, 0 otherwise
+ */
+int writeSparse(ioFile *f, char *buffer, size_t size, size_t unit, ioThrottle *t, size_t *holeBytes)
+{
+    diskLayout d;
+    describeImage(buffer, size, &d);
+    //the data region, and the start of the bytes not yet written
+    size_t dataStart = d.dataRegion - d.image;
+    size_t dataEnd = dataStart + ((size_t)d.numDataBlocks * d.blocksize);
+    size_t pending = 0;
+    *holeBytes = 0;
+    //iteration variable: the first unit wholly inside the data region
+    size_t unitStart = ((dataStart + unit - 1) / unit) * unit;
+    for (; unitStart + unit <= dataEnd; unitStart += unit)
+    {
+        if (isZeroBlock(&buffer[unitStart], (int)unit))
+        {
+            //write what came before this run of zero units, then skip the unit
+            if (unitStart > pending && !writeThrottled(f, buffer, pending, unitStart - pending, t))
+            {
+                return 0;
+            }
+            pending = unitStart + unit;
+            *holeBytes += unit;
+        }
+    }
+    return (pending >= size || writeThrottled(f, buffer, pending, size - pending, t)) && ioTruncate(f, size);
+}
+
+//-----------------------
+// Global: generate
+//-----------------------
+
+/**The smallest block size generate picks, in bytes */
+#define GEN_MIN_BLOCKSIZE 64
+/**The largest block size generate picks, in bytes */
+#define GEN_MAX_BLOCKSIZE 1024
+/**The fewest data blocks generate puts in the data region */
+#define GEN_MIN_DATA_BLOCKS 64
+/**The most data blocks generate puts in the data region */
+#define GEN_MAX_DATA_BLOCKS 8192
+
+/**
+ * Holds the state of the random image generator
+ */
+typedef struct
+{
+    uint64_t rng;       /* state of the xorshift random number generator */
+    diskLayout d;       /* layout of the image being generated */
+    int *pool;          /* data blocks not yet handed out, in random order */
+    int poolLen;        /* number of blocks in pool */
+    int budget;         /* blocks the current file may still take */
+    int density;        /* percentage of pointer slots the current file fills */
+} imageGenerator;
+
+/**
+ * Function that advances a xorshift64* random number generator
+ * @param state the generator's state, which must not be zero
+ * @return the next random number
+ */
+uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Function that picks a random integer in a range
+ * @param g the generator
+ * @param lo the smallest value that may be picked
+ * @param hi the largest value that may be picked
+ * @return the random integer
+ */
+int randomBetween(imageGenerator *g, int lo, int hi)
+{
+    return lo + (int)(nextRandom(&g->rng) % (uint64_t)(hi - lo + 1));
+}
+
+/**
+ * Function that fills a region of memory with random bytes
+ * @param g the generator
+ * @param dst the region to fill
+ * @param len the number of bytes to fill
+ */
+void fillRandom(imageGenerator *g, char *dst, size_t len)
+{
+    while (len > 0)
+    {
+        uint64_t r = nextRandom(&g->rng);
+        size_t n = len < sizeof(r) ? len : sizeof(r);
+        memcpy(dst, &r, n);
+        dst += n;
+        len -= n;
+    }
+}
+
+/**
+ * Function that hands out a random unused data block to the file being generated
+ * @param g the generator
+ * @return the block, or UNUSED_INODE_SENTINEL once the file's budget or the image is used up
+ */
+int takeBlock(imageGenerator *g)
+{
+    if (g->poolLen == 0 || g->budget == 0)
+    {
+        return UNUSED_INODE_SENTINEL;
+    }
+    g->budget--;
+    return g->pool[--g->poolLen];
+}
+
+/**
+ * Function that decides whether the file being generated fills a pointer slot,
+ * and if so hands out a block for it and fills that block with random file
+ * contents or, for an indirect block, with further pointers
+ * @param g the generator
+ * @param level the levels of indirection below the block the slot points to
+ * @return the block the slot points to, or UNUSED_INODE_SENTINEL to leave the slot empty
+ */
+int generateBlockTree(imageGenerator *g, int level)
+{
+    if (randomBetween(g, 1, 100) > g->density)
+    {
+        return UNUSED_INODE_SENTINEL;
+    }
+    int blockNum = takeBlock(g);
+    if (blockNum == UNUSED_INODE_SENTINEL)
+    {
+        return UNUSED_INODE_SENTINEL;
+    }
+    char *block = &g->d.dataRegion[(size_t)blockNum * g->d.blocksize];
+    if (level == ZERO_LEVELS)
+    {
+        fillRandom(g, block, g->d.blocksize);
+        return blockNum;
+    }
+    //iteration variable
+    int j = 0;
+    for (j = 0; j < g->d.blocksize / (int)sizeof(int); j++)
+    {
+        ((int *)block)[j] = generateBlockTree(g, level - 1);
+    }
+    return blockNum;
+}
+
+/**
+ * Visitor that records the highest index within a file of any of its data blocks
+ * @param ctx pointer to a long holding the highest index seen
+ * @param blockNum the block being visited
+ * @param level the levels of indirection below the block
+ * @param logicalBlock the index of a data block within the file
+ * @return always 0
+ */
+int findLastLogicalBlock(void *ctx, int blockNum, int level, long logicalBlock)
+{
+    if (level == ZERO_LEVELS && logicalBlock > *(long *)ctx)
+    {
+        *(long *)ctx = logicalBlock;
+    }
+    return 0;
+}
+
+/**
+ * Function that fills in a used inode with random metadata and a random block tree
+ * @param g the generator
+ * @param in the inode to fill in
+ * @param deepest the deepest level of indirection the file may use
+ */
+void generateFile(imageGenerator *g, inode *in, int deepest)
+{
+    fillRandom(g, (char *)in, INODE_SIZE);
+    in->next_inode = 0;
+    in->protect = 0;
+    in->nlink = randomBetween(g, 1, 3);
+    //pick how sparse this file's pointers are
+    g->density = randomBetween(g, 1, 4) == 1 ? randomBetween(g, 5, 100) : 100;
+    //the deepest trees are generated first so the file's budget isn't used up
+    //before reaching them; the blocks come from a shuffled pool either way
+    in->i3block = deepest >= THREE_LEVELS ? generateBlockTree(g, THREE_LEVELS) : UNUSED_INODE_SENTINEL;
+    in->i2block = deepest >= TWO_LEVELS ? generateBlockTree(g, TWO_LEVELS) : UNUSED_INODE_SENTINEL;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < N_IBLOCKS; i++)
+    {
+        in->iblocks[i] = deepest >= ONE_LEVEL ? generateBlockTree(g, ONE_LEVEL) : UNUSED_INODE_SENTINEL;
+    }
+    for (i = 0; i < N_DBLOCKS; i++)
+    {
+        in->dblocks[i] = generateBlockTree(g, ZERO_LEVELS);
+    }
+
+    //the file ends somewhere inside its last data block
+    long lastLogical = -1;
+    walkInodeBlocks(g->d.dataRegion, g->d.blocksize, g->d.numDataBlocks, in, findLastLogicalBlock, &lastLogical);
+    long size = (lastLogical * g->d.blocksize) + randomBetween(g, 1, g->d.blocksize);
+    in->size = lastLogical < 0 ? 0 : (size > INT32_MAX ? INT32_MAX : size);
+}
+
+/**
+ * Function that builds a random, valid disk image. Block size, region sizes and
+ * the mix of file shapes are random; files are scattered over the data region
+ * with sparse pointers at every level of indirection, the remaining blocks are
+ * threaded onto the free list in random order, and a few blocks are left off
+ * the free list altogether, as a crashed writer would leave them
+ * @param seed the seed of the random number generator; the same seed always
+ * gives the same image
+ * @param blocksize the block size to use, or 0 to pick one at random
+ * @param numDataBlocks the size of the data region in blocks, or 0 to pick one at random
+ * @param size pointer that receives the size of the image in bytes
+ * @return a newly allocated buffer holding the image
+ */
+char *generateImage(uint64_t seed, int blocksize, int numDataBlocks, size_t *size)
+{
+    imageGenerator g;
+    //a xorshift generator must never have a state of zero
+    g.rng = (seed * HASH_PRIME_1) | 1;
+    if (blocksize == 0)
+    {
+        blocksize = randomBetween(&g, GEN_MIN_BLOCKSIZE / sizeof(int), GEN_MAX_BLOCKSIZE / sizeof(int)) * sizeof(int);
+    }
+    if (numDataBlocks == 0)
+    {
+        numDataBlocks = randomBetween(&g, GEN_MIN_DATA_BLOCKS, GEN_MAX_DATA_BLOCKS);
+    }
+    int inodeOffset = randomBetween(&g, 0, 2);
+    //the inode region holds at least one inode
+    int inodeBlocks = randomBetween(&g, (INODE_SIZE + blocksize - 1) / blocksize, (INODE_SIZE * 40) / blocksize + 1);
+    int swapBlocks = randomBetween(&g, 0, 4);
+    *size = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + ((size_t)(inodeOffset + inodeBlocks + numDataBlocks + swapBlocks) * blocksize);
+    char *image = malloc(*size);
+    if (image == NULL)
+    {
+        error_msg("Allocating memory for the generated image failed.");
+    }
+    //everything outside the inodes, files and free list is random filler defrag must preserve
+    fillRandom(&g, image, *size);
+    superblock *sb = (superblock *)&image[SUPERBLOCK_SIZE];
+    sb->blocksize = blocksize;
+    sb->inode_offset = inodeOffset;
+    sb->data_offset = inodeOffset + inodeBlocks;
+    sb->swap_offset = sb->data_offset + numDataBlocks;
+    describeImage(image, *size, &g.d);
+
+    //shuffle the data blocks so files are scattered over the data region
+    g.pool = malloc(sizeof(int) * numDataBlocks);
+    if (g.pool == NULL)
+    {
+        error_msg("Allocating memory for the generated image failed.");
+    }
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < numDataBlocks; i++)
+    {
+        g.pool[i] = i;
+    }
+    for (i = numDataBlocks - 1; i > 0; i--)
+    {
+        int j = randomBetween(&g, 0, i);
+        int tmp = g.pool[i];
+        g.pool[i] = g.pool[j];
+        g.pool[j] = tmp;
+    }
+    //leave a few blocks neither used nor free
+    g.poolLen = numDataBlocks - randomBetween(&g, 0, numDataBlocks / 50);
+
+    //pick this image's mix of file shapes: weights of direct-only, iblock, i2block and i3block files
+    int weights[4];
+    //total of the weights
+    int totalWeight = 0;
+    for (i = 0; i < 4; i++)
+    {
+        weights[i] = randomBetween(&g, 0, 10);
+        totalWeight += weights[i];
+    }
+    if (totalWeight == 0)
+    {
+        weights[THREE_LEVELS] = 1;
+        totalWeight = 1;
+    }
+    //fill roughly this share of the data region with files
+    int fillPercent = randomBetween(&g, 30, 100);
+    int usedInodes = randomBetween(&g, 0, g.d.totalInodes);
+    //head of the free inode list, built from the last inode back to the first
+    int freeInodeHead = UNUSED_INODE_SENTINEL;
+    //which inodes hold files, chosen at random
+    for (i = g.d.totalInodes - 1; i >= 0; i--)
+    {
+        inode *in = inodeAt(&g.d, i);
+        if (randomBetween(&g, 1, g.d.totalInodes) <= usedInodes)
+        {
+            int pick = randomBetween(&g, 1, totalWeight);
+            //deepest level of indirection this file uses
+            int deepest = 0;
+            while (pick > weights[deepest])
+            {
+                pick -= weights[deepest];
+                deepest++;
+            }
+            g.budget = randomBetween(&g, 1, (int)(((long)numDataBlocks * fillPercent) / (100L * (usedInodes + 1))) + 1);
+            generateFile(&g, in, deepest);
+        }
+        else
+        {
+            memset(in, 0, INODE_SIZE);
+            memset(in->dblocks, 0xff, sizeof(int) * (N_DBLOCKS + N_IBLOCKS + 2));
+            in->next_inode = freeInodeHead;
+            freeInodeHead = i;
+        }
+    }
+    sb->free_inode = freeInodeHead;
+
+    //thread the blocks nobody took onto the free list in their shuffled order
+    sb->free_block = UNUSED_INODE_SENTINEL;
+    for (i = 0; i < g.poolLen; i++)
+    {
+        *(int *)&g.d.dataRegion[(size_t)g.pool[i] * blocksize] = sb->free_block;
+        sb->free_block = g.pool[i];
+    }
+    free(g.pool);
+    return image;
+}
+
+//-----------------------
+// Global: generateCommand
+//-----------------------
+
+/**
+ * Function that parses a non-negative integer option value
+ * @param value the text after the '=' sign
+ * @param name the option's name, for the error message
+ * @return the parsed value
+ */
+long parseCount(const char *value, const char *name)
+{
+    char *end;
+    long count = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || count < 0)
+    {
+        printf("Invalid value for %s.\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return count;
+}
+
+/**
+ * Function that parses the value of a --prefetch= option
+ * @param value the text after the '=' sign
+ * @return the number of pointers to look ahead, 0 to turn prefetching off
+ */
+int parsePrefetchDistance(const char *value)
+{
+    long distance = parseCount(value, "--prefetch");
+    if (distance > PREFETCH_MAX_DISTANCE)
+    {
+        error_msg("Invalid value for --prefetch.");
+    }
+    return distance;
+}
+
+/**
+ * Entry point of the generate subcommand, which writes a random disk image for testing.
+ * Usage: generate [--seed=N] [--blocksize=N] [--blocks=N] <output>
+ * @param argc the number of arguments after the subcommand name
+ * @param argv the arguments after the subcommand name
+ * @return 0 on success
+ */
+int generateCommand(int argc, char *argv[])
+{
+    uint64_t seed = 1;
+    //block size and data region size, or 0 to pick them at random
+    int blocksize = 0;
+    int numDataBlocks = 0;
+    char *outputFile = NULL;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--seed=", strlen("--seed=")) == 0)
+        {
+            seed = parseCount(argv[i] + strlen("--seed="), "--seed");
+        }
+        else if (strncmp(argv[i], "--blocksize=", strlen("--blocksize=")) == 0)
+        {
+            blocksize = parseCount(argv[i] + strlen("--blocksize="), "--blocksize");
+            if (blocksize < GEN_MIN_BLOCKSIZE || blocksize % sizeof(int) != 0)
+            {
+                error_msg("Block size must be a multiple of 4 and at least 64.");
+            }
+        }
+        else if (strncmp(argv[i], "--blocks=", strlen("--blocks=")) == 0)
+        {
+            numDataBlocks = parseCount(argv[i] + strlen("--blocks="), "--blocks");
+        }
+        else if (outputFile == NULL && argv[i][0] != '-')
+        {
+            outputFile = argv[i];
+        }
+        else
+        {
+            error_msg("Usage: disk-defrag generate [--seed=N] [--blocksize=N] [--blocks=N] <output>");
+        }
+    }
+    if (outputFile == NULL)
+    {
+        error_msg("Usage: disk-defrag generate [--seed=N] [--blocksize=N] [--blocks=N] <output>");
+    }
+    size_t size;
+    char *image = generateImage(seed, blocksize, numDataBlocks, &size);
+    int fd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        error_msg("Error opening output disk image file.");
+    }
+    writeFully(fd, image, size);
+    if (close(fd) != 0)
+    {
+        error_msg("Error writing output disk image file.");
+    }
+    free(image);
+    return 0;
+}
+
+//-----------------------
+// Global: deviceProfile
+//-----------------------
+
+/**Suffix added to an image's path to name its device profile */
+#define PROFILE_SUFFIX ".profile"
+/**Size of the scratch file calibrate measures with, unless --size= says otherwise */
+#define CALIBRATE_DEFAULT_SIZE (64 * 1024 * 1024)
+/**Size of each sequential read or write calibrate issues */
+#define CALIBRATE_SEQ_CHUNK (1024 * 1024)
+/**The most random operations calibrate times for each of reads and writes */
+#define CALIBRATE_RANDOM_OPS 2000
+/**The most time calibrate spends on each random test, in seconds */
+#define CALIBRATE_RANDOM_SECONDS 2.0
+
+/**Ways of reading the input image */
+#define STRATEGY_AUTO 0       /* pick the cheapest according to the device profile */
+#define STRATEGY_SEQUENTIAL 1 /* read the whole image front to back */
+#define STRATEGY_EXTENTS 2    /* read only the metadata regions and the used extents */
+
+/**
+ * Measured performance of the device an image lives on, at the image's block size
+ */
+typedef struct
+{
+    int blocksize;           /* block size the random tests used */
+    double seqReadBps;       /* sequential read throughput, bytes per second */
+    double seqWriteBps;      /* sequential write throughput, bytes per second */
+    double randReadLatency;  /* average latency of a random one-block read, seconds */
+    double randWriteLatency; /* average latency of a random one-block write, seconds */
+    double randReadBps;      /* random one-block read throughput, bytes per second */
+    double randWriteBps;     /* random one-block write throughput, bytes per second */
+} deviceProfile;
+
+/**
+ * Function that writes a device profile to a file
+ * @param p the profile
+ * @param path the path of the profile file
+ */
+void saveProfile(deviceProfile *p, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        error_msg("Error opening device profile file.");
+    }
+    fprintf(f, "# disk-defrag device profile\n");
+    fprintf(f, "blocksize=%d\n", p->blocksize);
+    fprintf(f, "seq-read-bps=%.0f\n", p->seqReadBps);
+    fprintf(f, "seq-write-bps=%.0f\n", p->seqWriteBps);
+    fprintf(f, "rand-read-latency-us=%.1f\n", p->randReadLatency * 1e6);
+    fprintf(f, "rand-write-latency-us=%.1f\n", p->randWriteLatency * 1e6);
+    fprintf(f, "rand-read-bps=%.0f\n", p->randReadBps);
+    fprintf(f, "rand-write-bps=%.0f\n", p->randWriteBps);
+    if (fclose(f) != 0)
+    {
+        error_msg("Error writing device profile file.");
+    }
+}
+
+/**
+ * Function that reads a device profile written by saveProfile
+ * @param path the path of the profile file
+ * @param p the profile to fill in
+ * @return 1 if a complete profile was read, 0 otherwise
+ */
+int loadProfile(const char *path, deviceProfile *p)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    memset(p, 0, sizeof(*p));
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        double value;
+        if (sscanf(line, "blocksize=%lf", &value) == 1)
+        {
+            p->blocksize = value;
+        }
+        else if (sscanf(line, "seq-read-bps=%lf", &value) == 1)
+        {
+            p->seqReadBps = value;
+        }
+        else if (sscanf(line, "seq-write-bps=%lf", &value) == 1)
+        {
+            p->seqWriteBps = value;
+        }
+        else if (sscanf(line, "rand-read-latency-us=%lf", &value) == 1)
+        {
+            p->randReadLatency = value / 1e6;
+        }
+        else if (sscanf(line, "rand-write-latency-us=%lf", &value) == 1)
+        {
+            p->randWriteLatency = value / 1e6;
+        }
+        else if (sscanf(line, "rand-read-bps=%lf", &value) == 1)
+        {
+            p->randReadBps = value;
+        }
+        else if (sscanf(line, "rand-write-bps=%lf", &value) == 1)
+        {
+            p->randWriteBps = value;
+        }
+    }
+    fclose(f);
+    return p->blocksize > 0 && p->seqReadBps > 0 && p->seqWriteBps > 0 && p->randReadLatency > 0;
+}
+
+//-----------------------
+// Global: calibrate
+//-----------------------
+
+/**
+ * Function that times random one-block reads or writes at block-aligned offsets of a scratch file
+ * @param fd the scratch file
+ * @param fileSize the size of the scratch file
+ * @param blocksize the size of each operation
+ * @param block buffer of blocksize bytes to read into or write from
+ * @param isWrite nonzero to time writes, each pushed to the device before the next, zero to time reads
+ * @return the average latency of one operation, in seconds
+ */
+double timeRandomIo(int fd, size_t fileSize, int blocksize, char *block, int isWrite)
+{
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    //number of block-sized slots in the file
+    size_t numSlots = fileSize / blocksize;
+    double start = nowSeconds();
+    //number of operations done
+    int ops = 0;
+    while (ops < CALIBRATE_RANDOM_OPS && nowSeconds() - start < CALIBRATE_RANDOM_SECONDS)
+    {
+        off_t offset = (off_t)(nextRandom(&rng) % numSlots) * blocksize;
+        ssize_t n = isWrite ? pwrite(fd, block, blocksize, offset) : pread(fd, block, blocksize, offset);
+        if (n != blocksize)
+        {
+            error_msg("Error during random I/O calibration.");
+        }
+        if (isWrite && sync_file_range(fd, offset, blocksize, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+        {
+            error_msg("Error during random I/O calibration.");
+        }
+        ops++;
+    }
+    return (nowSeconds() - start) / ops;
+}
+
+/**
+ * Function that measures the device a path lives on, using a scratch file next
+ * to it. Sequential tests move the whole file in large chunks; random tests move
+ * single blocks of the image's block size. The page cache is dropped for the
+ * scratch file before each read test so reads reach the device
+ * @param scratchPath the path of the scratch file to create and remove
+ * @param fileSize the size of the scratch file
+ * @param blocksize the block size of the random tests
+ * @param p the profile to fill in
+ */
+void calibrate(const char *scratchPath, size_t fileSize, int blocksize, deviceProfile *p)
+{
+    int fd = open(scratchPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        error_msg("Error creating calibration scratch file.");
+    }
+    //the scratch file is removed now and lives on until it is closed
+    unlink(scratchPath);
+    char *chunk = malloc(CALIBRATE_SEQ_CHUNK);
+    if (chunk == NULL)
+    {
+        error_msg("Allocating memory for calibration failed.");
+    }
+    //random contents, so compressing or deduplicating devices can't cheat
+    uint64_t rng = 0x2545F4914F6CDD1DULL;
+    //iteration variable
+    size_t i = 0;
+    for (i = 0; i + sizeof(uint64_t) <= CALIBRATE_SEQ_CHUNK; i += sizeof(uint64_t))
+    {
+        uint64_t r = nextRandom(&rng);
+        memcpy(&chunk[i], &r, sizeof(r));
+    }
+    p->blocksize = blocksize;
+
+    //sequential write, including the time to get it onto the device
+    double start = nowSeconds();
+    for (i = 0; i < fileSize; i += CALIBRATE_SEQ_CHUNK)
+    {
+        writeFully(fd, chunk, CALIBRATE_SEQ_CHUNK);
+    }
+    if (fdatasync(fd) != 0)
+    {
+        error_msg("Error during sequential write calibration.");
+    }
+    p->seqWriteBps = fileSize / (nowSeconds() - start);
+
+    //sequential read
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    start = nowSeconds();
+    for (i = 0; i < fileSize; i += CALIBRATE_SEQ_CHUNK)
+    {
+        if (pread(fd, chunk, CALIBRATE_SEQ_CHUNK, i) != CALIBRATE_SEQ_CHUNK)
+        {
+            error_msg("Error during sequential read calibration.");
+        }
+    }
+    p->seqReadBps = fileSize / (nowSeconds() - start);
+
+    //random reads and writes of one block; one is in flight at a time, so throughput is a block per latency
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    p->randReadLatency = timeRandomIo(fd, fileSize, blocksize, chunk, 0);
+    p->randWriteLatency = timeRandomIo(fd, fileSize, blocksize, chunk, 1);
+    p->randReadBps = blocksize / p->randReadLatency;
+    p->randWriteBps = blocksize / p->randWriteLatency;
+
+    free(chunk);
+    close(fd);
+}
+
+/**
+ * Entry point of the calibrate subcommand, which measures the device an image
+ * lives on at the image's block size and saves the results as a device profile.
+ * Usage: calibrate [--size=SIZE] [--profile=PATH] <image>
+ * @param argc the number of arguments after the subcommand name
+ * @param argv the arguments after the subcommand name
+ * @return 0 on success
+ */
+int calibrateCommand(int argc, char *argv[])
+{
+    double fileSize = CALIBRATE_DEFAULT_SIZE;
+    char *profileFile = NULL;
+    char *imagePath = NULL;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--size=", strlen("--size=")) == 0)
+        {
+            if (!parseSize(argv[i] + strlen("--size="), &fileSize) || fileSize < CALIBRATE_SEQ_CHUNK)
+            {
+                error_msg("Invalid value for --size.");
+            }
+        }
+        else if (strncmp(argv[i], "--profile=", strlen("--profile=")) == 0)
+        {
+            profileFile = argv[i] + strlen("--profile=");
+        }
+        else if (imagePath == NULL && argv[i][0] != '-')
+        {
+            imagePath = argv[i];
+        }
+        else
+        {
+            imagePath = NULL;
+            break;
+        }
+    }
+    if (imagePath == NULL)
+    {
+        error_msg("Usage: disk-defrag calibrate [--size=SIZE] [--profile=PATH] <image>");
+    }
+    size_t size;
+    char *image = mapDiskImage(imagePath, &size);
+    diskLayout d;
+    describeImage(image, size, &d);
+
+    char path[FILENAME_MAX];
+    if (snprintf(path, sizeof(path), "%s.calibrate", imagePath) >= (int)sizeof(path))
+    {
+        error_msg("Image path is too long.");
+    }
+    deviceProfile p;
+    //whole chunks only
+    size_t scratchSize = ((size_t)fileSize / CALIBRATE_SEQ_CHUNK) * CALIBRATE_SEQ_CHUNK;
+    calibrate(path, scratchSize, d.blocksize, &p);
+    if (profileFile == NULL)
+    {
+        snprintf(path, sizeof(path), "%s%s", imagePath, PROFILE_SUFFIX);
+        profileFile = path;
+    }
+    saveProfile(&p, profileFile);
+    printf("sequential read %.1f MB/s, sequential write %.1f MB/s\n", p.seqReadBps / 1e6, p.seqWriteBps / 1e6);
+    printf("random %d-byte read %.1f us (%.2f MB/s), write %.1f us (%.2f MB/s)\n", p.blocksize,
+           p.randReadLatency * 1e6, p.randReadBps / 1e6, p.randWriteLatency * 1e6, p.randWriteBps / 1e6);
+    printf("profile saved to %s\n", profileFile);
+    munmap(image, size);
+    return 0;
+}
+
+//-----------------------
+// Global: estimate
+//-----------------------
+
+/**
+ * Function that estimates how long a defrag takes with each way of reading the
+ * input. Both write the whole output image sequentially. The sequential strategy
+ * reads the whole input front to back; the extents strategy reads the regions
+ * before and after the data region sequentially and then each run of used data
+ * blocks, paying one random-read latency per run
+ * @param p the device profile
+ * @param d the layout of the image
+ * @param idx the image's block index, giving its used blocks
+ * @param sequential receives the estimate for the sequential strategy, in seconds
+ * @param extents receives the estimate for the extents strategy, in seconds
+ */
+void estimateDefrag(deviceProfile *p, diskLayout *d, blockIndex *idx, double *sequential, double *extents)
+{
+    //runs of used blocks, and the number of used blocks
+    long runs = 0;
+    long usedBlocks = 0;
+    //whether the previous block was used
+    int prevUsed = 0;
+    //iteration variable
+    int b = 0;
+    for (b = 0; b < d->numDataBlocks; b++)
+    {
+        int isUsed = testBlockBit(idx->usedBitmap, b);
+        runs += isUsed && !prevUsed;
+        usedBlocks += isUsed;
+        prevUsed = isUsed;
+    }
+    //bytes outside the data region, which both strategies read
+    double otherBytes = d->size - ((double)d->numDataBlocks * d->blocksize);
+    double writeTime = d->size / p->seqWriteBps;
+    *sequential = (d->size / p->seqReadBps) + writeTime;
+    *extents = (otherBytes / p->seqReadBps) + (runs * p->randReadLatency) + (((double)usedBlocks * d->blocksize) / p->seqReadBps) + writeTime;
+}
+
+//-----------------------
+// Global: loadImage
+//-----------------------
+
+/**
+ * Function that reads a disk image into a buffer. With a fresh block index, the
+ * image can instead be read as just its metadata regions and its runs of used
+ * data blocks; everything else becomes zeroed free blocks in the output, so the
+ * result is the same. With a device profile and STRATEGY_AUTO, the strategy the
+ * cost model estimates to be cheaper is used
+ * @param f the open image file
+ * @param imagePath the path of the image, used to find its index and profile
+ * @param fileInfo the image's stat information
+ * @param strategy one of the STRATEGY_ values
+ * @param profileFile the device profile to use, or NULL for <image>.profile
+ * @param t the throttle
+ * @return a newly allocated buffer holding the image
+ */
+char *loadImage(ioFile *f, char *imagePath, struct stat *fileInfo, int strategy, char *profileFile, ioThrottle *t)
+{
+    size_t size = fileInfo->st_size;
+    if (strategy == STRATEGY_SEQUENTIAL)
+    {
+        char *buffer = malloc(size);
+        if (buffer == NULL || !readThrottled(f, buffer, 0, size, t))
+        {
+            error_msg("Error reading disk image file");
+        }
+        return buffer;
+    }
+
+    //blocks that aren't read must not leak uninitialised memory into anything
+    char *buffer = calloc(1, size);
+    if (buffer == NULL || size < BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE || !readThrottled(f, buffer, 0, BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE, t))
+    {
+        error_msg("Error reading disk image file");
+    }
+    diskLayout d;
+    describeImage(buffer, size, &d);
+    //everything before the data region, and everything from the swap region on
+    size_t dataStart = d.dataRegion - d.image;
+    size_t dataEnd = dataStart + ((size_t)d.numDataBlocks * d.blocksize);
+    if (!readThrottled(f, buffer, BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE, dataStart - (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE), t))
+    {
+        error_msg("Error reading disk image file");
+    }
+
+    char path[FILENAME_MAX];
+    blockIndexPath(NULL, imagePath, path);
+    blockIndex idx;
+    int haveIndex = loadBlockIndex(path, &d, fileInfo, 0, &idx);
+    //only the used-block bitmap is needed to plan the reads
+    if (haveIndex && !checkBlockIndex(&idx, INDEX_SECTION_BITMAP))
+    {
+        freeBlockIndex(&idx);
+        haveIndex = 0;
+    }
+    if (strategy == STRATEGY_AUTO)
+    {
+        strategy = STRATEGY_SEQUENTIAL;
+        deviceProfile p;
+        if (profileFile == NULL)
+        {
+            snprintf(path, sizeof(path), "%s%s", imagePath, PROFILE_SUFFIX);
+            profileFile = path;
+        }
+        if (haveIndex && loadProfile(profileFile, &p))
+        {
+            double sequential;
+            double extents;
+            estimateDefrag(&p, &d, &idx, &sequential, &extents);
+            strategy = extents < sequential ? STRATEGY_EXTENTS : STRATEGY_SEQUENTIAL;
+            printf("estimate: %.3f s reading sequentially, %.3f s reading used extents; reading %s\n",
+                   sequential, extents, strategy == STRATEGY_EXTENTS ? "used extents" : "sequentially");
+        }
+    }
+    else if (!haveIndex)
+    {
+        printf("no up-to-date block index at %s.idx, reading sequentially\n", imagePath);
+        strategy = STRATEGY_SEQUENTIAL;
+    }
+
+    if (strategy == STRATEGY_SEQUENTIAL)
+    {
+        if (!readThrottled(f, buffer, dataStart, size - dataStart, t))
+        {
+            error_msg("Error reading disk image file");
+        }
+    }
+    else
+    {
+        //read each run of used blocks in ascending order
+        int b = 0;
+        while (b < d.numDataBlocks)
+        {
+            if (!testBlockBit(idx.usedBitmap, b))
+            {
+                b++;
+                continue;
+            }
+            int runStart = b;
+            while (b < d.numDataBlocks && testBlockBit(idx.usedBitmap, b))
+            {
+                b++;
+            }
+            if (!readThrottled(f, buffer, dataStart + ((size_t)runStart * d.blocksize), (size_t)(b - runStart) * d.blocksize, t))
+            {
+                error_msg("Error reading disk image file");
+            }
+        }
+        if (!readThrottled(f, buffer, dataEnd, size - dataEnd, t))
+        {
+            error_msg("Error reading disk image file");
+        }
+    }
+    if (haveIndex)
+    {
+        freeBlockIndex(&idx);
+    }
+    return buffer;
+}
+
+//-----------------------
+// Global: simulate
+//-----------------------
+
+/**
+ * Function that prints the results of a simulated read, with its modeled time when there is a profile
+ * @param label what was read
+ * @param sim the results
+ * @param blocksize the size of a block
+ * @param p the device profile, or NULL
+ * @return the modeled time in seconds, or 0 without a profile
+ */
+double reportSimulation(const char *label, readSimulation *sim, int blocksize, deviceProfile *p)
+{
+    printf("%s: %ld blocks in %ld extents, %ld seeks over %ld blocks", label, sim->blocks, sim->extents, sim->seeks, sim->distance);
+    if (p == NULL)
+    {
+        printf("\n");
+        return 0;
+    }
+    //every extent costs one random access, and its blocks stream at the sequential rate
+    double seconds = (sim->extents * p->randReadLatency) + (((double)sim->blocks * blocksize) / p->seqReadBps);
+    printf(", modeled %.6f s\n", seconds);
+    return seconds;
+}
+
+/**
+ * Entry point of the simulate subcommand, which replays whole-file reads
+ * against an image and against its defragmented layout, so the benefit of a
+ * defrag can be weighed before running it. Every file is read in inode order,
+ * or the files of an access trace in trace order; with a trace the planned
+ * layout is the one --trace would produce. Without a second image the layout
+ * is planned in memory.
+ * Usage: simulate [--profile=PATH] [--trace=PATH] <image> [<defragmented image>]
+ * @param argc the number of arguments after the subcommand name
+ * @param argv the arguments after the subcommand name
+ * @return 0 on success
+ */
+int simulateCommand(int argc, char *argv[])
+{
+    char *profileFile = NULL;
+    char *traceFile = NULL;
+    char *paths[2] = {NULL, NULL};
+    //number of image paths given
+    int numPaths = 0;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--profile=", strlen("--profile=")) == 0)
+        {
+            profileFile = argv[i] + strlen("--profile=");
+        }
+        else if (strncmp(argv[i], "--trace=", strlen("--trace=")) == 0)
+        {
+            traceFile = argv[i] + strlen("--trace=");
+        }
+        else if (numPaths < 2 && argv[i][0] != '-')
+        {
+            paths[numPaths++] = argv[i];
+        }
+        else
+        {
+            numPaths = 0;
+            break;
+        }
+    }
+    if (numPaths == 0)
+    {
+        error_msg("Usage: disk-defrag simulate [--profile=PATH] [--trace=PATH] <image> [<defragmented image>]");
+    }
+    size_t size;
+    char *image = mapDiskImage(paths[0], &size);
+    diskLayout d;
+    describeImage(image, size, &d);
+
+    deviceProfile profile;
+    char path[FILENAME_MAX];
+    if (profileFile == NULL)
+    {
+        snprintf(path, sizeof(path), "%s%s", paths[0], PROFILE_SUFFIX);
+    }
+    int haveProfile = loadProfile(profileFile != NULL ? profileFile : path, &profile);
+    if (profileFile != NULL && !haveProfile)
+    {
+        error_msg("Error reading device profile file.");
+    }
+    placementPolicy policy;
+    memset(&policy, 0, sizeof(policy));
+    int *trace = NULL;
+    int traceLength = 0;
+    if (traceFile != NULL)
+    {
+        trace = loadAccessTrace(traceFile, d.totalInodes, &traceLength);
+        policy.order = coAccessOrder(trace, traceLength, d.totalInodes, &policy.orderLength);
+    }
+
+    //the layout to compare against: the second image, or the planned defrag of the first
+    size_t plannedSize = size;
+    char *planned;
+    if (numPaths == 2)
+    {
+        planned = mapDiskImage(paths[1], &plannedSize);
+    }
+    else
+    {
+        char *scratch = malloc(size);
+        planned = malloc(size);
+        if (scratch == NULL || planned == NULL)
+        {
+            error_msg("Allocating memory for the planned layout failed.");
+        }
+        memcpy(scratch, image, size);
+        memcpy(planned, image, size);
+        defragImage(scratch, planned, size, &policy, NULL, NULL, NULL);
+        free(scratch);
+    }
+    diskLayout pd;
+    describeImage(planned, plannedSize, &pd);
+
+    readSimulation current;
+    readSimulation after;
+    simulateTrace(&d, trace, traceLength, &current);
+    simulateTrace(&pd, trace, traceLength, &after);
+    double currentTime = reportSimulation("current", &current, d.blocksize, haveProfile ? &profile : NULL);
+    double afterTime = reportSimulation(numPaths == 2 ? "other" : "planned", &after, pd.blocksize, haveProfile ? &profile : NULL);
+    if (haveProfile && currentTime > 0)
+    {
+        printf("modeled read time %.1f%% lower\n", 100.0 * (currentTime - afterTime) / currentTime);
+    }
+    else if (current.extents > 0)
+    {
+        printf("%.1f%% fewer extents\n", 100.0 * (current.extents - after.extents) / current.extents);
+    }
+
+    if (numPaths == 2)
+    {
+        munmap(planned, plannedSize);
+    }
+    else
+    {
+        free(planned);
+    }
+    free(trace);
+    free(policy.order);
+    munmap(image, size);
+    return 0;
+}
+
+//-----------------------
+// Global: extract
+//-----------------------
+
+/**The most bytes an extract worker reads at once when it has to copy through memory */
+#define EXTRACT_BATCH_SIZE (1024 * 1024)
+/**Number of inodes an extract worker claims at a time */
+#define EXTRACT_INODES_PER_CLAIM 4
+
+/**
+ * A run of a file's data blocks that are contiguous both in the file and in the image
+ */
+typedef struct
+{
+    long logical; /* index within the file of the run's first block */
+    int start;    /* the run's first block in the data region */
+    int length;   /* number of blocks in the run */
+} fileRun;
+
+/**
+ * Holds the runs of one file while its blocks are walked
+ */
+typedef struct
+{
+    fileRun *runs; /* the runs found so far */
+    int numRuns;   /* number of runs */
+    int capacity;  /* size of runs, which doubles as it fills */
+    arena *scratch; /* where runs is allocated */
+} runList;
+
+/**
+ * Holds the image being extracted and the work shared between extract workers
+ */
+typedef struct
+{
+    diskLayout *d;       /* the image, loaded to walk inodes and indirect blocks */
+    int fd;              /* the image, opened to copy data from */
+    const char *path;    /* the image's path, for workers that open it through a backend */
+    int ioBackend;       /* the backend each worker reads through, or IO_AUTO to use fd directly */
+    const char *dir;     /* the directory files are written to */
+    const int *inodes;   /* the inodes to extract */
+    int numInodes;       /* number of inodes to extract */
+    int nextInode;       /* next entry of inodes not yet claimed by a worker */
+    int copyRange;       /* cleared once copy_file_range has failed, so workers stop trying it */
+    long bytes;          /* bytes of file contents written */
+    int failures;        /* number of inodes that could not be extracted */
+    ioLatency *latency;  /* where workers merge their latency histograms when done, or NULL */
+    arena scratch;       /* takes the chunks of each worker's arena when it is done */
+    pthread_mutex_t doneLock; /* held while a finished worker merges into latency and scratch */
+} extractJob;
+
+/**
+ * Visitor that adds a data block to the runs of a file, extending the last
+ * run when the block follows it both in the file and in the image
+ * @param ctx pointer to the runList
+ * @param blockNum the block being visited
+ * @param level the levels of indirection below the block
+ * @param logicalBlock the index of a data block within the file
+ * @return always 0
+ */
+int addFileRun(void *ctx, int blockNum, int level, long logicalBlock)
+{
+    if (level != ZERO_LEVELS)
+    {
+        return 0;
+    }
+    runList *list = ctx;
+    fileRun *last = list->numRuns > 0 ? &list->runs[list->numRuns - 1] : NULL;
+    if (last != NULL && last->logical + last->length == logicalBlock && last->start + last->length == blockNum)
+    {
+        last->length++;
+        return 0;
+    }
+    if (list->numRuns == list->capacity)
+    {
+        int capacity = list->capacity > 0 ? list->capacity * 2 : 16;
+        list->runs = arenaGrow(list->scratch, list->runs, sizeof(fileRun) * list->capacity, sizeof(fileRun) * capacity);
+        list->capacity = capacity;
+    }
+    list->runs[list->numRuns++] = (fileRun){logicalBlock, blockNum, 1};
+    return 0;
+}
+
+/**
+ * Function that copies bytes from the image to an output file, in the kernel
+ * with copy_file_range while that works, and otherwise through a buffer in
+ * batches of up to EXTRACT_BATCH_SIZE bytes, read through the job's I/O
+ * backend when it has one
+ * @param job the extraction
+ * @param source this worker's handle on the image through the job's backend, or NULL
+ * @param out the output file
+ * @param src the offset to copy from in the image
+ * @param dst the offset to copy to in the output file
+ * @param len the number of bytes to copy
+ * @param batch buffer of EXTRACT_BATCH_SIZE bytes
+ * @param latency this worker's latency histograms, or NULL
+ * @return 1 on success, 0 on failure
+ */
+int copyExtent(extractJob *job, ioFile *source, int out, off_t src, off_t dst, size_t len, char *batch, ioLatency *latency)
+{
+    latencyHistogram *readLatency = latency != NULL ? &latency->kinds[LATENCY_READ] : NULL;
+    latencyHistogram *writeLatency = latency != NULL ? &latency->kinds[LATENCY_WRITE] : NULL;
+    while (len > 0 && __atomic_load_n(&job->copyRange, __ATOMIC_RELAXED))
+    {
+        //a kernel copy is counted as a write, since it ends when the data reaches the output
+        uint64_t start = nowNanos();
+        ssize_t n = copy_file_range(job->fd, &src, out, &dst, len, 0);
+        recordLatency(writeLatency, start);
+        if (n <= 0)
+        {
+            //not supported between these files; copy through memory from here on
+            __atomic_store_n(&job->copyRange, 0, __ATOMIC_RELAXED);
+            break;
+        }
+        len -= n;
+    }
+    while (len > 0)
+    {
+        size_t n = len < EXTRACT_BATCH_SIZE ? len : EXTRACT_BATCH_SIZE;
+        uint64_t start = nowNanos();
+        int readOk = source != NULL ? ioTransfer(source, batch, n, src, 0) : pread(job->fd, batch, n, src) == (ssize_t)n;
+        if (source == NULL)
+        {
+            recordLatency(readLatency, start);
+        }
+        start = nowNanos();
+        int writeOk = readOk && pwrite(out, batch, n, dst) == (ssize_t)n;
+        recordLatency(writeLatency, start);
+        if (!writeOk)
+        {
+            return 0;
+        }
+        src += n;
+        dst += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * Function that extracts one inode to <dir>/inode-<m>: each run of its blocks
+ * is copied to the run's place in the file, and the file is then truncated to
+ * the inode's size, which also leaves unallocated blocks as holes
+ * @param job the extraction
+ * @param source this worker's handle on the image through the job's backend, or NULL
+ * @param m the inode number
+ * @param list scratch run list, reused between inodes
+ * @param batch buffer of EXTRACT_BATCH_SIZE bytes
+ * @param latency this worker's latency histograms, or NULL
+ * @return 1 on success, 0 on failure
+ */
+int extractInode(extractJob *job, ioFile *source, int m, runList *list, char *batch, ioLatency *latency)
+{
+    diskLayout *d = job->d;
+    inode *in = inodeAt(d, m);
+    list->numRuns = 0;
+    if (walkInodeBlocks(d->dataRegion, d->blocksize, d->numDataBlocks, in, addFileRun, list) != 0)
+    {
+        printf("inode %d: block pointer outside the data region, not extracted\n", m);
+        return 0;
+    }
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/inode-%d", job->dir, m);
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        printf("inode %d: error creating %s\n", m, path);
+        return 0;
+    }
+    //byte offset of the data region in the image, and the file's size
+    off_t dataStart = d->dataRegion - d->image;
+    off_t fileSize = in->size > 0 ? in->size : 0;
+    int ok = 1;
+    //iteration variable
+    int r = 0;
+    for (r = 0; r < list->numRuns && ok; r++)
+    {
+        fileRun *run = &list->runs[r];
+        off_t dst = (off_t)run->logical * d->blocksize;
+        if (dst >= fileSize)
+        {
+            continue;
+        }
+        //blocks past the end of the file only hold their used part
+        off_t len = (off_t)run->length * d->blocksize;
+        len = dst + len > fileSize ? fileSize - dst : len;
+        ok = copyExtent(job, source, out, dataStart + ((off_t)run->start * d->blocksize), dst, len, batch, latency);
+        //only bytes that were written count toward the reported total and rate
+        if (ok)
+        {
+            __atomic_fetch_add(&job->bytes, len, __ATOMIC_RELAXED);
+        }
+    }
+    ok = ok && ftruncate(out, fileSize) == 0;
+    ok = close(out) == 0 && ok;
+    if (!ok)
+    {
+        printf("inode %d: error writing %s\n", m, path);
+    }
+    return ok;
+}
+
+/**
+ * Function run by each extract worker: claims a few inodes at a time until none are left
+ * @param arg pointer to the extractJob
+ * @return NULL
+ */
+void *extractWorker(void *arg)
+{
+    extractJob *job = (extractJob *)arg;
+    //each worker allocates from its own arena, so workers never contend for memory
+    arena scratch;
+    arenaInit(&scratch);
+    runList list = {NULL, 0, 0, &scratch};
+    char *batch = arenaAlloc(&scratch, EXTRACT_BATCH_SIZE);
+    //each worker records latencies into its own histograms, merged once it is done
+    ioLatency *latency = NULL;
+    if (job->latency != NULL && (latency = calloc(1, sizeof(ioLatency))) == NULL)
+    {
+        error_msg("Allocating memory for extraction failed.");
+    }
+    //backends keep per-file state, so each worker opens the image itself
+    ioFile file;
+    ioFile *source = NULL;
+    if (job->ioBackend != IO_AUTO)
+    {
+        source = &file;
+        if (!ioOpen(source, job->path, job->ioBackend, 0, 0))
+        {
+            error_msg("Error opening disk image file.");
+        }
+        source->latency = latency;
+    }
+    while (1)
+    {
+        //first entry of the group this worker claimed
+        int first = __atomic_fetch_add(&job->nextInode, EXTRACT_INODES_PER_CLAIM, __ATOMIC_RELAXED);
+        if (first >= job->numInodes)
+        {
+            break;
+        }
+        //iteration variable
+        int i = first;
+        for (i = first; i < first + EXTRACT_INODES_PER_CLAIM && i < job->numInodes; i++)
+        {
+            if (!extractInode(job, source, job->inodes[i], &list, batch, latency))
+            {
+                __atomic_fetch_add(&job->failures, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    if (source != NULL)
+    {
+        ioClose(source);
+    }
+    pthread_mutex_lock(&job->doneLock);
+    if (latency != NULL)
+    {
+        mergeLatency(job->latency, latency);
+    }
+    arenaAdopt(&job->scratch, &scratch);
+    pthread_mutex_unlock(&job->doneLock);
+    free(latency);
+    return NULL;
+}
+
+/**
+ * Entry point of the extract subcommand, which writes the contents of inodes
+ * to files named inode-<m> in a directory, each truncated to the inode's size.
+ * Inodes are extracted in parallel by N worker threads (one per processor by default).
+ * With --metrics, the latencies of the reads and writes are reported when done.
+ * Usage: extract [--threads=N] [--inodes=M,M,...] [--io=BACKEND] [--metrics] <image> <directory>
+ * @param argc the number of arguments after the subcommand name
+ * @param argv the arguments after the subcommand name
+ * @return 0 if every inode was extracted, 1 otherwise
+ */
+int extractCommand(int argc, char *argv[])
+{
+    //value of the --threads= option, if given
+    const char *threadsValue = NULL;
+    //value of the --inodes= option, if given
+    char *inodesValue = NULL;
+    //how the image is read
+    int ioBackend = IO_AUTO;
+    //whether to report I/O latencies
+    int reportLatencies = 0;
+    //the image and the output directory
+    char *positional[2] = {NULL, NULL};
+    int numPositional = 0;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--threads=", strlen("--threads=")) == 0)
+        {
+            threadsValue = argv[i] + strlen("--threads=");
+        }
+        else if (strncmp(argv[i], "--inodes=", strlen("--inodes=")) == 0)
+        {
+            inodesValue = argv[i] + strlen("--inodes=");
+        }
+        else if (strncmp(argv[i], "--io=", strlen("--io=")) == 0)
+        {
+            ioBackend = parseIoBackend(argv[i] + strlen("--io="));
+        }
+        else if (strcmp(argv[i], "--metrics") == 0)
+        {
+            reportLatencies = 1;
+        }
+        else if (numPositional < 2 && argv[i][0] != '-')
+        {
+            positional[numPositional++] = argv[i];
+        }
+        else
+        {
+            numPositional = 0;
+            break;
+        }
+    }
+    if (numPositional != 2)
+    {
+        error_msg("Usage: disk-defrag extract [--threads=N] [--inodes=M,M,...] [--io=BACKEND] [--metrics] <image> <directory>");
+    }
+    size_t size;
+    char *image = loadDiskImage(positional[0], ioBackend, &size);
+    diskLayout d;
+    describeImage(image, size, &d);
+
+    //the inodes to extract: those listed, or every inode in use
+    int *inodes = malloc(sizeof(int) * (d.totalInodes + 1));
+    if (inodes == NULL)
+    {
+        error_msg("Allocating memory for extraction failed.");
+    }
+    int numInodes = 0;
+    if (inodesValue != NULL)
+    {
+        //the listed inodes are marked, then taken in inode order, so one named twice
+        //is extracted once and no two workers ever write the same file
+        char *listed = calloc(d.totalInodes + 1, 1);
+        if (listed == NULL)
+        {
+            error_msg("Allocating memory for extraction failed.");
+        }
+        char *p = inodesValue;
+        while (*p != '\0')
+        {
+            char *end;
+            long m = strtol(p, &end, 10);
+            if (end == p || (*end != ',' && *end != '\0') || m < 0 || m >= d.totalInodes)
+            {
+                error_msg("Invalid value for --inodes.");
+            }
+            listed[m] = 1;
+            p = *end == ',' ? end + 1 : end;
+        }
+        for (i = 0; i < d.totalInodes; i++)
+        {
+            inodes[numInodes] = i;
+            numInodes += listed[i];
+        }
+        free(listed);
+    }
+    else
+    {
+        arena scratch;
+        arenaInit(&scratch);
+        inodeTable table;
+        decodeInodeTable(&d, &table, &scratch);
+        for (i = 0; i < table.count; i++)
+        {
+            inodes[numInodes] = i;
+            numInodes += table.nlink[i] > 0;
+        }
+        arenaRelease(&scratch);
+    }
+    if (mkdir(positional[1], 0755) != 0 && errno != EEXIST)
+    {
+        error_msg("Error creating output directory.");
+    }
+
+    extractJob job;
+    memset(&job, 0, sizeof(job));
+    job.d = &d;
+    job.fd = open(positional[0], O_RDONLY);
+    job.dir = positional[1];
+    job.inodes = inodes;
+    job.numInodes = numInodes;
+    //a backend named with --io= does the reads itself instead of copy_file_range
+    job.path = positional[0];
+    job.ioBackend = ioBackend;
+    job.copyRange = ioBackend == IO_AUTO;
+    ioLatency latency;
+    memset(&latency, 0, sizeof(latency));
+    job.latency = reportLatencies ? &latency : NULL;
+    arenaInit(&job.scratch);
+    pthread_mutex_init(&job.doneLock, NULL);
+    if (job.fd < 0)
+    {
+        error_msg("Error opening disk image file.");
+    }
+    double start = nowSeconds();
+    int numThreads = parseThreads(threadsValue, MAX_THREADS);
+    pthread_t threads[MAX_THREADS];
+    for (i = 1; i < numThreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, extractWorker, &job) != 0)
+        {
+            error_msg("Error starting extract worker thread.");
+        }
+    }
+    extractWorker(&job);
+    for (i = 1; i < numThreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = nowSeconds() - start;
+    printf("extracted %d of %d files, %ld bytes in %.3f s (%.1f MB/s)\n", numInodes - job.failures, numInodes, job.bytes, elapsed, elapsed > 0 ? job.bytes / elapsed / 1e6 : 0.0);
+    arenaRelease(&job.scratch);
+    if (reportLatencies)
+    {
+        reportLatency(&latency, stdout);
+        reportArenaUsage(stdout);
+    }
+
+    pthread_mutex_destroy(&job.doneLock);
+    close(job.fd);
+    free(inodes);
+    unloadDiskImage(image, size, ioBackend);
+    return job.failures > 0 ? 1 : 0;
+}
+
+//-----------------------
+// Global: build
+//-----------------------
+
+/**Block size of built images, unless --blocksize= says otherwise */
+#define BUILD_DEFAULT_BLOCKSIZE 512
+/**Size of the stdio buffers a build streams its input files and output image through */
+#define BUILD_STREAM_BUFFER (1024 * 1024)
+
+/**
+ * A host file going into a built image
+ */
+typedef struct
+{
+    char *path;    /* the host file */
+    long size;     /* its size in bytes */
+    struct stat info; /* its stat information, for the inode's metadata */
+} buildFile;
+
+/**
+ * Holds the state of laying out files block by block, either to plan pointers or to write the image
+ */
+typedef struct
+{
+    int blocksize;    /* size of blocks in bytes */
+    int ptrsPerBlock; /* number of pointers that fit in one indirect block */
+    int nextBlock;    /* the next block of the data region to lay out */
+    int dry;          /* nonzero to only plan, without reading or writing anything */
+    FILE *in;         /* the host file being laid out */
+    FILE *out;        /* the image being written */
+    char *block;      /* buffer of blocksize bytes */
+} imageBuilder;
+
+/**
+ * Function that collects the regular files under a directory, recursively
+ * @param dir the directory
+ * @param files the files found so far, grown as needed
+ * @param numFiles the number of files found so far
+ * @param capacity the size of files
+ */
+void collectFiles(const char *dir, buildFile **files, int *numFiles, int *capacity)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        error_msg("Error opening input directory.");
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        char path[FILENAME_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path))
+        {
+            error_msg("Input path is too long.");
+        }
+        struct stat info;
+        if (stat(path, &info) != 0)
+        {
+            error_msg("Error reading input directory.");
+        }
+        if (S_ISDIR(info.st_mode))
+        {
+            collectFiles(path, files, numFiles, capacity);
+        }
+        else if (S_ISREG(info.st_mode))
+        {
+            if (*numFiles == *capacity)
+            {
+                *capacity = *capacity > 0 ? *capacity * 2 : 64;
+                *files = realloc(*files, sizeof(buildFile) * *capacity);
+                if (*files == NULL)
+                {
+                    error_msg("Allocating memory for the file list failed.");
+                }
+            }
+            (*files)[*numFiles].path = strdup(path);
+            (*files)[*numFiles].size = info.st_size;
+            (*files)[*numFiles].info = info;
+            (*numFiles)++;
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * Function that orders build files by path, for qsort
+ * @param x the first file
+ * @param y the second file
+ * @return negative, zero or positive as x sorts before, with or after y
+ */
+int compareBuildFiles(const void *x, const void *y)
+{
+    return strcmp(((const buildFile *)x)->path, ((const buildFile *)y)->path);
+}
+
+/**
+ * Function that reads the host files listed in a manifest, one path per line
+ * @param manifest the manifest file
+ * @param files receives the newly allocated list of files
+ * @return the number of files
+ */
+int readManifest(const char *manifest, buildFile **files)
+{
+    FILE *f = fopen(manifest, "r");
+    if (f == NULL)
+    {
+        error_msg("Error opening manifest file.");
+    }
+    int numFiles = 0;
+    int capacity = 64;
+    *files = malloc(sizeof(buildFile) * capacity);
+    char line[FILENAME_MAX];
+    while (*files != NULL && fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+        if (numFiles == capacity)
+        {
+            capacity *= 2;
+            *files = realloc(*files, sizeof(buildFile) * capacity);
+            if (*files == NULL)
+            {
+                break;
+            }
+        }
+        buildFile *file = &(*files)[numFiles++];
+        if (stat(line, &file->info) != 0 || !S_ISREG(file->info.st_mode))
+        {
+            printf("%s: not a regular file\n", line);
+            exit(EXIT_FAILURE);
+        }
+        file->path = strdup(line);
+        file->size = file->info.st_size;
+    }
+    if (*files == NULL)
+    {
+        error_msg("Allocating memory for the file list failed.");
+    }
+    fclose(f);
+    return numFiles;
+}
+
+/**
+ * Function that counts the blocks a block tree takes when it covers some data blocks
+ * @param b the builder
+ * @param level the levels of indirection below the tree's root
+ * @param numData the number of data blocks under the root
+ * @return the number of blocks, indirect blocks included
+ */
+long treeBlocks(imageBuilder *b, int level, long numData)
+{
+    if (level == ZERO_LEVELS)
+    {
+        return numData;
+    }
+    //number of data blocks under each pointer of the root
+    long span = 1;
+    //iteration variable
+    int j = 0;
+    for (j = 1; j < level; j++)
+    {
+        span *= b->ptrsPerBlock;
+    }
+    //one block for the root, then whole subtrees as long as data remains
+    long count = 1 + ((numData / span) * treeBlocks(b, level - 1, span));
+    return numData % span > 0 ? count + treeBlocks(b, level - 1, numData % span) : count;
+}
+
+/**
+ * Function that lays out a block tree in pre-order, the order defrag uses: the
+ * root, then each subtree in turn. Indirect blocks point to where their
+ * subtrees will go, so nothing has to be revisited once written
+ * @param b the builder
+ * @param level the levels of indirection below the tree's root
+ * @param numData the number of data blocks under the root, at most one for a data block
+ * @return the root's block number
+ */
+int buildBlockTree(imageBuilder *b, int level, long numData)
+{
+    int root = b->nextBlock++;
+    if (level == ZERO_LEVELS)
+    {
+        if (!b->dry)
+        {
+            //the end of the file is padded out with zeros
+            size_t n = fread(b->block, 1, b->blocksize, b->in);
+            memset(&b->block[n], 0, b->blocksize - n);
+            if (fwrite(b->block, b->blocksize, 1, b->out) != 1)
+            {
+                error_msg("Error writing output disk image file.");
+            }
+        }
+        return root;
+    }
+    long span = 1;
+    //iteration variable
+    int j = 0;
+    for (j = 1; j < level; j++)
+    {
+        span *= b->ptrsPerBlock;
+    }
+    if (!b->dry)
+    {
+        //unused pointers are the sentinel
+        memset(b->block, 0xff, b->blocksize);
+        int *ptrs = (int *)b->block;
+        long child = root + 1;
+        long remaining = numData;
+        for (j = 0; remaining > 0; j++)
+        {
+            long n = remaining < span ? remaining : span;
+            ptrs[j] = child;
+            child += treeBlocks(b, level - 1, n);
+            remaining -= n;
+        }
+        if (fwrite(b->block, b->blocksize, 1, b->out) != 1)
+        {
+            error_msg("Error writing output disk image file.");
+        }
+    }
+    long remaining = numData;
+    while (remaining > 0)
+    {
+        long n = remaining < span ? remaining : span;
+        buildBlockTree(b, level - 1, n);
+        remaining -= n;
+    }
+    return root;
+}
+
+/**
+ * Function that lays out a file's blocks in defrag's order: direct blocks,
+ * then each iblock's tree, the i2block's and the i3block's, each used only
+ * once the ones before it are full
+ * @param b the builder
+ * @param in the inode, whose block pointers are filled in
+ * @param numData the number of data blocks the file needs
+ * @return the number of data blocks that did not fit
+ */
+long buildFileBlocks(imageBuilder *b, inode *in, long numData)
+{
+    //number of data blocks reachable through one pointer at each level
+    long spans[] = {1, b->ptrsPerBlock, (long)b->ptrsPerBlock * b->ptrsPerBlock, (long)b->ptrsPerBlock * b->ptrsPerBlock * b->ptrsPerBlock};
+    //the pointers of each level, in layout order
+    int *ptrs[] = {in->dblocks, in->iblocks, &in->i2block, &in->i3block};
+    int counts[] = {N_DBLOCKS, N_IBLOCKS, 1, 1};
+    //iteration variables
+    int level = 0;
+    int i = 0;
+    for (level = ZERO_LEVELS; level <= THREE_LEVELS; level++)
+    {
+        for (i = 0; i < counts[level]; i++)
+        {
+            long n = numData < spans[level] ? numData : spans[level];
+            ptrs[level][i] = n > 0 ? buildBlockTree(b, level, n) : UNUSED_INODE_SENTINEL;
+            numData -= n;
+        }
+    }
+    return numData;
+}
+
+/**
+ * Entry point of the build subcommand, which writes a new, already
+ * defragmented image holding the regular files under a directory (in path
+ * order) or listed in a manifest (in manifest order). Pointers are planned
+ * first; the image is then written front to back in one streaming pass, reading
+ * each input file once, with the unused blocks as a sorted free list.
+ * Usage: build [--blocksize=N] [--inodes=N] [--blocks=N] <directory|manifest> <output>
+ * @param argc the number of arguments after the subcommand name
+ * @param argv the arguments after the subcommand name
+ * @return 0 on success
+ */
+int buildCommand(int argc, char *argv[])
+{
+    int blocksize = BUILD_DEFAULT_BLOCKSIZE;
+    //inodes and data blocks asked for, or 0 for just enough (and a quarter more data blocks)
+    long minInodes = 0;
+    long numDataBlocks = 0;
+    //the input and the output image
+    char *positional[2] = {NULL, NULL};
+    int numPositional = 0;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--blocksize=", strlen("--blocksize=")) == 0)
+        {
+            blocksize = parseCount(argv[i] + strlen("--blocksize="), "--blocksize");
+            if (blocksize < GEN_MIN_BLOCKSIZE || blocksize % sizeof(int) != 0)
+            {
+                error_msg("Block size must be a multiple of 4 and at least 64.");
+            }
+        }
+        else if (strncmp(argv[i], "--inodes=", strlen("--inodes=")) == 0)
+        {
+            minInodes = parseCount(argv[i] + strlen("--inodes="), "--inodes");
+        }
+        else if (strncmp(argv[i], "--blocks=", strlen("--blocks=")) == 0)
+        {
+            numDataBlocks = parseCount(argv[i] + strlen("--blocks="), "--blocks");
+        }
+        else if (numPositional < 2 && argv[i][0] != '-')
+        {
+            positional[numPositional++] = argv[i];
+        }
+        else
+        {
+            numPositional = 0;
+            break;
+        }
+    }
+    if (numPositional != 2)
+    {
+        error_msg("Usage: disk-defrag build [--blocksize=N] [--inodes=N] [--blocks=N] <directory|manifest> <output>");
+    }
+
+    buildFile *files = NULL;
+    int numFiles = 0;
+    struct stat inputInfo;
+    if (stat(positional[0], &inputInfo) != 0)
+    {
+        error_msg("Error opening build input.");
+    }
+    if (S_ISDIR(inputInfo.st_mode))
+    {
+        int capacity = 0;
+        collectFiles(positional[0], &files, &numFiles, &capacity);
+        qsort(files, numFiles, sizeof(buildFile), compareBuildFiles);
+    }
+    else
+    {
+        numFiles = readManifest(positional[0], &files);
+    }
+
+    //the inode region holds every file, and at least one inode
+    long numInodes = numFiles > minInodes ? numFiles : minInodes;
+    numInodes = numInodes > 0 ? numInodes : 1;
+    long inodeBlocks = ((numInodes * INODE_SIZE) + blocksize - 1) / blocksize;
+    numInodes = (inodeBlocks * blocksize) / INODE_SIZE;
+    char *header = calloc(1, BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE + (inodeBlocks * blocksize));
+    if (header == NULL)
+    {
+        error_msg("Allocating memory for the image header failed.");
+    }
+    superblock *sb = (superblock *)&header[SUPERBLOCK_SIZE];
+    inode *inodes = (inode *)&header[BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE];
+
+    //plan every file's pointers, which also gives the blocks the files need
+    imageBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.blocksize = blocksize;
+    b.ptrsPerBlock = blocksize / sizeof(int);
+    b.dry = 1;
+    for (i = 0; i < numFiles; i++)
+    {
+        inode *in = &inodes[i];
+        if (files[i].size > INT32_MAX)
+        {
+            printf("%s: too large for the image format\n", files[i].path);
+            exit(EXIT_FAILURE);
+        }
+        in->nlink = 1;
+        in->protect = files[i].info.st_mode & 07777;
+        in->size = files[i].size;
+        in->uid = files[i].info.st_uid;
+        in->gid = files[i].info.st_gid;
+        in->ctime = files[i].info.st_ctime;
+        in->mtime = files[i].info.st_mtime;
+        in->atime = files[i].info.st_atime;
+        if (buildFileBlocks(&b, in, (files[i].size + blocksize - 1) / blocksize) > 0)
+        {
+            printf("%s: too large for block size %d\n", files[i].path, blocksize);
+            exit(EXIT_FAILURE);
+        }
+    }
+    int usedBlocks = b.nextBlock;
+    numDataBlocks = numDataBlocks > 0 ? numDataBlocks : usedBlocks + ((usedBlocks + 3) / 4);
+    if (numDataBlocks < usedBlocks)
+    {
+        printf("The files need %d data blocks.\n", usedBlocks);
+        exit(EXIT_FAILURE);
+    }
+    //unused inodes form the free inode list in ascending order
+    sb->free_inode = UNUSED_INODE_SENTINEL;
+    for (i = numInodes - 1; i >= numFiles; i--)
+    {
+        memset(inodes[i].dblocks, 0xff, sizeof(int) * (N_DBLOCKS + N_IBLOCKS + 2));
+        inodes[i].next_inode = sb->free_inode;
+        sb->free_inode = i;
+    }
+    sb->blocksize = blocksize;
+    sb->inode_offset = 0;
+    sb->data_offset = inodeBlocks;
+    sb->swap_offset = inodeBlocks + numDataBlocks;
+    sb->free_block = usedBlocks < numDataBlocks ? usedBlocks : UNUSED_INODE_SENTINEL;
+
+    //write the image front to back
+    b.out = fopen(positional[1], "w");
+    b.block = malloc(blocksize);
+    if (b.out == NULL || b.block == NULL)
+    {
+        error_msg("Error opening output disk image file.");
+    }
+    setvbuf(b.out, NULL, _IOFBF, BUILD_STREAM_BUFFER);
+    if (fwrite(header, BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE + (inodeBlocks * blocksize), 1, b.out) != 1)
+    {
+        error_msg("Error writing output disk image file.");
+    }
+    b.dry = 0;
+    b.nextBlock = 0;
+    for (i = 0; i < numFiles; i++)
+    {
+        b.in = fopen(files[i].path, "r");
+        if (b.in == NULL)
+        {
+            printf("%s: cannot be read\n", files[i].path);
+            exit(EXIT_FAILURE);
+        }
+        setvbuf(b.in, NULL, _IOFBF, BUILD_STREAM_BUFFER);
+        inode planned = inodes[i];
+        buildFileBlocks(&b, &planned, (files[i].size + blocksize - 1) / blocksize);
+        fclose(b.in);
+    }
+    //then the free list, each block pointing to the next
+    memset(b.block, FREE_BLOCK_ZERO, blocksize);
+    long blk = 0;
+    for (blk = usedBlocks; blk < numDataBlocks; blk++)
+    {
+        *(int *)b.block = blk + 1 < numDataBlocks ? blk + 1 : UNUSED_INODE_SENTINEL;
+        if (fwrite(b.block, blocksize, 1, b.out) != 1)
+        {
+            error_msg("Error writing output disk image file.");
+        }
+    }
+    if (fclose(b.out) != 0)
+    {
+        error_msg("Error writing output disk image file.");
+    }
+    printf("built %d files into %ld inodes, %d of %ld data blocks used\n", numFiles, numInodes, usedBlocks, numDataBlocks);
+
+    for (i = 0; i < numFiles; i++)
+    {
+        free(files[i].path);
+    }
+    free(files);
+    free(header);
+    free(b.block);
+    return 0;
+}
+
+//-----------------------
+// Global: bench
+//-----------------------
+
+/**Repetitions of each benchmark, unless --reps= says otherwise */
+#define BENCH_DEFAULT_REPS 7
+/**Shortest time each repetition runs its kernel for, unless --min-time= says otherwise, in seconds */
+#define BENCH_DEFAULT_MIN_TIME 0.05
+/**Block size of the synthetic image the scan and walk benchmarks run on */
+#define BENCH_BLOCKSIZE 512
+/**Number of inodes in the synthetic image, about half of them in use */
+#define BENCH_INODES 65536
+/**Number of data blocks under the i2-heavy inode: one full i2block tree */
+#define BENCH_I2_BLOCKS ((BENCH_BLOCKSIZE / 4) * (BENCH_BLOCKSIZE / 4))
+/**Number of data blocks under the i3-heavy inode: four full i2block trees */
+#define BENCH_I3_BLOCKS (4 * BENCH_I2_BLOCKS)
+/**Size of the regions the copy and zeroing benchmarks cycle through, in bytes; larger than most caches */
+#define BENCH_REGION_SIZE (32 * 1024 * 1024)
+
+/**
+ * The state a benchmark kernel runs on
+ */
+typedef struct
+{
+    diskLayout d;      /* the synthetic image, for the scan and walk kernels */
+    char *newImage;    /* the image defrag copies into */
+    int *order;        /* the image's data blocks, in the shuffled order they are handed out */
+    int nextBlock;     /* index in order of the next data block to hand out */
+    uint64_t rng;      /* state of the random number generator */
+    int inodeNum;      /* the inode a walk kernel walks */
+    inode saved;       /* that inode, as it was before defrag rewrote its pointers */
+    int levels;        /* its deepest level of indirection */
+    char *src;         /* the region the copy kernel copies from */
+    char *dst;         /* the region the copy kernel copies to, and the zeroing kernel zeroes */
+    int blocksize;     /* the block size the copy and zeroing kernels work in */
+    int numBlocks;     /* number of blocks in src and dst */
+    int *perm;         /* the shuffled order the copy kernel reads source blocks in */
+    long sink;         /* results kernels fold in so the compiler can't drop their work */
+} benchContext;
+
+/**
+ * Function type of a benchmark kernel, which runs the code under test some number of times
+ * @param c the kernel's state
+ * @param iterations the number of operations to run
+ */
+typedef void (*benchKernel)(benchContext *c, long iterations);
+
+/**
+ * Function that hands out the next data block of the synthetic image, in shuffled order
+ * @param c the benchmark state
+ * @return the block number
+ */
+int benchBlock(benchContext *c)
+{
+    if (c->nextBlock >= c->d.numDataBlocks)
+    {
+        error_msg("Benchmark image ran out of data blocks.");
+    }
+    return c->order[c->nextBlock++];
+}
+
+/**
+ * Function that builds a dense block tree scattered over the synthetic image
+ * @param c the benchmark state
+ * @param level the levels of indirection below the root
+ * @param numData the number of data blocks under the root
+ * @return the root's block number
+ */
+int benchTree(benchContext *c, int level, long numData)
+{
+    int root = benchBlock(c);
+    if (level == ZERO_LEVELS)
+    {
+        return root;
+    }
+    int ptrsPerBlock = c->d.blocksize / sizeof(int);
+    //number of data blocks under each pointer of the root
+    long span = 1;
+    //iteration variable
+    int j = 0;
+    for (j = 1; j < level; j++)
+    {
+        span *= ptrsPerBlock;
+    }
+    int *ptrs = (int *)&c->d.dataRegion[(size_t)root * c->d.blocksize];
+    memset(ptrs, 0xff, c->d.blocksize);
+    for (j = 0; j < ptrsPerBlock && numData > 0; j++)
+    {
+        long n = numData < span ? numData : span;
+        ptrs[j] = benchTree(c, level - 1, n);
+        numData -= n;
+    }
+    return root;
+}
+
+/**
+ * Function that builds the synthetic image: about half of BENCH_INODES inodes
+ * in use, none of them with blocks yet, and room for the walk kernels' trees
+ * @param c the benchmark state to set up
+ */
+void makeBenchImage(benchContext *c)
+{
+    int blocksize = BENCH_BLOCKSIZE;
+    int inodeBlocks = ((BENCH_INODES * INODE_SIZE) + blocksize - 1) / blocksize;
+    //both trees with their indirect blocks, the sentinel scan's blocks, and room to spare
+    int numDataBlocks = ((BENCH_I3_BLOCKS + BENCH_I2_BLOCKS) * 5) / 4;
+    size_t size = (BOOT_BLOCK_SIZE + SUPERBLOCK_SIZE) + ((size_t)(inodeBlocks + numDataBlocks) * blocksize);
+    char *image = calloc(size, 1);
+    c->newImage = malloc(size);
+    c->order = malloc(sizeof(int) * numDataBlocks);
+    if (image == NULL || c->newImage == NULL || c->order == NULL)
+    {
+        error_msg("Allocating memory for the benchmark image failed.");
+    }
+    superblock *sb = (superblock *)&image[SUPERBLOCK_SIZE];
+    sb->blocksize = blocksize;
+    sb->inode_offset = 0;
+    sb->data_offset = inodeBlocks;
+    sb->swap_offset = inodeBlocks + numDataBlocks;
+    sb->free_inode = UNUSED_INODE_SENTINEL;
+    sb->free_block = UNUSED_INODE_SENTINEL;
+    describeImage(image, size, &c->d);
+    c->rng = HASH_PRIME_1;
+    //iteration variable
+    int i = 0;
+    for (i = 0; i < c->d.totalInodes; i++)
+    {
+        inode *in = inodeAt(&c->d, i);
+        memset(in->dblocks, 0xff, sizeof(int) * (N_DBLOCKS + N_IBLOCKS + 2));
+        in->nlink = nextRandom(&c->rng) & 1;
+    }
+    for (i = 0; i < numDataBlocks; i++)
+    {
+        c->order[i] = i;
+    }
+    for (i = numDataBlocks - 1; i > 0; i--)
+    {
+        int j = nextRandom(&c->rng) % (uint64_t)(i + 1);
+        int tmp = c->order[i];
+        c->order[i] = c->order[j];
+        c->order[j] = tmp;
+    }
+    c->nextBlock = 0;
+    memcpy(c->newImage, image, size);
+}
+
+/**
+ * Kernel that scans the inode region for inodes in use
+ * @param c the benchmark state
+ * @param iterations the number of scans
+ */
+void benchInodeScan(benchContext *c, long iterations)
+{
+    arena scratch;
+    arenaInit(&scratch);
+    for (; iterations > 0; iterations--)
+    {
+        int *valid = getValidInodes(c->d.sb->inode_offset, c->d.sb->data_offset, INODE_SIZE, c->d.blocksize, c->d.image, &scratch);
+        c->sink += valid[0];
+        arenaRelease(&scratch);
+    }
+}
+
+/**
+ * Kernel that decodes the inode region into a table and works out every inode's level from its columns
+ * @param c the benchmark state
+ * @param iterations the number of decodes
+ */
+void benchInodeTable(benchContext *c, long iterations)
+{
+    //the table has at most INODE_TABLE_GROUP padding rows
+    signed char *levels = malloc(c->d.totalInodes + INODE_TABLE_GROUP);
+    if (levels == NULL)
+    {
+        error_msg("Allocating memory for the benchmark failed.");
+    }
+    arena scratch;
+    arenaInit(&scratch);
+    for (; iterations > 0; iterations--)
+    {
+        inodeTable table;
+        decodeInodeTable(&c->d, &table, &scratch);
+        classifyInodes(&table, levels);
+        c->sink += levels[0];
+        arenaRelease(&scratch);
+    }
+    free(levels);
+}
+
+/**
+ * Kernel that works out every inode's level from an already decoded table
+ * @param c the benchmark state
+ * @param iterations the number of passes
+ */
+void benchInodeClassify(benchContext *c, long iterations)
+{
+    arena scratch;
+    arenaInit(&scratch);
+    inodeTable table;
+    decodeInodeTable(&c->d, &table, &scratch);
+    signed char *levels = arenaAlloc(&scratch, table.rows);
+    for (; iterations > 0; iterations--)
+    {
+        classifyInodes(&table, levels);
+        c->sink += levels[0];
+    }
+    arenaRelease(&scratch);
+}
+
+/**
+ * Kernel that walks the tree of one inode, visiting every block without copying
+ * @param c the benchmark state
+ * @param iterations the number of walks
+ */
+void benchTreeWalk(benchContext *c, long iterations)
+{
+    for (; iterations > 0; iterations--)
+    {
+        int count = 0;
+        walkInodeBlocks(c->d.dataRegion, c->d.blocksize, c->d.numDataBlocks, &c->saved, countBlock, &count);
+        c->sink += count;
+    }
+}
+
+/**
+ * Kernel that defragments one inode to the start of the data region, restoring
+ * its pointers first since defrag rewrites them
+ * @param c the benchmark state
+ * @param iterations the number of defrags
+ */
+void benchDefragWalk(benchContext *c, long iterations)
+{
+    arena scratch;
+    arenaInit(&scratch);
+    inodeTable table;
+    decodeInodeTable(&c->d, &table, &scratch);
+    int nextFreeGroup = 0;
+    for (; iterations > 0; iterations--)
+    {
+        decodeInodeRow(&table, c->inodeNum, &c->saved);
+        c->sink += defrag(c->d.image, c->newImage, c->levels, c->d.blocksize, c->d.sb->data_offset, 0, &table, c->inodeNum, &nextFreeGroup);
+    }
+    arenaRelease(&scratch);
+}
+
+/**
+ * Kernel that copies blocks from shuffled places in one region to consecutive
+ * places in another, the way defrag gathers a file's blocks
+ * @param c the benchmark state
+ * @param iterations the number of blocks copied
+ */
+void benchBlockCopy(benchContext *c, long iterations)
+{
+    int j = 0;
+    for (; iterations > 0; iterations--)
+    {
+        memcpy(&c->dst[(size_t)j * c->blocksize], &c->src[(size_t)c->perm[j] * c->blocksize], c->blocksize);
+        j = j + 1 < c->numBlocks ? j + 1 : 0;
+    }
+    c->sink += c->dst[0];
+}
+
+/**
+ * Kernel that zeroes consecutive free blocks
+ * @param c the benchmark state
+ * @param iterations the number of blocks zeroed
+ */
+void benchZeroFreeBlock(benchContext *c, long iterations)
+{
+    int j = 0;
+    for (; iterations > 0; iterations--)
+    {
+        zeroFreeBlock(j * c->blocksize, c->blocksize, c->dst);
+        j = j + 1 < c->numBlocks ? j + 1 : 0;
+    }
+    c->sink += c->dst[sizeof(int)];
+}
+
+/**
+ * Kernel that tests consecutive all-zero blocks for being all zero, which reads every byte of each
+ * @param c the benchmark state
+ * @param iterations the number of blocks tested
+ */
+void benchZeroBlockTest(benchContext *c, long iterations)
+{
+    int j = 0;
+    for (; iterations > 0; iterations--)
+    {
+        c->sink += isZeroBlock(&c->dst[j * c->blocksize], c->blocksize);
+        j = j + 1 < c->numBlocks ? j + 1 : 0;
+    }
+}
+
+/**
+ * Function that compares two doubles, for qsort
+ * @param x pointer to the first double
+ * @param y pointer to the second double
+ * @return a negative, zero or positive value as x is less than, equal to or greater than y
+ */
+int compareBenchSamples(const void *x, const void *y)
+{
+    double a = *(const double *)x;
+    double b = *(const double *)y;
+    return (a > b) - (a < b);
+}
+
+/**
+ * Function that runs a benchmark: after a warm-up that picks how many
+ * operations take at least minTime, it times that many operations reps times
+ * and prints the median and fastest time per operation, the spread between
+ * the fastest and slowest repetition, and the throughput at the median
+ * @param name the benchmark's name
+ * @param filter only run the benchmark if its name contains this, or NULL to always run it
+ * @param kernel the code under test
+ * @param c the kernel's state
+ * @param bytesPerOp the bytes one operation processes
+ * @param reps the number of repetitions
+ * @param minTime the shortest time a repetition runs for, in seconds
+ */
+void runBenchmark(const char *name, const char *filter, benchKernel kernel, benchContext *c, double bytesPerOp, int reps, double minTime)
+{
+    if (filter != NULL && strstr(name, filter) == NULL)
+    {
+        return;
+    }
+    //double the operations until a batch takes a tenth of minTime, then scale up to minTime
+    long iterations = 1;
+    double elapsed = 0;
+    while (1)
+    {
+        uint64_t start = nowNanos();
+        kernel(c, iterations);
+        elapsed = (nowNanos() - start) / 1e9;
+        if (elapsed >= minTime / 10 || iterations >= (1L << 40))
+        {
+            break;
+        }
+        iterations *= 2;
+    }
+    if (elapsed < minTime)
+    {
+        iterations = (long)(iterations * (minTime / (elapsed > 0 ? elapsed : minTime))) + 1;
+    }
+    double *samples = malloc(sizeof(double) * reps);
+    if (samples == NULL)
+    {
+        error_msg("Allocating memory for benchmark samples failed.");
+    }
+    //iteration variable
+    int r = 0;
+    for (r = 0; r < reps; r++)
+    {
+        uint64_t start = nowNanos();
+        kernel(c, iterations);
+        samples[r] = (double)(nowNanos() - start) / iterations;
+    }
+    qsort(samples, reps, sizeof(double), compareBenchSamples);
+    double median = reps % 2 == 1 ? samples[reps / 2] : (samples[(reps / 2) - 1] + samples[reps / 2]) / 2;
+    double spread = median > 0 ? 100 * (samples[reps - 1] - samples[0]) / median : 0;
+    printf("%-24s %12.1f %12.1f %7.1f%% %12.1f\n", name, median, samples[0], spread, median > 0 ? bytesPerOp / median * 1e3 : 0.0);
+    free(samples);
+}
+
+/**
+ * Entry point of the bench subcommand, which runs microbenchmarks of the inner
+ * loops of a defrag on synthetic data, each in isolation, so a change to one
+ * of them can be judged on its own: the inode region scan, decoding it into an
+ * inode table and classifying inodes from the table, the sentinel scan
+ * of one indirect block at several densities of used pointers, the copy of a
+ * single block, the zeroing of a free block and the test for an all-zero
+ * block at several block sizes, and
+ * walks and defrags of inodes with full i2block and i3block trees, the defrags
+ * with and without prefetching.
+ * Usage: bench [--reps=N] [--min-time=SECONDS] [--filter=TEXT] [--prefetch=N]
+ * @param argc the number of arguments after the subcommand name
+ * @param argv the arguments after the subcommand name
+ * @return 0 on success
+ */
+int benchCommand(int argc, char *argv[])
+{
+    int reps = BENCH_DEFAULT_REPS;
+    double minTime = BENCH_DEFAULT_MIN_TIME;
+    //only benchmarks whose names contain this are run, if given
+    const char *filter = NULL;
+    //iteration variables
+    int i = 0;
+    int j = 0;
+    for (i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--reps=", strlen("--reps=")) == 0)
+        {
+            reps = parseCount(argv[i] + strlen("--reps="), "--reps");
+            if (reps < 1)
+            {
+                error_msg("Invalid value for --reps.");
+            }
+        }
+        else if (strncmp(argv[i], "--min-time=", strlen("--min-time=")) == 0)
+        {
+            if (!parseDuration(argv[i] + strlen("--min-time="), &minTime) || minTime <= 0)
+            {
+                error_msg("Invalid value for --min-time.");
+            }
+        }
+        else if (strncmp(argv[i], "--filter=", strlen("--filter=")) == 0)
+        {
+            filter = argv[i] + strlen("--filter=");
+        }
+        else if (strncmp(argv[i], "--prefetch=", strlen("--prefetch=")) == 0)
+        {
+            prefetchDistance = parsePrefetchDistance(argv[i] + strlen("--prefetch="));
+        }
+        else
+        {
+            error_msg("Usage: disk-defrag bench [--reps=N] [--min-time=SECONDS] [--filter=TEXT] [--prefetch=N]");
+        }
+    }
+
+    benchContext c;
+    memset(&c, 0, sizeof(c));
+    makeBenchImage(&c);
+    printf("%-24s %12s %12s %8s %12s  (%d repetitions of at least %.3f s)\n", "benchmark", "ns/op", "min ns/op", "spread", "MB/s", reps, minTime);
+    //name of the benchmark being run
+    char name[64];
+
+    runBenchmark("inode-scan", filter, benchInodeScan, &c, (double)c.d.totalInodes * INODE_SIZE, reps, minTime);
+    runBenchmark("inode-table", filter, benchInodeTable, &c, (double)c.d.totalInodes * INODE_SIZE, reps, minTime);
+    runBenchmark("inode-classify", filter, benchInodeClassify, &c, (double)c.d.totalInodes * sizeof(int) * (N_DBLOCKS + N_IBLOCKS + 3), reps, minTime);
+
+    //one inode with a single indirect block, a share of whose pointers are in use
+    int densities[] = {1, 10, 50, 90, 100};
+    int ptrsPerBlock = c.d.blocksize / sizeof(int);
+    c.inodeNum = 0;
+    inode *in = inodeAt(&c.d, c.inodeNum);
+    in->nlink = 1;
+    in->iblocks[0] = benchBlock(&c);
+    int *ptrs = (int *)&c.d.dataRegion[(size_t)in->iblocks[0] * c.d.blocksize];
+    int dataBlocks[BENCH_BLOCKSIZE / sizeof(int)];
+    for (j = 0; j < ptrsPerBlock; j++)
+    {
+        dataBlocks[j] = benchBlock(&c);
+    }
+    for (i = 0; i < (int)(sizeof(densities) / sizeof(densities[0])); i++)
+    {
+        for (j = 0; j < ptrsPerBlock; j++)
+        {
+            ptrs[j] = (int)(nextRandom(&c.rng) % 100) < densities[i] ? dataBlocks[j] : UNUSED_INODE_SENTINEL;
+        }
+        c.saved = *in;
+        snprintf(name, sizeof(name), "sentinel-scan/%d%%", densities[i]);
+        runBenchmark(name, filter, benchTreeWalk, &c, c.d.blocksize, reps, minTime);
+    }
+
+    //inodes whose blocks hang almost all under the i2block, or the i3block
+    for (c.levels = TWO_LEVELS; c.levels <= THREE_LEVELS; c.levels++)
+    {
+        c.inodeNum = c.levels - 1;
+        in = inodeAt(&c.d, c.inodeNum);
+        in->nlink = 1;
+        long numData = c.levels == TWO_LEVELS ? BENCH_I2_BLOCKS : BENCH_I3_BLOCKS;
+        *(c.levels == TWO_LEVELS ? &in->i2block : &in->i3block) = benchTree(&c, c.levels, numData);
+        c.saved = *in;
+        //a walk reads only the indirect blocks, and a defrag copies every block
+        costWalk walk;
+        memset(&walk, 0, sizeof(walk));
+        walk.sim.prevBlock = -1;
+        walkInodeBlocks(c.d.dataRegion, c.d.blocksize, c.d.numDataBlocks, in, measureCostBlock, &walk);
+        snprintf(name, sizeof(name), "walk-i%dblock", c.levels);
+        runBenchmark(name, filter, benchTreeWalk, &c, (double)walk.indirect * c.d.blocksize, reps, minTime);
+        //the defrag runs without prefetching, then with the configured distance
+        int distance = prefetchDistance;
+        prefetchDistance = 0;
+        snprintf(name, sizeof(name), "defrag-i%dblock/prefetch=0", c.levels);
+        runBenchmark(name, filter, benchDefragWalk, &c, (double)walk.sim.blocks * c.d.blocksize, reps, minTime);
+        prefetchDistance = distance;
+        if (distance > 0)
+        {
+            snprintf(name, sizeof(name), "defrag-i%dblock/prefetch=%d", c.levels, distance);
+            runBenchmark(name, filter, benchDefragWalk, &c, (double)walk.sim.blocks * c.d.blocksize, reps, minTime);
+        }
+        memcpy(in, &c.saved, sizeof(inode));
+    }
+    free(c.d.image);
+    free(c.newImage);
+    free(c.order);
+
+    //a block copied from a random place, a free block zeroed, and a zero block tested, at each block size
+    int blocksizes[] = {512, 1024, 2048, 4096};
+    c.src = malloc(BENCH_REGION_SIZE);
+    c.dst = malloc(BENCH_REGION_SIZE);
+    c.perm = malloc(sizeof(int) * (BENCH_REGION_SIZE / blocksizes[0]));
+    if (c.src == NULL || c.dst == NULL || c.perm == NULL)
+    {
+        error_msg("Allocating memory for the benchmark regions failed.");
+    }
+    memset(c.src, 0x5a, BENCH_REGION_SIZE);
+    memset(c.dst, 0, BENCH_REGION_SIZE);
+    for (i = 0; i < (int)(sizeof(blocksizes) / sizeof(blocksizes[0])); i++)
+    {
+        c.blocksize = blocksizes[i];
+        c.numBlocks = BENCH_REGION_SIZE / c.blocksize;
+        for (j = 0; j < c.numBlocks; j++)
+        {
+            c.perm[j] = j;
+        }
+        for (j = c.numBlocks - 1; j > 0; j--)
+        {
+            int k = nextRandom(&c.rng) % (uint64_t)(j + 1);
+            int tmp = c.perm[j];
+            c.perm[j] = c.perm[k];
+            c.perm[k] = tmp;
+        }
+        snprintf(name, sizeof(name), "block-copy/%d", c.blocksize);
+        runBenchmark(name, filter, benchBlockCopy, &c, c.blocksize, reps, minTime);
+        snprintf(name, sizeof(name), "zero-free-block/%d", c.blocksize);
+        runBenchmark(name, filter, benchZeroFreeBlock, &c, c.blocksize - sizeof(int), reps, minTime);
+        //the copies left data in the region, and the sparse writer's worst case is a block that is all zero
+        memset(c.dst, 0, BENCH_REGION_SIZE);
+        snprintf(name, sizeof(name), "zero-test/%d", c.blocksize);
+        runBenchmark(name, filter, benchZeroBlockTest, &c, c.blocksize, reps, minTime);
+    }
+    free(c.src);
+    free(c.dst);
+    free(c.perm);
+    return 0;
+}
+
+//-----------------------
+// Global: main
+//-----------------------
+
+/**
+ * Main entry point of the program
+ * @param argc the number of arguments given
+ * @param argv array of pointers to first character of 
+ * each space-separated command-line argument
+ * @return 0 on successful exit of the program and a different value
+ * upon non-successful exit.
+ */
+int main(int argc, char *argv[])
+{
+    //hand off to a subcommand if one was named
+    if (argc >= 2 && strcmp(argv[1], "dump") == 0)
+    {
+        return dumpCommand(argc - 2, &argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "diff") == 0)
+    {
+        return diffCommand(argc - 2, &argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "analyze") == 0)
+    {
+        return analyzeCommand(argc - 2, &argv[2], 1);
+    }
+    if (argc >= 2 && strcmp(argv[1], "index") == 0)
+    {
+        return analyzeCommand(argc - 2, &argv[2], 0);
+    }
+    if (argc >= 2 && strcmp(argv[1], "simulate") == 0)
+    {
+        return simulateCommand(argc - 2, &argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "extract") == 0)
+    {
+        return extractCommand(argc - 2, &argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "build") == 0)
+    {
+        return buildCommand(argc - 2, &argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "calibrate") == 0)
+    {
+        return calibrateCommand(argc - 2, &argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "generate") == 0)
+    {
+        return generateCommand(argc - 2, &argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+    {
+        return benchCommand(argc - 2, &argv[2]);
+    }
+
+    //path of the disk image to defragment
+    char *diskImageFile = NULL;
+    //path to write the defragmented image to, if given with --output=
+    char *outputFile = NULL;
+    //whether to write a block index for the output image
+    int writeIndex = 0;
+    //path of the previous run's block index, if defragmenting incrementally
+    char *incrementalIndex = NULL;
+    //limits on the bandwidth and operation rate of reading and writing the images
+    ioThrottle throttle;
+    initThrottle(&throttle);
+    //how to read the input image, and the device profile to choose with
+    int strategy = STRATEGY_AUTO;
+    char *profileFile = NULL;
+    //constraints on where files are placed
+    placementPolicy policy;
+    memset(&policy, 0, sizeof(policy));
+    policy.slackWindow = SLACK_DEFAULT_WINDOW;
+    policy.now = time(NULL);
+    //access trace to order files by
+    char *traceFile = NULL;
+    //how image files are read and written
+    int ioBackend = IO_AUTO;
+    //where per-phase metrics are reported: "-" for standard output, or NULL for nowhere
+    char *metricsFile = NULL;
+    perfMetrics metrics;
+    //whether all-zero data blocks may be left as holes in the output file
+    int sparse = 1;
+    //the most expensive inodes to defragment, when --top= asked for them
+    costHeap topInodes = {NULL, 0, 0};
+    //iteration variable
+    int arg = 1;
+    for (arg = 1; arg < argc; arg++)
+    {
+        if (strncmp(argv[arg], "--output=", strlen("--output=")) == 0)
+        {
+            outputFile = argv[arg] + strlen("--output=");
+        }
+        else if (strcmp(argv[arg], "--index") == 0)
+        {
+            writeIndex = 1;
+        }
+        else if (strcmp(argv[arg], "--no-sparse") == 0)
+        {
+            sparse = 0;
+        }
+        else if (strcmp(argv[arg], "--incremental") == 0 || strncmp(argv[arg], "--incremental=", strlen("--incremental=")) == 0)
+        {
+            //an incremental run writes an index so the next run can be incremental too
+            writeIndex = 1;
+            incrementalIndex = argv[arg] + strlen("--incremental");
+            incrementalIndex += *incrementalIndex == '=' ? 1 : 0;
+        }
+        else if (strncmp(argv[arg], "--profile=", strlen("--profile=")) == 0)
+        {
+            profileFile = argv[arg] + strlen("--profile=");
+        }
+        else if (strcmp(argv[arg], "--strategy=auto") == 0 || strcmp(argv[arg], "--strategy=sequential") == 0 || strcmp(argv[arg], "--strategy=extents") == 0)
+        {
+            strategy = argv[arg][strlen("--strategy=")] == 'a' ? STRATEGY_AUTO : argv[arg][strlen("--strategy=")] == 's' ? STRATEGY_SEQUENTIAL : STRATEGY_EXTENTS;
+        }
+        else if (strncmp(argv[arg], "--align=", strlen("--align=")) == 0 || strncmp(argv[arg], "--align-min=", strlen("--align-min=")) == 0)
+        {
+            double value;
+            if (!parseSize(strchr(argv[arg], '=') + 1, &value))
+            {
+                error_msg("Invalid value for --align or --align-min.");
+            }
+            *(argv[arg][strlen("--align")] == '=' ? &policy.alignBytes : &policy.alignMinBytes) = value;
+        }
+        else if (strncmp(argv[arg], "--slack=", strlen("--slack=")) == 0)
+        {
+            char *end;
+            double value = strtod(argv[arg] + strlen("--slack="), &end);
+            if (end == argv[arg] + strlen("--slack=") || value < 0 || (*end != '\0' && strcmp(end, "%") != 0))
+            {
+                error_msg("Invalid value for --slack.");
+            }
+            policy.slackBlocks = *end == '%' ? 0 : (long)value;
+            policy.slackPercent = *end == '%' ? value : 0;
+        }
+        else if (strncmp(argv[arg], "--slack-window=", strlen("--slack-window=")) == 0)
+        {
+            double value;
+            if (!parseDuration(argv[arg] + strlen("--slack-window="), &value))
+            {
+                error_msg("Invalid value for --slack-window.");
+            }
+            policy.slackWindow = value;
+        }
+        else if (strncmp(argv[arg], "--trace=", strlen("--trace=")) == 0)
+        {
+            traceFile = argv[arg] + strlen("--trace=");
+        }
+        else if (strncmp(argv[arg], "--io=", strlen("--io=")) == 0)
+        {
+            ioBackend = parseIoBackend(argv[arg] + strlen("--io="));
+        }
+        else if (strncmp(argv[arg], "--top=", strlen("--top=")) == 0)
+        {
+            char *end;
+            long value = strtol(argv[arg] + strlen("--top="), &end, 10);
+            if (end == argv[arg] + strlen("--top=") || *end != '\0' || value < 1 || value > MAX_TOP_INODES)
+            {
+                error_msg("Invalid value for --top.");
+            }
+            free(topInodes.entries);
+            topInodes.capacity = value;
+            topInodes.entries = malloc(sizeof(inodeCost) * value);
+            if (topInodes.entries == NULL)
+            {
+                error_msg("Allocating memory for --top failed.");
+            }
+        }
+        else if (strcmp(argv[arg], "--metrics") == 0 || strncmp(argv[arg], "--metrics=", strlen("--metrics=")) == 0)
+        {
+            metricsFile = argv[arg][strlen("--metrics")] == '=' ? argv[arg] + strlen("--metrics=") : "-";
+        }
+        else if (strncmp(argv[arg], "--prefetch=", strlen("--prefetch=")) == 0)
+        {
+            prefetchDistance = parsePrefetchDistance(argv[arg] + strlen("--prefetch="));
+        }
+        else if (strncmp(argv[arg], "--throttle-file=", strlen("--throttle-file=")) == 0)
+        {
+            throttle.controlFile = argv[arg] + strlen("--throttle-file=");
+            throttle.enabled = 1;
+        }
+        else if (strncmp(argv[arg], "--", 2) == 0 && applyThrottleSetting(&throttle, argv[arg] + 2))
+        {
+            //--read-bw=, --write-bw=, --iops= and --adaptive-latency= were applied
+        }
+        else if (diskImageFile == NULL && argv[arg][0] != '-')
+        {
+            diskImageFile = argv[arg];
+        }
+        else
+        {
+            error_msg("Invalid command line arguments!");
+        }
+    }
+    //check that number of arguments is valid
+    if (diskImageFile == NULL)
+    {
+        error_msg("Invalid number of command line arguments!");
+    }
+
+    //Steps: read in disk image, then get size of disk image using stat() system call
+
+    // stat struct that will hold information about file
+    struct stat fileInfo;
+    
+    int rc = stat(diskImageFile, &fileInfo);
+    //error-handling for file having invalid stat() return
+    if (rc != 0)
+    {
+        error_msg("Error determing disk image size.");
+    }
+
+    //  allocate enough space for the disk image
+    //the image, opened through the chosen I/O backend
+    ioFile f;
+    //open file for reading
+    if (!ioOpen(&f, diskImageFile, ioBackend, 0, 0))
+    {
+        error_msg("Error reading disk image file.");
+    }
+    //phases are only sampled, and I/O latencies only recorded, when metrics were asked for
+    perfMetrics *phases = NULL;
+    ioLatency latency;
+    memset(&latency, 0, sizeof(latency));
+    if (metricsFile != NULL)
+    {
+        initMetrics(&metrics);
+        phases = &metrics;
+        f.latency = &latency;
+    }
+    //read in the disk image file, paced by the throttle if one was asked for
+    startThrottle(&throttle);
+    beginPhase(phases);
+    char *buffer = loadImage(&f, diskImageFile, &fileInfo, strategy, profileFile, &throttle);
+    ioClose(&f);
+    endPhase(phases, PHASE_READ);
+
+    //allocate a new buffer representing the new disk image
+    char *newBuffer = malloc(fileInfo.st_size);
+
+    //copy entire original buffer
+    beginPhase(phases);
+    memcpy(&newBuffer[0], &buffer[0], fileInfo.st_size);
+    endPhase(phases, PHASE_BUFFER_COPY);
+
+    //block index of the output image, if one is being written
+    blockIndex outIndex;
+    //defragment only what changed since the last run if asked to, falling back to a full defrag
+    char indexPath[FILENAME_MAX];
+    blockIndexPath(incrementalIndex, diskImageFile, indexPath);
+    int incremental = incrementalIndex != NULL && incrementalDefrag(buffer, newBuffer, fileInfo.st_size, &fileInfo, indexPath, &outIndex);
+    if (!incremental)
+    {
+        //lay files read together next to each other, and measure the reads before and after
+        int *trace = NULL;
+        int traceLength = 0;
+        readSimulation before;
+        diskLayout inLayout;
+        if (traceFile != NULL)
+        {
+            describeImage(buffer, fileInfo.st_size, &inLayout);
+            trace = loadAccessTrace(traceFile, inLayout.totalInodes, &traceLength);
+            policy.order = coAccessOrder(trace, traceLength, inLayout.totalInodes, &policy.orderLength);
+            simulateTrace(&inLayout, trace, traceLength, &before);
+        }
+        defragImage(buffer, newBuffer, fileInfo.st_size, &policy, phases, topInodes.capacity > 0 ? &topInodes : NULL, writeIndex ? &outIndex : NULL);
+        if (traceFile != NULL)
+        {
+            readSimulation after;
+            diskLayout outLayout;
+            describeImage(newBuffer, fileInfo.st_size, &outLayout);
+            simulateTrace(&outLayout, trace, traceLength, &after);
+            printf("trace: %d accesses; read distance %ld blocks in %ld seeks before, %ld blocks in %ld seeks after\n",
+                   traceLength, before.distance, before.seeks, after.distance, after.seeks);
+            free(trace);
+            free(policy.order);
+        }
+    }
+    //only a full defrag measures each inode it moves
+    if (topInodes.capacity > 0 && incremental)
+    {
+        printf("top: not measured, an incremental run only moves the inodes that changed\n");
+    }
+    else if (topInodes.capacity > 0)
+    {
+        reportInodeCosts(&topInodes, stdout);
+    }
+    free(topInodes.entries);
+
+    //write new buffer out to a file named disk_defrag_k, where k is
+    //the number of the original disk image file, unless --output= named a file -- use fwrite for this
+    ioFile newFile;
+    char * diskImageFileNumPtr = &diskImageFile[strlen(diskImageFile) - 1];
+    char filename_part[FILENAME_MAX] = "output-disk-image/disk-defrag-";
+    char * filename = outputFile != NULL ? outputFile : strcat(filename_part, diskImageFileNumPtr);
+    if (!ioOpen(&newFile, filename, ioBackend, 1, fileInfo.st_size))
+    {
+        error_msg("Error opening output disk image file.");
+    }
+    newFile.latency = f.latency;
+    //holes only work in a regular file, which ioOpen has just truncated; a device must be written in full
+    struct stat newFileInfo;
+    sparse = sparse && fstat(newFile.fd, &newFileInfo) == 0 && S_ISREG(newFileInfo.st_mode) && newFileInfo.st_blksize > 0;
+    //all-zero bytes of the data region left out of the output
+    size_t holeBytes = 0;
+    beginPhase(phases);
+    int written = sparse ? writeSparse(&newFile, newBuffer, fileInfo.st_size, newFileInfo.st_blksize, &throttle, &holeBytes) : writeThrottled(&newFile, newBuffer, 0, fileInfo.st_size, &throttle);
+    if (!written || !ioClose(&newFile))
+    {
+        error_msg("Error writing output disk image file.");
+    }
+    endPhase(phases, PHASE_WRITE);
+    if (throttle.enabled)
+    {
+        printf("throttle: waited %.2f s for tokens, ended at %.0f%% of the configured rates\n", throttle.waited, throttle.scale * 100);
+    }
+    if (phases != NULL)
+    {
+        FILE *out = strcmp(metricsFile, "-") == 0 ? stdout : fopen(metricsFile, "w");
+        if (out == NULL)
+        {
+            error_msg("Error opening metrics file.");
+        }
+        reportMetrics(phases, out);
+        reportLatency(&latency, out);
+        reportArenaUsage(out);
+        fprintf(out, "prefetch: distance %d, %ld blocks prefetched\n", prefetchDistance, prefetchedBlocks);
+        if (sparse)
+        {
+            diskLayout outLayout;
+            describeImage(newBuffer, fileInfo.st_size, &outLayout);
+            fprintf(out, "sparse: %zu bytes in %ld-byte units left as holes (%zu data blocks)\n", holeBytes, (long)newFileInfo.st_blksize, holeBytes / outLayout.blocksize);
+        }
+        if (out != stdout && fclose(out) != 0)
+        {
+            error_msg("Error writing metrics file.");
+        }
+    }
+
+    //key the output's block index to the file just written
+    if (writeIndex)
+    {
+        struct stat outputInfo;
+        if (stat(filename, &outputInfo) != 0)
+        {
+            error_msg("Error determing output disk image size.");
+        }
+        diskLayout outLayout;
+        describeImage(newBuffer, fileInfo.st_size, &outLayout);
+        keyBlockIndex(&outIndex, &outLayout, &outputInfo);
+        blockIndexPath(NULL, filename, indexPath);
+        saveBlockIndex(&outIndex, indexPath);
+        freeBlockIndex(&outIndex);
+    }
+
+    //free resources
+    free(buffer);
+    free(newBuffer);
+
+    return 0;
 }
\ No newline at end of file
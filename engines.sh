@@ -0,0 +1,14 @@
+# Engines the check and fuzz harnesses run, and the options that select each
+# one. Sourced by check.sh and fuzz.sh; "default" is the reference every other
+# engine must match byte for byte.
+
+ALL_ENGINES="default io-buffer io-mmap io-pread io-direct io-uring"
+
+# Prints the command-line options that select an engine.
+engine_args() {
+    case "$1" in
+    default) echo "" ;;
+    io-*) echo "--io=${1#io-}" ;;
+    *) echo "unknown engine: $1" >&2; return 2 ;;
+    esac
+}